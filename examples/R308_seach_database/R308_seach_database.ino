@@ -16,7 +16,7 @@
  */
 SoftwareSerial fserial(2, 3);
 
-FPM finger(&fserial);
+FPM finger(&fserial, FPMSensorFamily::R308);
 FPMSystemParams params;
 
 /* for convenience */
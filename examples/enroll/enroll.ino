@@ -78,31 +78,25 @@ void loop()
 
 bool getFreeId(int16_t * fid) 
 {
-    for (int page = 0; page < (params.capacity / FPM_TEMPLATES_PER_PAGE) + 1; page++) 
+    /* searches every page of the database at once */
+    FPMStatus status = finger.getFreeId(fid);
+    
+    if (status != FPMStatus::OK)
     {
-        FPMStatus status = finger.getFreeIndex(page, fid);
-        
-        switch (status) 
-        {
-            case FPMStatus::OK:
-                if (*fid != -1) {
-                    Serial.print("Free slot at ID ");
-                    Serial.println(*fid);
-                    return true;
-                }
-                break;
-                
-            default:
-                snprintf(printfBuf, PRINTF_BUF_SZ, "getFreeIndex(%d): error 0x%X", page, static_cast<uint16_t>(status));
-                Serial.println(printfBuf);
-                return false;
-        }
-        
-        yield();
+        snprintf(printfBuf, PRINTF_BUF_SZ, "getFreeId: error 0x%X", static_cast<uint16_t>(status));
+        Serial.println(printfBuf);
+        return false;
     }
     
-    Serial.println("No free slots!");
-    return false;
+    if (*fid == -1)
+    {
+        Serial.println("No free slots!");
+        return false;
+    }
+    
+    Serial.print("Free slot at ID ");
+    Serial.println(*fid);
+    return true;
 }
 
 bool enrollFinger(int16_t fid) 
@@ -1,5 +1,6 @@
 #include <SoftwareSerial.h>
 #include <fpm.h>
+#include <fpm_image.h>
 
 /* Send a fingerprint image to a PC.
  *
@@ -15,13 +16,17 @@ SoftwareSerial fserial(2, 3);
 FPM finger(&fserial);
 FPMSystemParams params;
 
+/* Expands the image into a complete BMP file, on its way to the PC */
+FPMImageWriter bmpWriter(&Serial, FPMImageFormat::BMP);
+
 /* for convenience */
 #define PRINTF_BUF_SZ   60
 char printfBuf[PRINTF_BUF_SZ];
 
 void setup()
 {
-    Serial.begin(57600);
+    /* every byte from the sensor becomes 2 pixels, so the PC link must be at least twice as fast */
+    Serial.begin(115200);
     fserial.begin(57600);
     
     Serial.println("IMAGE-TO-PC example");
@@ -93,17 +98,18 @@ uint32_t imageToPc(void)
 
     /* Send some arbitrary signature to the PC, to indicate the start of the image stream */
     Serial.write(0xAA);
+    bmpWriter.begin();
     
     uint32_t totalRead = 0;
     uint16_t readLen = 0;
     
     /* Now, the sensor will send us the image from its image buffer, one packet at a time.
-     * We will stream it directly to Serial. */
+     * We will stream it directly to Serial, as a BMP file. */
     bool readComplete = false;
 
     while (!readComplete) 
     {
-        bool ret = finger.readDataPacket(NULL, &Serial, &readLen, &readComplete);
+        bool ret = finger.readDataPacket(NULL, &bmpWriter, &readLen, &readComplete);
         
         if (!ret)
         {
@@ -117,6 +123,8 @@ uint32_t imageToPc(void)
         yield();
     }
 
+    bmpWriter.end();
+
     Serial.println();
     Serial.print(totalRead); Serial.println(" bytes transferred.");
     return totalRead;
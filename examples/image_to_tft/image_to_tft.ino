@@ -11,6 +11,7 @@
 #endif
 
 #include <fpm.h>
+#include <fpm_image.h>
 
 #include <SPI.h>
 #include <TFT_eSPI.h>
@@ -43,12 +44,10 @@ char printfBuf[PRINTF_BUF_SZ];
 
 /*  The scaling ((mult/div)^2) applied to the original image area, when drawing it.
     e.g. When mult == 1 and div == 2, the drawn image will occupy IMAGE_WIDTH/2 by IMAGE_HEIGHT/2 pixels on the display,
-    always preserving the aspect ratio.
+    always preserving the aspect ratio. Each drawn pixel is the average of the sensor's pixels it covers.
 
     This is useful when the TFT display is not large enough to hold the entire image
     (e.g. 240x320 TFT cannot display 256x288 fingerprint).
-
-    To function properly, div must be a factor of both IMAGE_WIDTH*mul and IMAGE_HEIGHT*mul.
 */
 #define IMAGE_SCALING_MULT  3
 #define IMAGE_SCALING_DIV   4
@@ -57,7 +56,7 @@ char printfBuf[PRINTF_BUF_SZ];
 const uint16_t BG_COLOUR = tft.color565(0, 25, 0);
 
 /*  Define a special kind of Stream which writes to the TFT directly,
-    as each chunk/packet of image data is read from the sensor. */
+    as each chunk of pixels is passed on by the image writer (below). */
     
 class TftStream : public Stream
 {
@@ -65,12 +64,12 @@ class TftStream : public Stream
 
         TftStream(bool raw) : startx(0), starty(0),
                               canvasWidth(0), canvasHeight(0), 
-                              pixelCount(0), rawMode(raw)
+                              rawMode(raw)
         {
 
         }
 
-        void resetCanvas(void)
+        void resetCanvas(uint16_t width, uint16_t height)
         {
             /* Clear the existing canvas, if any */
             if (canvasWidth != 0 && canvasHeight != 0)
@@ -79,14 +78,12 @@ class TftStream : public Stream
             }
 
             /* Setup the bounds of the canvas. Make sure to center the image. */
-            canvasWidth = IMAGE_WIDTH * IMAGE_SCALING_MULT / IMAGE_SCALING_DIV;
-            canvasHeight = IMAGE_HEIGHT * IMAGE_SCALING_MULT / IMAGE_SCALING_DIV;
+            canvasWidth = width;
+            canvasHeight = height;
             
             startx = (TFT_WIDTH / 2) - (canvasWidth / 2);
             starty = (TFT_HEIGHT / 2) - (canvasHeight / 2);
 
-            pixelCount = 0;
-
             tft.fillRect(startx, starty, canvasWidth, canvasHeight, BG_COLOUR);
             tft.setAddrWindow(startx, starty, canvasWidth, canvasHeight);
         }
@@ -116,46 +113,18 @@ class TftStream : public Stream
         
         size_t write(const uint8_t *chunk, size_t chunkLen)
         {            
+            /* Each byte is one 8-bit grayscale pixel, already scaled, row by row */
             for (int i = 0; i < chunkLen; i++)
             {
                 /*  Convert the colour in grayscale to RGB565. */
-                uint16_t colour = bmpToTftColour(chunk[i]);
-
-                /* According to the datasheets, each received byte is a lossily-compressed value,
-                 * holding part of the colour information for 2 adjacent pixels in the same row.
-                 * i.e. Upper nibble = Upper nibble of Pixel X, Lower nibble = Lower nibble of Pixel X + 1,
-                 * where X must be even in the range [0, IMAGE_WIDTH).
-
-                 * So, for simplicity, assume that both pixels were originally close enough in colour,
-                 * to now be assigned the same colour.
-
-                /* Push Pixel X, after applying scaling. */
-                uint16_t row = pixelCount / IMAGE_WIDTH;
-                uint16_t column = pixelCount % IMAGE_WIDTH;
-
-                if ((row % IMAGE_SCALING_DIV) < IMAGE_SCALING_MULT && (column % IMAGE_SCALING_DIV) < IMAGE_SCALING_MULT)
-                {
-                    tft.pushColor(colour);
-                }
-
-                pixelCount++;
-
-                /* Push Pixel X+1, after applying scaling. */
-                row = pixelCount / IMAGE_WIDTH;
-                column = pixelCount % IMAGE_WIDTH;
-                if ((row % IMAGE_SCALING_DIV) < IMAGE_SCALING_MULT && (column % IMAGE_SCALING_DIV) < IMAGE_SCALING_MULT)
-                {
-                    tft.pushColor(colour);
-                }
-
-                pixelCount++;
+                tft.pushColor(bmpToTftColour(chunk[i]));
             }
 
             return chunkLen;
         }
 
         /* Dummy implementations to satisfy compiler */
-        size_t write(uint8_t n) { return 0; }
+        size_t write(uint8_t n) { return write(&n, 1); }
         int available(void) { return 0; }
         int read(void) { return 0; }
         int peek(void) { return 0; }
@@ -166,7 +135,6 @@ class TftStream : public Stream
         int starty;
         uint16_t canvasWidth;
         uint16_t canvasHeight;
-        uint32_t pixelCount;
         bool rawMode;
 };
 
@@ -176,6 +144,12 @@ class TftStream : public Stream
  */
 TftStream tftStream(false);
 
+/* Expands the sensor's 4-bit pixels and scales them down, on their way to the TFT */
+FPMImageWriter imageWriter(&tftStream, FPMImageFormat::RAW, IMAGE_WIDTH, IMAGE_HEIGHT);
+
+/* Checks the quality of the image on its way to the writer, to see if the finger should be placed again */
+FPMImageQuality imageQuality(&imageWriter, IMAGE_WIDTH, IMAGE_HEIGHT);
+
 void setup()
 {
     Serial.begin(57600);
@@ -204,6 +178,8 @@ void setup()
     tft.setRotation(0); /* Portrait */
 
     tft.fillScreen(BG_COLOUR);
+
+    imageWriter.setScale(IMAGE_SCALING_MULT, IMAGE_SCALING_DIV);
 }
 
 void loop()
@@ -245,7 +221,7 @@ uint32_t imageToTft(void)
     while (status != FPMStatus::OK);
 
     /* Prepare the canvas */
-    tftStream.resetCanvas();
+    tftStream.resetCanvas(imageWriter.outputWidth(), imageWriter.outputHeight());
 
     /* Initiate the image transfer */
     status = finger.downloadImage();
@@ -270,11 +246,13 @@ uint32_t imageToTft(void)
 
     /* Now, the sensor will send us the image from its image buffer, one packet at a time */
     bool readComplete = false;
+    imageWriter.begin();
+    imageQuality.begin();
 
     while (!readComplete)
     {
-        /* The library will write the data directly into the TFT stream/display */
-        bool ret = finger.readDataPacket(NULL, &tftStream, &readLen, &readComplete);
+        /* The library will write the data through the quality check and image writer, and from there to the TFT stream/display */
+        bool ret = finger.readDataPacket(NULL, &imageQuality, &readLen, &readComplete);
 
         if (!ret)
         {
@@ -289,6 +267,17 @@ uint32_t imageToTft(void)
         yield();
     }
     
+    imageWriter.end();
+    imageQuality.end();
+
+    FPMImageQualityReport quality;
+    imageQuality.getReport(&quality);
+
+    snprintf(printfBuf, PRINTF_BUF_SZ, "Coverage: %u%%, contrast: %u, offset: %d%%/%d%%", 
+             quality.coverage, quality.contrast, quality.offsetX, quality.offsetY);
+    Serial.println(printfBuf);
+    Serial.println(quality.acceptable ? "Good image." : "Poor image, place the finger again.");
+
     Serial.println();
     Serial.print(totalRead); Serial.println(" bytes transferred.");
     return totalRead;
@@ -1,5 +1,6 @@
 #include <SoftwareSerial.h>
 #include <fpm.h>
+#include <fpm_sinks.h>
 
 #include <Ethernet.h>
 #include <EthernetUdp.h>
@@ -30,6 +31,9 @@ unsigned int udpServerPort = 9999;
 EthernetUDP udpClient;
 unsigned int localPort = 8888;
 
+/* Each chunk of image data goes straight into the UDP packet being composed */
+auto udpSink = makeCallbackSink([](const uint8_t * data, uint16_t len) { udpClient.write(data, len); });
+
 /* for convenience */
 #define PRINTF_BUF_SZ   60
 char printfBuf[PRINTF_BUF_SZ];
@@ -125,7 +129,7 @@ uint32_t imageToUdp(void)
         /* Start composing a packet to the remote server */
         udpClient.beginPacket(udpServerIp, udpServerPort);
         
-        bool ret = finger.readDataPacket(NULL, &udpClient, &readLen, &readComplete);
+        bool ret = finger.readDataPacket(udpSink, &readLen, &readComplete);
         
         if (!ret)
         {
@@ -90,9 +90,10 @@ bool searchDatabase(void)
             return false;
     }
 
-    /* Search the database for the converted print */
+    /* Search the database for the converted print, 
+     * only as far as the occupied IDs go, and with a high-speed search where possible */
     uint16_t fid, score;
-    status = finger.searchDatabase(&fid, &score);
+    status = finger.searchDatabase(&fid, &score, 1, 0, params.capacity, FPMSearchMode::AUTO);
     
     switch (status)
     {
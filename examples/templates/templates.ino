@@ -21,10 +21,11 @@ FPMSystemParams params;
 #define PRINTF_BUF_SZ   60
 char printfBuf[PRINTF_BUF_SZ];
 
-/* This should be equal to the template size for your sensor,
+/* This should be at least the template size for your sensor,
  * which can be anywhere from 512 to 1536 bytes.
  * 
- * So check the printed result of readTemplate() to determine 
+ * If your sensor supports readProductInfo(), the template size is printed in setup().
+ * Otherwise, check the printed result of readTemplate() to determine 
  * the correct template size for your sensor and adjust the buffer
  * size below accordingly. If this example doesn't work at first, try increasing
  * this value, provided you have sufficient RAM.
@@ -44,6 +45,11 @@ void setup()
         Serial.println("Found fingerprint sensor!");
         Serial.print("Capacity: "); Serial.println(params.capacity);
         Serial.print("Packet length: "); Serial.println(FPM::packetLengths[static_cast<uint8_t>(params.packetLen)]);
+        
+        FPMProductInfo info;
+        if (finger.readProductInfo(&info) == FPMStatus::OK) {
+            Serial.print("Template size: "); Serial.println(info.templateSize);
+        }
     } 
     else {
         Serial.println("Did not find fingerprint sensor :(");
@@ -93,66 +99,31 @@ uint16_t getIDInput(void)
 
 uint16_t readTemplate(uint16_t fid, uint8_t * buffer, uint16_t bufLen)
 {
-    /* Load the template from the sensor's storage into one of its Buffers
-     * (Buffer 1 by default) */
-    FPMStatus status = finger.loadTemplate(fid);
+    /* The library loads the template from the sensor's storage into one of its Buffers
+     * (Buffer 1 by default), and then reads it from there, one packet at a time.
+     * 
+     * As an argument, this holds the max number of bytes to read from the sensor.
+     * When the function returns successfully, it then holds the number of bytes actually read. */
+    uint16_t readLen = bufLen;
+    FPMStatus status = finger.readTemplate(fid, buffer, &readLen);
     
     switch (status) 
     {
         case FPMStatus::OK:
-            Serial.print("Template "); Serial.print(fid); Serial.println(" loaded");
+            Serial.print("Template "); Serial.print(fid); Serial.println(" read");
             break;
             
         case FPMStatus::DBREADFAIL:
             Serial.println(F("Invalid template or location"));
-            return false;
-            
-        default:
-            snprintf_P(printfBuf, PRINTF_BUF_SZ, PSTR("loadTemplate(%d): error 0x%X"), fid, static_cast<uint16_t>(status));
-            Serial.println(printfBuf);
-            return false;
-    }
-    
-    /* Inform the sensor that we're about to download a template from that Buffer */
-    status = finger.downloadTemplate();
-    switch (status) 
-    {
-        case FPMStatus::OK:
-            break;
+            return 0;
             
         default:
-            snprintf_P(printfBuf, PRINTF_BUF_SZ, PSTR("downloadTemplate(%d): error 0x%X"), fid, static_cast<uint16_t>(status));
-            Serial.println(printfBuf);
-            return false; 
-    }
-    
-    /* Now, the sensor will send us the template from that Buffer, one packet at a time */
-    bool readComplete = false;
-    
-    /* As an argument, this holds the max number of bytes to read from the sensor.
-     * Whenever the function returns successfully, it then holds the number of bytes actually read. */
-    uint16_t readLen = bufLen;
-    
-    uint16_t bufPos = 0;
-
-    while (!readComplete) 
-    {
-        bool ret = finger.readDataPacket(buffer + bufPos, NULL, &readLen, &readComplete);
-        
-        if (!ret)
-        {
-            snprintf_P(printfBuf, PRINTF_BUF_SZ, PSTR("readDataPacket(): failed after reading %u bytes"), bufPos);
+            snprintf_P(printfBuf, PRINTF_BUF_SZ, PSTR("readTemplate(%d): error 0x%X"), fid, static_cast<uint16_t>(status));
             Serial.println(printfBuf);
             return 0;
-        }
-        
-        bufPos += readLen;
-        readLen = bufLen - bufPos;
-        
-        yield();
     }
     
-    uint16_t totalBytes = bufPos;
+    uint16_t totalBytes = readLen;
     
     /* just for pretty-printing */
     uint16_t numRows = totalBytes / 16;
@@ -204,47 +175,10 @@ bool deleteTemplate(int fid)
 
 bool writeTemplate(uint16_t fid, uint8_t * buffer, uint16_t templateSz) 
 {
-    /* Inform the sensor that we're about to upload a template to one of its Buffers
-     * (Buffer 1 by default) */
-    FPMStatus status = finger.uploadTemplate();
-    
-    switch (status) 
-    {
-        case FPMStatus::OK:
-            Serial.println("Starting template upload...");
-            break;
-            
-        default:
-            snprintf_P(printfBuf, PRINTF_BUF_SZ, PSTR("uploadTemplate(%u): error 0x%X"), fid, static_cast<uint16_t>(status));
-            Serial.println(printfBuf);
-            return false; 
-    }
-    
-    /* One packet at a time, upload the template to that Buffer */
-    uint16_t writeLen = templateSz;
-    uint16_t written = 0;
-    const uint16_t PACKET_LENGTH = FPM::packetLengths[static_cast<uint8_t>(params.packetLen)];
-    
-    while (writeLen)
-    {
-        /* the write is completed when we have no more than PACKET_LENGTH left to write */
-        bool ret = finger.writeDataPacket(buffer + written, NULL, &writeLen, writeLen <= PACKET_LENGTH);
-        
-        if (!ret)
-        {
-            snprintf_P(printfBuf, PRINTF_BUF_SZ, PSTR("writeDataPacket(): failed after writing %u bytes"), written);
-            Serial.println(printfBuf);
-            return false;
-        }
-        
-        written += writeLen;
-        writeLen = templateSz - written;
-        
-        yield();
-    }
-    
-    /* Finally, store the template at the specified location */
-    status = finger.storeTemplate(fid);
+    /* The library uploads the template to one of the sensor's Buffers (Buffer 1 by default),
+     * splitting it into packets as needed, and then stores it at the specified location */
+    Serial.println("Starting template upload...");
+    FPMStatus status = finger.writeTemplate(fid, buffer, templateSz);
 
     switch (status)
     {
@@ -259,7 +193,7 @@ bool writeTemplate(uint16_t fid, uint8_t * buffer, uint16_t templateSz)
             return false;
             
         default:
-            snprintf_P(printfBuf, PRINTF_BUF_SZ, PSTR("storeModel(%u): error 0x%X"), fid, static_cast<uint16_t>(status));
+            snprintf_P(printfBuf, PRINTF_BUF_SZ, PSTR("writeTemplate(%u): error 0x%X"), fid, static_cast<uint16_t>(status));
             Serial.println(printfBuf);
             return false;
     }
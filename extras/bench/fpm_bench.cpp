@@ -0,0 +1,1209 @@
+/***************************************************
+  Packet-layer benchmarks for the FPM library, run on a PC against the sensor emulator.
+
+  Build and run from the root of the library:
+
+    g++ -O2 -std=gnu++11 -pthread -DFPM_GROUP_STD_THREAD -Iextras/host -Isrc -Iextras/emulator -Iextras/decoder \
+        src/fpm.cpp src/fpm_link.cpp src/fpm_backup.cpp src/fpm_group.cpp src/fpm_shards.cpp src/fpm_hotset.cpp src/fpm_image.cpp src/fpm_tee.cpp \
+        src/fpm_trace.cpp extras/emulator/fpm_emulator.cpp extras/emulator/fpm_replay.cpp extras/decoder/fpm_image_decoder.cpp \
+        extras/bench/fpm_bench.cpp -o fpm_bench
+    ./fpm_bench [-n iterations] [-c corruption-rate] [-i image.pgm]... [-w trace.fpmt | -r trace.fpmt [-t]]
+
+  -w saves the trace of the capture/replay session, and -r replays a saved one instead of capturing it
+  (-t at its original timing), so that a run with corrupted frames or timeouts can be reproduced exactly.
+
+  All figures include the cost of the emulator itself, so they are most useful
+  for comparing builds of the library against each other, on the same machine.
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include <Arduino.h>
+#include <fpm.h>
+#include <fpm_group.h>
+#include <fpm_shards.h>
+#include <fpm_hotset.h>
+#include <fpm_image.h>
+#include <fpm_tee.h>
+#include <fpm_sinks.h>
+#include <fpm_trace.h>
+#include "fpm_emulator.h"
+#include "fpm_replay.h"
+#include "fpm_image_decoder.h"
+
+#include <stdlib.h>
+#include <chrono>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+#define IMAGE_SZ        (256UL * 288 / 2)
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double elapsedNs(BenchClock::time_point start)
+{
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(BenchClock::now() - start).count();
+}
+
+static uint32_t millis_since(BenchClock::time_point start)
+{
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(BenchClock::now() - start).count();
+}
+
+/* Discards everything written to it */
+class NullStream : public Stream
+{
+    public:
+    NullStream() : count(0) { }
+
+    size_t write(uint8_t c) { (void)c; count++; return 1; }
+    size_t write(const uint8_t * buffer, size_t size) { (void)buffer; count += size; return size; }
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+    int peek(void) { return -1; }
+
+    size_t count;
+};
+
+/* Takes at most #limit bytes per write, like a network client with a full send buffer */
+class ThrottledStream : public NullStream
+{
+    public:
+    ThrottledStream(size_t limit) : limit(limit) { }
+
+    size_t write(const uint8_t * buffer, size_t size) { return NullStream::write(buffer, min(size, limit)); }
+
+    size_t limit;
+};
+
+/* Keeps everything written to it */
+class VectorStream : public NullStream
+{
+    public:
+    VectorStream(std::vector<uint8_t> & v) : v(v) { }
+
+    size_t write(uint8_t c) { v.push_back(c); return 1; }
+    size_t write(const uint8_t * buffer, size_t size) { v.insert(v.end(), buffer, buffer + size); return size; }
+
+    std::vector<uint8_t> & v;
+};
+
+/* Keeps what's written to it, up to #limit bytes in all, like a file on a full disk */
+class CappedStream : public VectorStream
+{
+    public:
+    CappedStream(std::vector<uint8_t> & v, size_t limit) : VectorStream(v), limit(limit) { }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t * buffer, size_t size) 
+    {
+        size_t room = (v.size() < limit) ? limit - v.size() : 0;
+        return VectorStream::write(buffer, min(size, room));
+    }
+
+    size_t limit;
+};
+
+/* Serves bytes from memory, once */
+class MemoryStream : public NullStream
+{
+    public:
+    MemoryStream(const std::vector<uint8_t> & v) : v(v), pos(0) { }
+
+    int available(void) { return v.size() - pos; }
+    int read(void) { return (pos < v.size()) ? v[pos++] : -1; }
+    int peek(void) { return (pos < v.size()) ? v[pos] : -1; }
+
+    private:
+    const std::vector<uint8_t> & v;
+    size_t pos;
+};
+
+/* Serves bytes from memory, looping over them endlessly */
+class LoopStream : public Stream
+{
+    public:
+    LoopStream(const uint8_t * data, size_t len) : data(data), len(len), pos(0) { }
+
+    size_t write(uint8_t c) { (void)c; return 0; }
+    int available(void) { return 0x7FFF; }
+    int read(void) { uint8_t c = data[pos]; pos = (pos + 1) % len; return c; }
+    int peek(void) { return data[pos]; }
+
+    private:
+    const uint8_t * data;
+    size_t len;
+    size_t pos;
+};
+
+static void report(const char * group, const char * name, uint16_t packetLen,
+                   uint32_t iterations, double ns, uint64_t bytes, uint64_t packets)
+{
+    printf("%-7s %-28s plen=%-4u N=%-6u", group, name, packetLen, iterations);
+
+    if (bytes)      printf("  %8.2f ns/byte", ns / bytes);
+    if (packets)    printf("  %10.0f pkts/s", packets / (ns / 1e9));
+
+    printf("  %10.0f ns/op\n", ns / iterations);
+}
+
+static void benchAcks(FPM & finger, uint32_t iterations)
+{
+    uint16_t id, score, count;
+    BenchClock::time_point start;
+
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations; i++) finger.handshake();
+    report("[ack]", "handshake", 0, iterations, elapsedNs(start), 0, 2ULL * iterations);
+
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations; i++) finger.getTemplateCount(&count);
+    report("[ack]", "getTemplateCount", 0, iterations, elapsedNs(start), 0, 2ULL * iterations);
+
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations; i++) finger.image2Tz(1);
+    report("[ack]", "image2Tz", 0, iterations, elapsedNs(start), 0, 2ULL * iterations);
+
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations; i++) finger.searchDatabase(&id, &score);
+    report("[ack]", "searchDatabase", 0, iterations, elapsedNs(start), 0, 2ULL * iterations);
+}
+
+#if (FPM_METRICS)
+/* What the sensor's own metrics made of everything so far, with the bucket holding the median of each command */
+static void reportMetrics(FPM & finger)
+{
+    FPMMetrics m;
+    finger.getMetrics(&m);
+
+    printf("%-7s link: %u pkts / %u bytes in, %u pkts / %u bytes out, %u bad checksums, %u timeouts\n", "[metric]",
+           m.packetsIn, m.bytesIn, m.packetsOut, m.bytesOut, m.wrongChecksum, m.timeouts);
+
+    for (uint8_t i = 0; i < FPM_METRICS_COMMAND_COUNT; i++)
+    {
+        const FPMCommandMetrics * cmd = &m.commands[i];
+        if (cmd->count == 0) continue;
+
+        uint32_t seen = 0;
+        uint8_t median = 0;
+        while (median < FPM_METRICS_BUCKETS - 1 && (seen += cmd->histogram[median]) * 2 < cmd->count) median++;
+
+        printf("%-7s command 0x%02X  N=%-8u %8.1f us avg  %8u us max  p50 < %6lu us  %u not OK, %u timeouts, %u errors\n", "[metric]",
+               cmd->command, cmd->count, (double)cmd->totalMicros / cmd->count, cmd->maxMicros, 
+               1UL << (median + 8), cmd->notOk, cmd->timeouts, cmd->errors);
+    }
+}
+#endif
+
+static void benchReads(FPM & finger, uint16_t packetLen, uint32_t iterations)
+{
+    std::vector<uint8_t> image(IMAGE_SZ);
+    NullStream sink;
+    BenchClock::time_point start;
+    uint32_t packets = 0;
+    bool ok = true;
+
+    /* readPacket: straight into the caller's buffer */
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations && ok; i++) {
+        ok = finger.downloadImage() == FPMStatus::OK;
+
+        uint32_t total = 0;
+        bool readComplete = false;
+
+        while (ok && !readComplete) {
+            uint16_t readLen = IMAGE_SZ - total;
+            ok = finger.readDataPacket(&image[total], NULL, &readLen, &readComplete);
+            total += readLen;
+            packets++;
+        }
+    }
+
+    report("[read]", ok ? "image -> buffer" : "image -> buffer (FAILED)", packetLen,
+           iterations, elapsedNs(start), (uint64_t)IMAGE_SZ * iterations, packets);
+
+    /* readPacket: forwarded to a Stream */
+    packets = 0;
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations && ok; i++) {
+        ok = finger.downloadImage() == FPMStatus::OK;
+
+        bool readComplete = false;
+
+        while (ok && !readComplete) {
+            uint16_t readLen = 0;
+            ok = finger.readDataPacket(NULL, &sink, &readLen, &readComplete);
+            packets++;
+        }
+    }
+
+    report("[read]", ok ? "image -> Stream" : "image -> Stream (FAILED)", packetLen,
+           iterations, elapsedNs(start), (uint64_t)IMAGE_SZ * iterations, packets);
+
+    /* the same, through the sink adapters: into a span, then to a callback */
+    FPMSpanSink span(&image[0], image.size());
+    packets = 0;
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations && ok; i++) {
+        ok = finger.downloadImage() == FPMStatus::OK;
+        span.reset();
+
+        bool readComplete = false;
+
+        while (ok && !readComplete) {
+            uint16_t readLen = 0;
+            ok = finger.readDataPacket(span, &readLen, &readComplete);
+            packets++;
+        }
+
+        ok = ok && span.length == IMAGE_SZ;
+    }
+
+    report("[read]", ok ? "image -> span sink" : "image -> span sink (FAILED)", packetLen,
+           iterations, elapsedNs(start), (uint64_t)IMAGE_SZ * iterations, packets);
+
+    size_t received = 0, chunkBytes = 0;
+    auto callback = makeCallbackSink([&chunkBytes](const uint8_t * chunk, uint16_t len) { (void)chunk; chunkBytes += len; });
+    packets = 0;
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations && ok; i++) {
+        ok = finger.downloadImage() == FPMStatus::OK;
+
+        bool readComplete = false;
+
+        while (ok && !readComplete) {
+            uint16_t readLen = 0;
+            ok = finger.readDataPacket(callback, &readLen, &readComplete);
+            packets++;
+        }
+
+        received += IMAGE_SZ;
+    }
+
+    ok = ok && chunkBytes == received;
+    report("[read]", ok ? "image -> callback sink" : "image -> callback sink (FAILED)", packetLen,
+           iterations, elapsedNs(start), (uint64_t)IMAGE_SZ * iterations, packets);
+}
+
+/* One image download fanned out to a display-like sink, a throttled network-like sink and a copy in RAM,
+ * against downloading it once for each of them */
+static void benchTee(FPM & finger, uint16_t packetLen, uint32_t iterations)
+{
+    std::vector<uint8_t> copy(IMAGE_SZ), ring(1024);
+    NullStream display;
+    ThrottledStream network(packetLen * 3 / 4);
+    FPMTee tee;
+    BenchClock::time_point start;
+    uint32_t dropped = 0;
+    bool ok = true;
+
+    tee.addConsumer(&display);
+    tee.addConsumer(&network, &ring[0], ring.size());
+    tee.addConsumer(&copy[0], copy.size());
+
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations && ok; i++) {
+        ok = finger.downloadImage() == FPMStatus::OK;
+        tee.begin();
+
+        bool readComplete = false;
+
+        while (ok && !readComplete) {
+            uint16_t readLen = 0;
+            ok = finger.readDataPacket(NULL, &tee, &readLen, &readComplete);
+            tee.poll();
+        }
+
+        while (tee.end() == FPMStatus::PENDING) { }
+        dropped += tee.dropped(1);
+    }
+
+    ok = ok && dropped == 0 && network.count == display.count;
+    report("[tee]", ok ? "image -> 3 consumers, once" : "image -> 3 consumers (FAILED)", packetLen,
+           iterations, elapsedNs(start), (uint64_t)IMAGE_SZ * iterations, 0);
+
+    /* the same, one download per consumer */
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations && ok; i++) {
+        for (uint8_t c = 0; c < 3 && ok; c++) {
+            ok = finger.downloadImage() == FPMStatus::OK;
+
+            uint32_t total = 0;
+            bool readComplete = false;
+
+            while (ok && !readComplete) {
+                uint16_t readLen = IMAGE_SZ - total;
+                ok = finger.readDataPacket(c == 2 ? &copy[total] : NULL, c == 0 ? &display : (c == 1 ? &network : NULL), 
+                                           &readLen, &readComplete);
+                total += readLen;
+            }
+        }
+    }
+
+    report("[tee]", ok ? "image -> 3 consumers, 3 times" : "image -> 3 consumers (FAILED)", packetLen,
+           iterations, elapsedNs(start), (uint64_t)IMAGE_SZ * iterations, 0);
+}
+
+/* Expansion of a packed image into each output format, on its own (no sensor), then cropped and scaled down */
+static void benchImage(uint32_t iterations)
+{
+    static const struct {
+        const char * name;
+        FPMImageFormat format;
+        uint16_t cropX, cropY, cropWidth, cropHeight;
+        uint8_t mult, div;
+    } cases[] = {
+        { "image -> raw pixels",        FPMImageFormat::RAW, 0, 0, FPM_IMAGE_WIDTH, FPM_IMAGE_HEIGHT, 1, 1 },
+        { "image -> PGM",               FPMImageFormat::PGM, 0, 0, FPM_IMAGE_WIDTH, FPM_IMAGE_HEIGHT, 1, 1 },
+        { "image -> BMP",               FPMImageFormat::BMP, 0, 0, FPM_IMAGE_WIDTH, FPM_IMAGE_HEIGHT, 1, 1 },
+        { "image -> BMP, 128x128 crop", FPMImageFormat::BMP, 64, 80, 128, 128, 1, 1 },
+        { "image -> BMP, scaled 3/4",   FPMImageFormat::BMP, 0, 0, FPM_IMAGE_WIDTH, FPM_IMAGE_HEIGHT, 3, 4 },
+        { "image -> BMP, scaled 1/4",   FPMImageFormat::BMP, 0, 0, FPM_IMAGE_WIDTH, FPM_IMAGE_HEIGHT, 1, 4 },
+    };
+
+    std::vector<uint8_t> packed(IMAGE_SZ);
+    for (size_t i = 0; i < packed.size(); i++) packed[i] = (uint8_t)(i * 31);
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        NullStream sink;
+        FPMImageWriter writer(&sink, cases[c].format);
+        bool ok = writer.setCrop(cases[c].cropX, cases[c].cropY, cases[c].cropWidth, cases[c].cropHeight) == FPMStatus::OK &&
+                  writer.setScale(cases[c].mult, cases[c].div) == FPMStatus::OK;
+
+        BenchClock::time_point start = BenchClock::now();
+        for (uint32_t i = 0; i < iterations && ok; i++) {
+            writer.begin();
+
+            /* in packet-sized chunks, as it would come from readDataPacket() */
+            for (size_t pos = 0; pos < packed.size(); pos += 128) {
+                writer.write(&packed[pos], min(packed.size() - pos, (size_t)128));
+            }
+
+            ok = writer.end() == FPMStatus::OK && sink.count == (size_t)writer.outputSize() * (i + 1);
+        }
+
+        report("[image]", ok ? cases[c].name : "image (FAILED)", 0, iterations, elapsedNs(start), (uint64_t)IMAGE_SZ * iterations, 0);
+    }
+}
+
+/* Loads a recorded image, in the sensor's format, from either a raw dump or an 8-bit PGM file */
+static bool loadImage(const char * path, std::vector<uint8_t> & packed)
+{
+    FILE * fp = fopen(path, "rb");
+    if (fp == NULL) return false;
+
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t n;
+
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) data.insert(data.end(), chunk, chunk + n);
+    fclose(fp);
+
+    unsigned w, h, maxval;
+    int headerLen = 0;
+
+    if (data.size() == IMAGE_SZ) {
+        packed = data;
+        return true;
+    }
+
+    data.push_back(0);
+    if (sscanf((const char *)&data[0], "P5 %u %u %u%n", &w, &h, &maxval, &headerLen) != 3 || maxval != 255) return false;
+
+    /* one whitespace byte follows the header */
+    const uint8_t * pixels = &data[headerLen + 1];
+    if (w * h != IMAGE_SZ * 2 || headerLen + 1 + (size_t)w * h > data.size() - 1) return false;
+
+    packed.assign(IMAGE_SZ, 0);
+    for (size_t i = 0; i < (size_t)w * h; i++) packed[i / 2] |= (i & 1) ? (pixels[i] >> 4) : (pixels[i] & 0xF0);
+
+    return true;
+}
+
+/* Recorded images if any, or else some from the emulator */
+static void loadImages(const std::vector<const char *> & paths, std::vector<std::vector<uint8_t> > & images)
+{
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::vector<uint8_t> packed;
+
+        if (loadImage(paths[i], packed)) images.push_back(packed);
+        else printf("[image] can't load %s, skipped\n", paths[i]);
+    }
+
+    if (images.empty())
+    {
+        FPMEmulator emu;
+        FPM finger(&emu);
+        finger.begin();
+
+        for (uint32_t seed = 1; seed <= 8; seed++) {
+            std::vector<uint8_t> packed(IMAGE_SZ);
+            uint32_t total = 0;
+            bool readComplete = false;
+
+            emu.setFinger(true, seed);
+            finger.getImage();
+            finger.downloadImage();
+
+            while (!readComplete) {
+                uint16_t readLen = IMAGE_SZ - total;
+                if (!finger.readDataPacket(&packed[total], NULL, &readLen, &readComplete)) break;
+                total += readLen;
+            }
+
+            images.push_back(packed);
+        }
+    }
+}
+
+/* Compression ratio and speed of FPMImageCompressor */
+static void benchCompression(const std::vector<std::vector<uint8_t> > & images, bool recorded, uint32_t iterations)
+{
+    char name[40];
+
+    uint64_t rawTotal = 0, zipTotal = 0;
+    double ns = 0;
+    bool ok = true;
+
+    for (size_t img = 0; img < images.size(); img++)
+    {
+        NullStream sink;
+        FPMImageCompressor compressor(&sink);
+
+        BenchClock::time_point start = BenchClock::now();
+        for (uint32_t i = 0; i < iterations; i++) {
+            compressor.begin();
+
+            for (size_t pos = 0; pos < IMAGE_SZ; pos += 128) {
+                compressor.write(&images[img][pos], 128);
+            }
+
+            compressor.end();
+        }
+        ns += elapsedNs(start);
+
+        /* and check that it all comes back */
+        std::vector<uint8_t> zipped, unzipped;
+        VectorStream capture(zipped);
+
+        FPMImageCompressor check(&capture);
+        check.begin();
+        check.write(&images[img][0], IMAGE_SZ);
+        check.end();
+
+        ok = ok && FPMImageDecoder::decode(&zipped[0], zipped.size(), unzipped) && unzipped == images[img];
+
+        rawTotal += IMAGE_SZ;
+        zipTotal += zipped.size();
+    }
+
+    snprintf(name, sizeof(name), "%s x%u", ok ? "compress" : "compress (FAILED)", (unsigned)images.size());
+    report("[zip]", name, 0, iterations * images.size(), ns, rawTotal * iterations, 0);
+    printf("        %s images: %.1f KB -> %.1f KB on average, %.2fx\n", recorded ? "recorded" : "emulator", 
+           rawTotal / 1024.0 / images.size(), zipTotal / 1024.0 / images.size(), (double)rawTotal / zipTotal);
+}
+
+/* Speed of FPMImageQuality, and its verdict on each image, then on a blank one and one mostly off to the side */
+static void benchQuality(const std::vector<std::vector<uint8_t> > & images, uint32_t iterations)
+{
+    std::vector<std::vector<uint8_t> > all(images);
+    FPMImageQualityReport result;
+    uint32_t accepted = 0;
+    char name[40];
+    double ns = 0;
+
+    all.push_back(std::vector<uint8_t>(IMAGE_SZ, 0xFF));
+    all.push_back(images[0]);
+
+    for (size_t y = 0; y < FPM_IMAGE_HEIGHT; y++) {
+        memset(&all.back()[y * FPM_IMAGE_WIDTH / 2], 0xFF, FPM_IMAGE_WIDTH * 3 / 8);
+    }
+
+    for (size_t img = 0; img < all.size(); img++)
+    {
+        FPMImageQuality quality;
+
+        BenchClock::time_point start = BenchClock::now();
+        for (uint32_t i = 0; i < iterations; i++) {
+            quality.begin();
+
+            for (size_t pos = 0; pos < IMAGE_SZ; pos += 128) {
+                quality.write(&all[img][pos], 128);
+            }
+
+            quality.end();
+        }
+
+        if (img < images.size()) {
+            ns += elapsedNs(start);
+            accepted += quality.acceptable();
+        }
+
+        if (img == 0 || img >= images.size())
+        {
+            quality.getReport(&result);
+            printf("        %-20s coverage %3u%%  contrast %2u  offset %+3d%%/%+3d%%  %s\n", 
+                   img == 0 ? "first image:" : (img == images.size() ? "blank image:" : "off to the side:"),
+                   result.coverage, result.contrast, result.offsetX, result.offsetY, result.acceptable ? "accepted" : "rejected");
+        }
+    }
+
+    snprintf(name, sizeof(name), "quality x%u, %u accepted", (unsigned)images.size(), accepted);
+    report("[image]", name, 0, iterations * images.size(), ns, (uint64_t)IMAGE_SZ * iterations * images.size(), 0);
+}
+
+static void benchWrites(FPM & finger, FPMEmulator & emu, uint16_t packetLen, uint32_t iterations)
+{
+    const uint16_t TEMPLATE_SZ = emu.config().templateSize;
+    std::vector<uint8_t> tmpl(TEMPLATE_SZ, 0x5A);
+    LoopStream source(&tmpl[0], tmpl.size());
+    BenchClock::time_point start;
+    uint32_t packets = 0;
+    bool ok = true;
+
+    /* writePacket: from the caller's buffer */
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations && ok; i++) {
+        ok = finger.uploadTemplate() == FPMStatus::OK;
+
+        uint16_t written = 0;
+        while (ok && written < TEMPLATE_SZ) {
+            uint16_t writeLen = TEMPLATE_SZ - written;
+            ok = finger.writeDataPacket(&tmpl[written], NULL, &writeLen, writeLen <= packetLen);
+            written += writeLen;
+            packets++;
+        }
+    }
+
+    report("[write]", ok ? "template <- buffer" : "template <- buffer (FAILED)", packetLen,
+           iterations, elapsedNs(start), (uint64_t)TEMPLATE_SZ * iterations, packets);
+
+    /* writePacket: pulled from a Stream */
+    packets = 0;
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations && ok; i++) {
+        ok = finger.uploadTemplate() == FPMStatus::OK;
+
+        uint16_t written = 0;
+        while (ok && written < TEMPLATE_SZ) {
+            uint16_t writeLen = TEMPLATE_SZ - written;
+            ok = finger.writeDataPacket(NULL, &source, &writeLen, writeLen <= packetLen);
+            written += writeLen;
+            packets++;
+        }
+    }
+
+    report("[write]", ok ? "template <- Stream" : "template <- Stream (FAILED)", packetLen,
+           iterations, elapsedNs(start), (uint64_t)TEMPLATE_SZ * iterations, packets);
+
+    /* writePacket: from a span source */
+    FPMSpanSource span(&tmpl[0], tmpl.size());
+    packets = 0;
+    start = BenchClock::now();
+    for (uint32_t i = 0; i < iterations && ok; i++) {
+        ok = finger.uploadTemplate() == FPMStatus::OK;
+        span.reset();
+
+        while (ok && span.available() != 0) {
+            uint16_t writeLen = TEMPLATE_SZ;
+            ok = finger.writeDataPacket(span, &writeLen, span.available() <= packetLen);
+            packets++;
+        }
+    }
+
+    report("[write]", ok ? "template <- span source" : "template <- span source (FAILED)", packetLen,
+           iterations, elapsedNs(start), (uint64_t)TEMPLATE_SZ * iterations, packets);
+}
+
+static void countIdentify(uint8_t sensorIdx, FPMStatus status, uint16_t fingerId, uint16_t score, void * ctx)
+{
+    (void)sensorIdx; (void)fingerId; (void)score;
+    if (status == FPMStatus::OK) (*(std::atomic<uint32_t> *)ctx)++;
+}
+
+/* Identifications per second across N sensors, each taking a realistic-ish time per command */
+static void benchGroup(uint8_t numSensors, bool useWorkers, uint32_t durationMs)
+{
+    FPMEmulatorConfig cfg;
+    std::vector<FPMEmulator *> emus;
+    std::vector<FPM *> fingers;
+    FPMGroup group;
+
+    for (uint8_t i = 0; i < numSensors; i++)
+    {
+        FPMEmulator * emu = new FPMEmulator(cfg);
+        FPM * finger = new FPM(emu);
+        
+        finger->begin();
+
+        emu->setFinger(true, 42);
+        finger->getImage();
+        finger->image2Tz(1);
+        finger->storeTemplate(7);
+        
+        emu->setCommandLatency(FPM_GETIMAGE, 20000);
+        emu->setCommandLatency(FPM_IMAGE2TZ, 10000);
+        emu->setCommandLatency(FPM_SEARCH, 15000);
+
+        emus.push_back(emu);
+        fingers.push_back(finger);
+        group.add(finger);
+    }
+
+    std::atomic<uint32_t> matches(0);
+    BenchClock::time_point start = BenchClock::now();
+
+    group.startIdentify(countIdentify, &matches, false);
+
+#if (FPM_GROUP_WORKERS)
+    if (useWorkers) group.startWorkers(numSensors);
+#endif
+
+    while (millis_since(start) < durationMs)
+    {
+        if (!useWorkers) group.poll();
+        else delay(1);
+    }
+
+    group.stop();
+    double ns = elapsedNs(start);
+
+    char name[40];
+    snprintf(name, sizeof(name), "identify x%u sensors (%s)", numSensors, useWorkers ? "threads" : "poll");
+    report("[group]", name, 0, matches, ns, 0, 0);
+    printf("        %.1f identifications/s\n", matches / (ns / 1e9));
+
+    for (uint8_t i = 0; i < numSensors; i++)
+    {
+        delete fingers[i];
+        delete emus[i];
+    }
+}
+
+/* Latency of an identify across N shards, the match being on the last one */
+static void benchShards(uint8_t numShards, uint32_t iterations)
+{
+    FPMEmulatorConfig cfg;
+    std::vector<FPMEmulator *> emus;
+    std::vector<FPM *> fingers;
+    std::vector<uint8_t> tmpl(cfg.templateSize);
+    FPMShardedDatabase db(&tmpl[0], tmpl.size());
+
+    for (uint8_t i = 0; i < numShards; i++)
+    {
+        FPMEmulator * emu = new FPMEmulator(cfg);
+        FPM * finger = new FPM(emu);
+
+        finger->begin();
+        emu->setCommandLatency(FPM_SEARCH, 50000);
+
+        emus.push_back(emu);
+        fingers.push_back(finger);
+        db.add(finger);
+    }
+
+    /* the print is stored on the last shard, and captured on the first one */
+    emus.back()->setFinger(true, 42);
+    fingers.back()->getImage();
+    fingers.back()->image2Tz(1);
+    fingers.back()->storeTemplate(3);
+
+    emus.front()->setFinger(true, 42);
+    fingers.front()->getImage();
+    fingers.front()->image2Tz(1);
+
+    uint32_t found = 0, globalId = 0;
+    uint16_t score;
+    BenchClock::time_point start = BenchClock::now();
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        if (db.identify(0, &globalId, &score) == FPMStatus::OK) found++;
+    }
+
+    char name[40];
+    snprintf(name, sizeof(name), "identify across %u shards%s", numShards, 
+             (found == iterations && globalId == db.getCapacity() - cfg.capacity + 3) ? "" : " (FAILED)");
+    report("[shards]", name, 0, iterations, elapsedNs(start), 0, 0);
+
+    for (uint8_t i = 0; i < numShards; i++)
+    {
+        delete fingers[i];
+        delete emus[i];
+    }
+}
+
+/* Outcomes of searches over part of the database, with a single print enrolled at ID 50 */
+static void benchSearch(uint32_t iterations)
+{
+    struct SearchCase {
+        const char * name;
+        uint16_t startId;
+        uint16_t count;
+        FPMSearchMode mode;
+        FPMStatus expected;
+    };
+
+    static const SearchCase cases[] = {
+        { "normal, below the print",    0,  5,  FPMSearchMode::NORMAL,      FPMStatus::NOTFOUND },
+        { "auto, below the print",      0,  5,  FPMSearchMode::AUTO,        FPMStatus::NOTFOUND },
+        { "auto, above the print",      51, 10, FPMSearchMode::AUTO,        FPMStatus::NOTFOUND },
+        { "auto, around the print",     40, 20, FPMSearchMode::AUTO,        FPMStatus::OK },
+        { "auto, just the print",       50, 1,  FPMSearchMode::AUTO,        FPMStatus::OK },
+        { "high-speed, whole database", 0,  0,  FPMSearchMode::HIGH_SPEED,  FPMStatus::OK },
+    };
+
+    FPMEmulatorConfig cfg;
+    FPMEmulator emu(cfg);
+    FPM finger(&emu);
+
+    finger.begin();
+
+    emu.setFinger(true, 7);
+    finger.getImage();
+    finger.image2Tz(1);
+    finger.storeTemplate(50);
+
+    finger.getImage();
+    finger.image2Tz(1);
+
+    /* the occupancy cache isn't loaded yet, and beginSearch() mustn't stop to load it */
+    finger.invalidateIndexCache();
+    uint32_t packetsBefore = emu.packetsIn;
+
+    finger.beginSearch(1, 0, 5);
+    bool oneCommand = (emu.packetsIn - packetsBefore == 1);
+    while (finger.poll() == FPMStatus::PENDING) { }
+
+    printf("%-7s %-28s %s\n", "[search]", "beginSearch, cold cache", oneCommand ? "1 command sent" : "FAILED, blocked on the cache");
+
+    for (uint8_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        const SearchCase & sc = cases[c];
+        const uint16_t count = (sc.count != 0) ? sc.count : cfg.capacity;
+        uint32_t passed = 0;
+
+        BenchClock::time_point start = BenchClock::now();
+
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            uint16_t id = 0xFFFF, score = 0;
+            FPMStatus status = finger.searchDatabase(&id, &score, 1, sc.startId, count, sc.mode);
+
+            if (status == sc.expected && (status != FPMStatus::OK || id == 50)) passed++;
+        }
+
+        char name[48];
+        snprintf(name, sizeof(name), "%s%s", sc.name, (passed == iterations) ? "" : " (FAILED)");
+        report("[search]", name, 0, iterations, elapsedNs(start), 0, 0);
+    }
+}
+
+/* true if every template in #a is in #b at the same ID, with the same bytes, and #b has nothing else */
+static bool sameDatabase(FPM & a, FPMEmulator & emuA, FPM & b, FPMEmulator & emuB)
+{
+    std::vector<uint8_t> ta(emuA.config().templateSize), tb(emuB.config().templateSize);
+
+    for (uint16_t id = 0; id < emuA.config().capacity; id++)
+    {
+        if (emuA.isOccupied(id) != emuB.isOccupied(id)) return false;
+        if (!emuA.isOccupied(id)) continue;
+
+        uint16_t lenA = ta.size(), lenB = tb.size();
+
+        if (a.readTemplate(id, &ta[0], &lenA) != FPMStatus::OK || b.readTemplate(id, &tb[0], &lenB) != FPMStatus::OK ||
+            lenA != lenB || ta != tb)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Backs up a database and restores it onto another sensor, checking that it comes across intact,
+ * that a damaged container is refused, and that an interrupted backup or restore can be resumed */
+static void benchBackup(void)
+{
+    const uint16_t USERS = 24;
+
+    FPMEmulatorConfig cfg;
+    FPMEmulator srcEmu(cfg);
+    FPM src(&srcEmu);
+
+    src.begin();
+
+    /* templates at scattered IDs, each ending in the zero padding that compression is for */
+    std::vector<uint8_t> tmpl(cfg.templateSize);
+    srand(7);
+
+    for (uint16_t u = 0; u < USERS; u++)
+    {
+        uint16_t used = cfg.templateSize / 2 + rand() % (cfg.templateSize / 4);
+
+        for (uint16_t i = 0; i < cfg.templateSize; i++) {
+            tmpl[i] = (i < used && (i % 17) != 0) ? 1 + rand() % 255 : 0;
+        }
+
+        srcEmu.storeTemplate(3 + u * 7, &tmpl[0], tmpl.size());
+    }
+
+    for (int compress = 0; compress < 2; compress++)
+    {
+        std::vector<uint8_t> container;
+        VectorStream out(container);
+
+        BenchClock::time_point start = BenchClock::now();
+        FPMStatus backedUp = src.backupDatabase(&out, compress);
+        double backupNs = elapsedNs(start);
+
+        FPMEmulator destEmu(cfg);
+        FPM dest(&destEmu);
+        dest.begin();
+
+        MemoryStream in(container);
+
+        start = BenchClock::now();
+        FPMStatus restored = dest.restoreDatabase(&in);
+        double restoreNs = elapsedNs(start);
+
+        bool intact = (backedUp == FPMStatus::OK && restored == FPMStatus::OK && sameDatabase(src, srcEmu, dest, destEmu));
+
+        printf("%-7s %-28s N=%-6u  %6.2f ms backup  %6.2f ms restore  %5u bytes/template  %s\n", "[backup]", 
+               compress ? "round trip (compressed)" : "round trip", USERS, backupNs / 1e6, restoreNs / 1e6,
+               (unsigned)(container.size() / USERS), intact ? "intact" : "FAILED");
+
+        /* a single flipped byte, two thirds of the way through the records, stops the restore just before its record */
+        std::vector<uint8_t> damaged = container;
+        damaged[container.size() * 2 / 3] ^= 0x40;
+
+        FPMEmulator damagedEmu(cfg);
+        FPM damagedDest(&damagedEmu);
+        damagedDest.begin();
+
+        MemoryStream damagedIn(damaged);
+        int16_t lastId = -1;
+        FPMStatus refused = damagedDest.restoreDatabase(&damagedIn, 0, &lastId);
+
+        /* then the rest, resumed from the intact container */
+        MemoryStream resumedIn(container);
+        FPMStatus resumed = damagedDest.restoreDatabase(&resumedIn, lastId + 1);
+
+        printf("%-7s %-28s %s, %s\n", "[backup]", compress ? "flipped byte (compressed)" : "flipped byte",
+               (refused == FPMStatus::READ_ERROR && lastId >= 3 && lastId < 3 + (USERS - 1) * 7) ? "refused" : "FAILED, not refused",
+               (resumed == FPMStatus::OK && sameDatabase(src, srcEmu, damagedDest, damagedEmu)) ? "resumed" : "FAILED to resume");
+    }
+
+    /* a destination that fills up halfway through; the backup is resumed into a second container */
+    std::vector<uint8_t> first, second;
+    CappedStream capped(first, 14 + 2 * USERS + 2 + (USERS / 2) * (cfg.templateSize + 4));
+    VectorStream rest(second);
+    int16_t lastId = -1;
+
+    FPMStatus truncated = src.backupDatabase(&capped, false, 0, &lastId);
+    FPMStatus continued = (lastId >= 0) ? src.backupDatabase(&rest, false, lastId + 1) : FPMStatus::INVALID_PARAMS;
+
+    FPMEmulator destEmu(cfg);
+    FPM dest(&destEmu);
+    dest.begin();
+
+    /* the first container is cut short, so restore what it has, then the rest from the second */
+    MemoryStream firstIn(first), secondIn(second);
+    int16_t restoredId = -1;
+
+    dest.restoreDatabase(&firstIn, 0, &restoredId);
+    FPMStatus completed = dest.restoreDatabase(&secondIn);
+
+    printf("%-7s %-28s %s, %s\n", "[backup]", "full destination",
+           (truncated == FPMStatus::WRITE_ERROR && restoredId == lastId) ? "stopped" : "FAILED, not stopped",
+           (continued == FPMStatus::OK && completed == FPMStatus::OK && sameDatabase(src, srcEmu, dest, destEmu)) ? 
+           "resumed" : "FAILED to resume");
+}
+
+static void reportLatencies(const char * name, std::vector<double> & ns, uint32_t found)
+{
+    std::sort(ns.begin(), ns.end());
+
+    double total = 0;
+    for (size_t i = 0; i < ns.size(); i++) total += ns[i];
+
+    printf("%-7s %-28s N=%-6u  %6.2f ms avg  %6.2f ms p99  %u/%u found\n", "[hot]", name, (unsigned)ns.size(), 
+           total / ns.size() / 1e6, ns[ns.size() * 99 / 100] / 1e6, found, (unsigned)ns.size());
+}
+
+/* Identify latency with most matches going to a few users, without and with the hot set */
+static void benchHotSet(uint32_t iterations)
+{
+    const uint16_t USERS = 400, HOT_USERS = 8, FIRST_ID = FPM_HOTSET_MAX_BLOCK;
+
+    FPMEmulatorConfig cfg;
+    cfg.searchUsPerTemplate = 25;
+
+    FPMEmulator emu(cfg);
+    FPM finger(&emu);
+    FPMHotSet hotSet(&finger);
+
+    finger.begin();
+    hotSet.begin();
+
+    for (uint16_t u = 0; u < USERS; u++) {
+        emu.setFinger(true, 1000 + u);
+        finger.getImage();
+        finger.image2Tz(1);
+        hotSet.storeTemplate(FIRST_ID + u);
+    }
+
+    for (int withHotSet = 0; withHotSet < 2; withHotSet++)
+    {
+        std::vector<double> ns;
+        uint32_t found = 0;
+        srand(1);
+
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            /* 90% of the matches go to the last few users enrolled, the worst case for a full search */
+            uint16_t u = (rand() % 10) ? USERS - 1 - (rand() % HOT_USERS) : rand() % USERS;
+            uint16_t fid, score;
+
+            emu.setFinger(true, 1000 + u);
+            finger.getImage();
+            finger.image2Tz(1);
+
+            BenchClock::time_point start = BenchClock::now();
+            FPMStatus status = withHotSet ? hotSet.identify(&fid, &score) : finger.searchDatabase(&fid, &score);
+            ns.push_back(elapsedNs(start));
+
+            if (status == FPMStatus::OK && fid == FIRST_ID + u) found++;
+            if (withHotSet) hotSet.maintain();
+        }
+
+        reportLatencies(withHotSet ? "identify (hot set)" : "identify (full search)", ns, found);
+    }
+}
+
+/* Enrolls a print, then identifies it and downloads its image #rounds times, noting the outcome of every step */
+static void traceSession(FPM & finger, uint32_t rounds, std::vector<uint32_t> & outcomes)
+{
+    static uint8_t image[IMAGE_SZ];
+
+    outcomes.push_back(finger.begin());
+    outcomes.push_back(static_cast<uint16_t>(finger.getImage()));
+    outcomes.push_back(static_cast<uint16_t>(finger.image2Tz(1)));
+    outcomes.push_back(static_cast<uint16_t>(finger.storeTemplate(1)));
+
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        uint16_t id = 0, score = 0;
+
+        outcomes.push_back(static_cast<uint16_t>(finger.getImage()));
+        outcomes.push_back(static_cast<uint16_t>(finger.image2Tz(1)));
+        outcomes.push_back(static_cast<uint16_t>(finger.searchDatabase(&id, &score)));
+        outcomes.push_back(id);
+
+        FPMStatus status = finger.downloadImage();
+        outcomes.push_back(static_cast<uint16_t>(status));
+        if (status != FPMStatus::OK) continue;
+
+        uint32_t total = 0;
+        bool done = false;
+
+        while (!done && total < IMAGE_SZ) {
+            uint16_t len = IMAGE_SZ - total;
+            if (!finger.readDataPacket(&image[total], NULL, &len, &done)) break;
+            total += len;
+        }
+
+        outcomes.push_back(total);
+    }
+}
+
+/* Captures a session with the emulator (or loads a saved trace), then replays it and checks that it plays out the same */
+static void benchTrace(uint32_t rounds, double corruption, const char * savePath, const char * replayPath, bool realTime)
+{
+    std::vector<uint8_t> trace;
+    std::vector<uint32_t> captured, replayed;
+
+    if (replayPath == NULL)
+    {
+        FPMEmulatorConfig cfg;
+        cfg.corruptionRate = corruption;
+
+        FPMEmulator emu(cfg);
+        VectorStream traceOut(trace);
+        FPMTraceStream tracer(&emu, &traceOut);
+        FPM finger(&tracer);
+
+        emu.setFinger(true, 42);
+        tracer.begin();
+
+        BenchClock::time_point start = BenchClock::now();
+        traceSession(finger, rounds, captured);
+        tracer.flushTrace();
+
+        double ns = elapsedNs(start);
+        printf("%-7s %-28s N=%-6u  %8.2f ms  %u bytes of trace  %u bad packets\n", "[trace]", "capture", rounds, 
+               ns / 1e6, (unsigned)trace.size(), emu.badPacketsIn);
+
+        if (savePath != NULL) {
+            FILE * f = fopen(savePath, "wb");
+            if (f == NULL || fwrite(trace.data(), 1, trace.size(), f) != trace.size()) printf("failed to write %s\n", savePath);
+            if (f != NULL) fclose(f);
+        }
+    }
+    else
+    {
+        FILE * f = fopen(replayPath, "rb");
+        if (f == NULL) {
+            printf("failed to read %s\n", replayPath);
+            return;
+        }
+
+        uint8_t chunk[4096];
+        size_t len;
+        while ((len = fread(chunk, 1, sizeof(chunk), f)) > 0) trace.insert(trace.end(), chunk, chunk + len);
+        fclose(f);
+    }
+
+    FPMReplayStream replay(trace.data(), trace.size(), realTime);
+    if (!replay.valid()) {
+        printf("not a trace\n");
+        return;
+    }
+
+    FPM finger(&replay);
+
+    BenchClock::time_point start = BenchClock::now();
+    traceSession(finger, rounds, replayed);
+    double ns = elapsedNs(start);
+
+    printf("%-7s %-28s N=%-6u  %8.2f ms  %8.2f ns/byte  %u bytes written, %u unexpected  %s\n", "[trace]", 
+           realTime ? "replay (original timing)" : "replay", rounds, ns / 1e6, ns / replay.bytesRead, 
+           replay.bytesWritten, replay.mismatches, replay.finished() ? "all played" : "not all played");
+
+    if (replayPath == NULL) {
+        printf("%-7s %-28s %s\n", "[trace]", "outcomes", (captured == replayed) ? "identical" : "differ");
+    }
+}
+
+/* Time from power-up to a ready sensor, cold and with params cached from an earlier session */
+static void benchStartup(uint32_t iterations)
+{
+    FPMEmulatorConfig cfg;
+    cfg.bootTimeUs = 300000;
+
+    FPMEmulator emu(cfg);
+    FPMSystemParams params;
+    FPMProductInfo info;
+
+    for (int cached = 0; cached < 2; cached++)
+    {
+        double total = 0;
+        uint32_t ok = 0, packets = 0;
+
+        for (uint32_t i = 0; i < iterations; i++)
+        {
+            FPM finger(&emu);
+            if (cached) finger.setCachedParams(&params, &info);
+
+            emu.powerCycle();
+            uint32_t packetsBefore = emu.packetsIn;
+
+            BenchClock::time_point start = BenchClock::now();
+            if (finger.begin()) ok++;
+            total += elapsedNs(start);
+            packets += emu.packetsIn - packetsBefore;
+
+            if (!cached) {
+                finger.readParams(&params);
+                finger.readProductInfo(&info);
+            }
+        }
+
+        printf("%-7s %-28s N=%-6u  %6.1f ms avg  %4.1f packets sent  %u/%u ready  (boot takes %u ms)\n", "[start]",
+               cached ? "begin (cached params)" : "begin (cold)", iterations, total / iterations / 1e6,
+               (double)packets / iterations, ok, iterations, cfg.bootTimeUs / 1000);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    uint32_t iterations = 200;
+    double corruption = 0.0;
+    std::vector<const char *> images;
+    const char * savePath = NULL;
+    const char * replayPath = NULL;
+    bool realTime = false;
+
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-n") == 0)         iterations = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-c") == 0)    corruption = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "-i") == 0)    images.push_back(argv[++i]);
+        else if (strcmp(argv[i], "-w") == 0)    savePath = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0)    replayPath = argv[++i];
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0)         realTime = true;
+    }
+
+    FPMEmulatorConfig cfg;
+    FPMEmulator emu(cfg);
+    FPM finger(&emu);
+
+    if (!finger.begin()) {
+        printf("begin() failed\n");
+        return 1;
+    }
+
+    /* something to extract features from and to search */
+    emu.setFinger(true, 42);
+    finger.getImage();
+    finger.image2Tz(1);
+    finger.storeTemplate(cfg.capacity - 1);
+
+    emu.setCorruptionRate(corruption);
+
+    benchAcks(finger, iterations * 50);
+
+    for (uint8_t plen = 0; plen <= static_cast<uint8_t>(FPMPacketLength::PLEN_256); plen++) {
+        finger.setPacketLength(static_cast<FPMPacketLength>(plen));
+
+        benchReads(finger, FPM::packetLengths[plen], iterations);
+        benchWrites(finger, emu, FPM::packetLengths[plen], iterations * 20);
+    }
+
+#if (FPM_METRICS)
+    reportMetrics(finger);
+#endif
+
+    std::vector<std::vector<uint8_t> > packedImages;
+    loadImages(images, packedImages);
+
+    benchTee(finger, FPM::packetLengths[static_cast<uint8_t>(FPMPacketLength::PLEN_256)], iterations);
+    benchImage(iterations);
+    benchQuality(packedImages, iterations);
+    benchCompression(packedImages, !images.empty(), iterations);
+
+    for (uint8_t n = 1; n <= FPM_GROUP_MAX_SENSORS; n++) {
+        benchGroup(n, false, 1000);
+#if (FPM_GROUP_WORKERS)
+        benchGroup(n, true, 1000);
+#endif
+    }
+
+    for (uint8_t n = 1; n <= FPM_MAX_SHARDS; n++) {
+        benchShards(n, 10);
+    }
+
+    benchSearch(iterations);
+    benchBackup();
+    benchHotSet(iterations);
+    benchStartup(5);
+    benchTrace(20, (corruption != 0) ? corruption : 0.0005, savePath, replayPath, realTime);
+
+    printf("emulator: %u packets in (%u bad), %u packets out, %.2f port writes per packet in\n", 
+           emu.packetsIn, emu.badPacketsIn, emu.packetsOut, (double)emu.writeCalls / emu.packetsIn);
+    return 0;
+}
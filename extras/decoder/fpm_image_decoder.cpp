@@ -0,0 +1,144 @@
+/***************************************************
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm_image_decoder.h"
+
+#include <string.h>
+
+/* must match the encoder */
+#define FPM_IMAGEZ_ERROR_WINDOW     32
+
+FPMImageDecoder::FPMImageDecoder(const uint8_t * data, size_t len) :
+    data(data), len(len), bitPos(0)
+{
+
+}
+
+bool FPMImageDecoder::getBit(uint8_t * bit)
+{
+    if (bitPos >= len * 8) return false;
+
+    *bit = (data[bitPos / 8] >> (7 - (bitPos % 8))) & 1;
+    bitPos++;
+    return true;
+}
+
+bool FPMImageDecoder::getBits(uint8_t count, uint32_t * value)
+{
+    *value = 0;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint8_t bit;
+        if (!getBit(&bit)) return false;
+
+        *value = (*value << 1) | bit;
+    }
+
+    return true;
+}
+
+bool FPMImageDecoder::decode(const uint8_t * data, size_t len, std::vector<uint8_t> & packed,
+                             uint16_t * width, uint16_t * height)
+{
+    if (len < FPM_IMAGEZ_HEADER_LEN || memcmp(data, FPM_IMAGEZ_MAGIC, 4) != 0 || data[4] != FPM_IMAGEZ_VERSION) return false;
+
+    const uint16_t w = data[5] | (data[6] << 8);
+    const uint16_t h = data[7] | (data[8] << 8);
+    const uint32_t totalPixels = (uint32_t)w * h;
+
+    if (w == 0 || h == 0) return false;
+    if (width != NULL) *width = w;
+    if (height != NULL) *height = h;
+
+    FPMImageDecoder reader(data + FPM_IMAGEZ_HEADER_LEN, len - FPM_IMAGEZ_HEADER_LEN);
+
+    std::vector<uint8_t> pixels(totalPixels);
+    uint32_t runLength = 0;
+    uint16_t errorSum = 4;
+    uint8_t errorCount = 1;
+
+    for (uint32_t i = 0; i < totalPixels; i++)
+    {
+        const uint16_t column = i % w;
+
+        /* same neighbours and prediction as the encoder */
+        const uint8_t above = (i >= w) ? pixels[i - w] : 0x0F;
+        const uint8_t a = column ? pixels[i - 1] : above;
+        const uint8_t c = column ? ((i >= w) ? pixels[i - w - 1] : 0x0F) : above;
+        const uint8_t predicted = FPMImageCompressor::predict(a, above, c);
+
+        uint8_t folded = 0;
+
+        if (runLength == 0)
+        {
+            uint8_t flag;
+            if (!reader.getBit(&flag)) return false;
+
+            if (flag == 0)
+            {
+                /* a run, in Elias gamma code */
+                uint8_t zeros = 0, bit = 0;
+
+                while (reader.getBit(&bit) && bit == 0) {
+                    if (++zeros > 31) return false;
+                }
+
+                if (bit != 1) return false;
+
+                uint32_t rest;
+                if (!reader.getBits(zeros, &rest)) return false;
+
+                runLength = (1UL << zeros) | rest;
+            }
+            else
+            {
+                /* an error, in Rice code */
+                const uint8_t k = FPMImageCompressor::riceParam(errorSum, errorCount);
+                uint8_t q = 0, bit;
+
+                while (reader.getBit(&bit) && bit == 1) {
+                    if (++q > 15) return false;
+                }
+
+                if (bit != 0) return false;
+
+                uint32_t remainder;
+                if (!reader.getBits(k, &remainder)) return false;
+
+                const uint8_t value = (q << k) | remainder;
+                if (value > 14) return false;
+
+                folded = value + 1;
+                errorSum += value;
+
+                if (++errorCount == FPM_IMAGEZ_ERROR_WINDOW) {
+                    errorSum >>= 1;
+                    errorCount >>= 1;
+                }
+            }
+        }
+
+        if (runLength != 0)
+        {
+            runLength--;
+            folded = 0;
+        }
+
+        const int8_t error = (folded & 1) ? -((folded + 1) / 2) : folded / 2;
+        pixels[i] = (predicted + error) & 0x0F;
+    }
+
+    /* any run must end exactly with the image */
+    if (runLength != 0) return false;
+
+    packed.assign((totalPixels + 1) / 2, 0);
+
+    for (uint32_t i = 0; i < totalPixels; i++) {
+        packed[i / 2] |= (i & 1) ? pixels[i] : (pixels[i] << 4);
+    }
+
+    return true;
+}
@@ -0,0 +1,35 @@
+/***************************************************
+  Host-side decoder for images compressed by FPMImageCompressor (see fpm_image.h),
+  back into the sensor's own format: 2 pixels per byte, 4 bits each, upper nibble first.
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_IMAGE_DECODER_H_
+#define FPM_IMAGE_DECODER_H_
+
+#include <fpm_image.h>
+
+#include <vector>
+
+class FPMImageDecoder
+{
+    public:
+    /** Decodes a whole compressed image, header included, into #packed.
+     *  Returns false if the data is malformed or cut short. */
+    static bool decode(const uint8_t * data, size_t len, std::vector<uint8_t> & packed,
+                       uint16_t * width = NULL, uint16_t * height = NULL);
+
+    private:
+    FPMImageDecoder(const uint8_t * data, size_t len);
+
+    const uint8_t * data;
+    size_t len;
+    size_t bitPos;
+
+    bool getBit(uint8_t * bit);
+    bool getBits(uint8_t count, uint32_t * value);
+};
+
+#endif
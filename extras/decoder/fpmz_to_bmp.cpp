@@ -0,0 +1,93 @@
+/***************************************************
+  Turns an image compressed by FPMImageCompressor back into a BMP (or PGM) file.
+
+  Build and run from the root of the library:
+
+    g++ -O2 -std=gnu++11 -Iextras/host -Isrc -Iextras/decoder \
+        src/fpm_image.cpp extras/decoder/fpm_image_decoder.cpp extras/decoder/fpmz_to_bmp.cpp -o fpmz_to_bmp
+    ./fpmz_to_bmp print.fpmz print.bmp
+
+  The output is a PGM file instead if its name ends with .pgm.
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include <Arduino.h>
+#include <fpm_image.h>
+#include "fpm_image_decoder.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+/* Writes straight to a file */
+class FileStream : public Stream
+{
+    public:
+    FileStream(FILE * fp) : fp(fp) { }
+
+    size_t write(uint8_t c) { return fwrite(&c, 1, 1, fp); }
+    size_t write(const uint8_t * buffer, size_t size) { return fwrite(buffer, 1, size, fp); }
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+    int peek(void) { return -1; }
+
+    private:
+    FILE * fp;
+};
+
+int main(int argc, char ** argv)
+{
+    if (argc != 3) {
+        printf("usage: %s <input.fpmz> <output.bmp|output.pgm>\n", argv[0]);
+        return 1;
+    }
+
+    FILE * in = fopen(argv[1], "rb");
+    if (in == NULL) {
+        printf("can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t n;
+
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) data.insert(data.end(), chunk, chunk + n);
+    fclose(in);
+
+    std::vector<uint8_t> packed;
+    uint16_t width, height;
+
+    if (!FPMImageDecoder::decode(data.empty() ? NULL : &data[0], data.size(), packed, &width, &height)) {
+        printf("%s is not a valid compressed image\n", argv[1]);
+        return 1;
+    }
+
+    FILE * out = fopen(argv[2], "wb");
+    if (out == NULL) {
+        printf("can't create %s\n", argv[2]);
+        return 1;
+    }
+
+    const size_t nameLen = strlen(argv[2]);
+    const bool pgm = nameLen > 4 && strcmp(argv[2] + nameLen - 4, ".pgm") == 0;
+
+    FileStream file(out);
+    FPMImageWriter writer(&file, pgm ? FPMImageFormat::PGM : FPMImageFormat::BMP, width, height);
+
+    writer.begin();
+    writer.write(&packed[0], packed.size());
+    FPMStatus status = writer.end();
+
+    fclose(out);
+
+    if (status != FPMStatus::OK) {
+        printf("failed to write %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("%ux%u image: %u bytes -> %s\n", width, height, (unsigned)data.size(), argv[2]);
+    return 0;
+}
@@ -0,0 +1,704 @@
+/***************************************************
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm_emulator.h"
+
+#include <math.h>
+
+#define FPM_EMU_HEADER_LEN      9
+#define FPM_EMU_MATCH_SCORE     150
+
+FPMEmulatorConfig::FPMEmulatorConfig() :
+    address(FPM_DEFAULT_ADDRESS), password(FPM_DEFAULT_PASSWORD),
+    capacity(1000), securityLevel(FPMSecurityLevel::FRR_3),
+    packetLen(FPMPacketLength::PLEN_128), baudRate(FPMBaud::B57600),
+    templateSize(512), imageWidth(256), imageHeight(288),
+    hasProductInfo(true), commandLatencyUs(0), searchUsPerTemplate(0), bootTimeUs(0), paceToBaudRate(false),
+    corruptionRate(0.0), seed(1)
+{
+
+}
+
+FPMEmulator::FPMEmulator(const FPMEmulatorConfig & config) :
+    packetsIn(0), packetsOut(0), bytesIn(0), bytesOut(0), badPacketsIn(0), writeCalls(0),
+    cfg(config), hostBaud(0), poweredAt(micros()),
+    inState(InState::HEADER), inHeader(0), inExpected(0),
+    rxPos(0), lastReadyAt(0), rng(config.seed),
+    database(config.capacity), fingerPresent(true), imageCaptured(false), fingerSeed(1),
+    dataState(DataState::NONE), dataSlot(1)
+{
+    for (int i = 0; i < 256; i++) {
+        latencies[i] = cfg.commandLatencyUs;
+    }
+}
+
+void FPMEmulator::begin(unsigned long baud)
+{
+    hostBaud = baud;
+    rxReady.clear();
+    rxPos = 0;
+    rxPending.clear();
+    inState = InState::HEADER;
+    inHeader = 0;
+}
+
+void FPMEmulator::powerCycle(void)
+{
+    /* the database survives, everything else is lost */
+    poweredAt = micros();
+    begin(hostBaud);
+
+    charBuffers[0].clear();
+    charBuffers[1].clear();
+    imageCaptured = false;
+    dataState = DataState::NONE;
+}
+
+bool FPMEmulator::linkUp(void) const
+{
+    /* a host baud of 0 means the link was never configured, so always accept */
+    return hostBaud == 0 || hostBaud == 9600UL * static_cast<uint16_t>(cfg.baudRate);
+}
+
+void FPMEmulator::setCommandLatency(uint8_t command, uint32_t latencyUs)
+{
+    latencies[command] = latencyUs;
+}
+
+void FPMEmulator::setCorruptionRate(double rate)
+{
+    cfg.corruptionRate = rate;
+}
+
+void FPMEmulator::setFinger(bool present, uint32_t seed)
+{
+    fingerPresent = present;
+    fingerSeed = seed;
+}
+
+void FPMEmulator::setImage(const uint8_t * img, size_t len)
+{
+    image.assign(img, img + len);
+    imageCaptured = true;
+}
+
+void FPMEmulator::storeTemplate(uint16_t id, const uint8_t * tmpl, size_t len)
+{
+    if (id < database.size()) {
+        database[id].assign(tmpl, tmpl + len);
+    }
+}
+
+bool FPMEmulator::isOccupied(uint16_t id) const
+{
+    return id < database.size() && !database[id].empty();
+}
+
+/*********************** Stream interface ***********************/
+
+void FPMEmulator::releasePending(void)
+{
+    if (rxPending.empty()) return;
+
+    unsigned long now = micros();
+    while (!rxPending.empty() && (long)(now - rxPending.front().readyAt) >= 0) {
+        rxReady.insert(rxReady.end(), rxPending.front().bytes.begin(), rxPending.front().bytes.end());
+        rxPending.pop_front();
+    }
+}
+
+int FPMEmulator::available(void)
+{
+    releasePending();
+    return (int)(rxReady.size() - rxPos);
+}
+
+int FPMEmulator::read(void)
+{
+    releasePending();
+    if (rxPos == rxReady.size()) return -1;
+
+    uint8_t c = rxReady[rxPos++];
+
+    /* reclaim the space once everything has been read */
+    if (rxPos == rxReady.size()) {
+        rxReady.clear();
+        rxPos = 0;
+    }
+
+    return c;
+}
+
+int FPMEmulator::peek(void)
+{
+    releasePending();
+    return (rxPos == rxReady.size()) ? -1 : rxReady[rxPos];
+}
+
+size_t FPMEmulator::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t FPMEmulator::write(const uint8_t * buffer, size_t size)
+{
+    if (!linkUp()) return size;
+
+    /* still booting, so the bytes are lost */
+    if ((unsigned long)(micros() - poweredAt) < cfg.bootTimeUs) return size;
+
+    writeCalls++;
+    bytesIn += size;
+
+    for (size_t i = 0; i < size; i++) {
+        uint8_t c = buffer[i];
+
+        switch (inState)
+        {
+            case InState::HEADER:
+                inHeader = (inHeader << 8) | c;
+                if (inHeader == FPM_STARTCODE) {
+                    inHeader = 0;
+                    inPacket.clear();
+                    inState = InState::METADATA;
+                }
+                break;
+
+            case InState::METADATA:
+            {
+                /* Address (4), Packet ID (1), Length (2) */
+                inPacket.push_back(c);
+                if (inPacket.size() < 7) break;
+
+                uint16_t len = (inPacket[5] << 8) | inPacket[6];
+                if (len <= 2 || len > FPM_MAX_PACKET_LEN + 2) {
+                    badPacketsIn++;
+                    inState = InState::HEADER;
+                    break;
+                }
+
+                inExpected = 7 + len;
+                inState = InState::PAYLOAD;
+                break;
+            }
+
+            case InState::PAYLOAD:
+            {
+                inPacket.push_back(c);
+                if (inPacket.size() < inExpected) break;
+
+                inState = InState::HEADER;
+
+                uint32_t addr = ((uint32_t)inPacket[0] << 24) | ((uint32_t)inPacket[1] << 16) |
+                                ((uint32_t)inPacket[2] << 8) | inPacket[3];
+                if (addr != cfg.address) {
+                    badPacketsIn++;
+                    break;
+                }
+
+                uint16_t sum = 0;
+                for (size_t j = 4; j < inPacket.size() - 2; j++) {
+                    sum += inPacket[j];
+                }
+
+                uint16_t pktSum = (inPacket[inPacket.size() - 2] << 8) | inPacket[inPacket.size() - 1];
+                uint8_t pktId = inPacket[4];
+
+                if (sum != pktSum) {
+                    badPacketsIn++;
+                    if (pktId == FPM_COMMANDPACKET) {
+                        sendAck(0, static_cast<uint8_t>(FPMStatus::PACKETRECIEVEERR));
+                    }
+                    break;
+                }
+
+                packetsIn++;
+                handlePacket(pktId, &inPacket[7], inPacket.size() - 7 - 2);
+                break;
+            }
+        }
+    }
+
+    return size;
+}
+
+/*********************** Packet output ***********************/
+
+uint16_t FPMEmulator::packetLength(void) const
+{
+    return FPM::packetLengths[static_cast<uint16_t>(cfg.packetLen)];
+}
+
+void FPMEmulator::queuePacket(uint8_t pktId, const uint8_t * payload, uint16_t len, unsigned long readyAt)
+{
+    if (!linkUp()) return;
+
+    uint16_t totalLen = len + 2;
+    std::vector<uint8_t> pkt;
+    pkt.reserve(FPM_EMU_HEADER_LEN + totalLen);
+
+    pkt.push_back(FPM_STARTCODE >> 8); pkt.push_back(FPM_STARTCODE & 0xFF);
+    pkt.push_back(cfg.address >> 24); pkt.push_back(cfg.address >> 16);
+    pkt.push_back(cfg.address >> 8); pkt.push_back(cfg.address);
+    pkt.push_back(pktId);
+    pkt.push_back(totalLen >> 8); pkt.push_back(totalLen & 0xFF);
+    pkt.insert(pkt.end(), payload, payload + len);
+
+    uint16_t sum = pktId + (totalLen >> 8) + (totalLen & 0xFF);
+    for (uint16_t i = 0; i < len; i++) {
+        sum += payload[i];
+    }
+
+    pkt.push_back(sum >> 8); pkt.push_back(sum & 0xFF);
+
+    if (cfg.corruptionRate > 0.0 &&
+        std::uniform_real_distribution<double>(0.0, 1.0)(rng) < cfg.corruptionRate)
+    {
+        size_t pos = std::uniform_int_distribution<size_t>(0, pkt.size() - 1)(rng);
+        pkt[pos] ^= (uint8_t)(1 << std::uniform_int_distribution<int>(0, 7)(rng));
+    }
+
+    packetsOut++;
+    bytesOut += pkt.size();
+
+    /* the time taken to shift the packet out at the sensor's baud rate */
+    if (cfg.paceToBaudRate) {
+        unsigned long bitsPerSec = 9600UL * static_cast<uint16_t>(cfg.baudRate);
+        unsigned long start = (readyAt != 0 && (long)(readyAt - lastReadyAt) > 0) ? readyAt : lastReadyAt;
+        if ((long)(micros() - start) > 0) start = micros();
+        readyAt = start + (unsigned long)(pkt.size() * 10ULL * 1000000ULL / bitsPerSec);
+        lastReadyAt = readyAt;
+    }
+
+    /* fast path, when there's nothing to wait for */
+    if (readyAt == 0 && rxPending.empty()) {
+        rxReady.insert(rxReady.end(), pkt.begin(), pkt.end());
+        return;
+    }
+
+    PendingBytes pending;
+    pending.readyAt = readyAt;
+    pending.bytes.swap(pkt);
+    rxPending.push_back(pending);
+}
+
+void FPMEmulator::sendAck(uint8_t cmd, uint8_t confirmCode, const uint8_t * data, uint16_t len, uint32_t extraLatencyUs)
+{
+    uint8_t payload[FPM_MAX_PACKET_LEN];
+    payload[0] = confirmCode;
+    if (len) memcpy(&payload[1], data, len);
+
+    uint32_t latency = latencies[cmd] + extraLatencyUs;
+    unsigned long readyAt = latency ? micros() + latency : 0;
+    queuePacket(FPM_ACKPACKET, payload, len + 1, readyAt);
+}
+
+void FPMEmulator::sendData(uint8_t cmd, const std::vector<uint8_t> & data)
+{
+    const uint16_t PACKET_LEN = packetLength();
+    unsigned long readyAt = latencies[cmd] ? micros() + latencies[cmd] : 0;
+
+    for (size_t pos = 0; pos < data.size(); pos += PACKET_LEN) {
+        uint16_t len = (uint16_t)min(data.size() - pos, (size_t)PACKET_LEN);
+        bool last = (pos + len == data.size());
+        queuePacket(last ? FPM_ENDDATAPACKET : FPM_DATAPACKET, &data[pos], len, readyAt);
+    }
+}
+
+/*********************** Sensor model ***********************/
+
+std::vector<uint8_t> * FPMEmulator::charBuffer(uint8_t slot)
+{
+    if (slot < 1 || slot > 2) return NULL;
+    return &charBuffers[slot - 1];
+}
+
+void FPMEmulator::generateImage(void)
+{
+    /* concentric ridges around a finger-dependent core, on a light background */
+    const int w = cfg.imageWidth;
+    const int h = cfg.imageHeight;
+    const double cx = w / 2.0 + (int)(fingerSeed % 31) - 15;
+    const double cy = h / 2.0 + (int)((fingerSeed / 31) % 31) - 15;
+    const double period = 7.0 + (fingerSeed % 5);
+
+    image.assign((size_t)w * h / 2, 0);
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x += 2) {
+            uint8_t px[2];
+
+            for (int k = 0; k < 2; k++) {
+                double dx = (x + k - cx) / (w * 0.38);
+                double dy = (y - cy) / (h * 0.42);
+
+                if (dx * dx + dy * dy > 1.0) {
+                    px[k] = 0xF;
+                }
+                else {
+                    double r = sqrt((x + k - cx) * (x + k - cx) + (y - cy) * (y - cy));
+                    double v = 0.5 + 0.5 * sin(r * 2 * M_PI / period);
+                    px[k] = (uint8_t)(2 + v * 9);
+                }
+            }
+
+            image[(size_t)y * (w / 2) + x / 2] = (px[0] << 4) | px[1];
+        }
+    }
+}
+
+void FPMEmulator::extractFeatures(std::vector<uint8_t> & tmpl)
+{
+    /* Not real features, just a template that identifies its finger:
+     * a fixed prefix, the finger's identity, then noise and a zero-padded tail */
+    tmpl.assign(cfg.templateSize, 0);
+    tmpl[0] = 0x03; tmpl[1] = 0x01;
+    tmpl[2] = fingerSeed >> 24; tmpl[3] = fingerSeed >> 16;
+    tmpl[4] = fingerSeed >> 8; tmpl[5] = fingerSeed;
+
+    std::mt19937 noise(fingerSeed);
+    for (size_t i = 6; i < tmpl.size() * 3 / 4; i++) {
+        tmpl[i] = (uint8_t)noise();
+    }
+}
+
+uint32_t FPMEmulator::identityOf(const std::vector<uint8_t> & tmpl)
+{
+    if (tmpl.size() < 6) return 0;
+    return ((uint32_t)tmpl[2] << 24) | ((uint32_t)tmpl[3] << 16) | ((uint32_t)tmpl[4] << 8) | tmpl[5];
+}
+
+void FPMEmulator::handlePacket(uint8_t pktId, const uint8_t * payload, uint16_t len)
+{
+    if (pktId == FPM_COMMANDPACKET) {
+        dataState = DataState::NONE;
+        handleCommand(payload, len);
+        return;
+    }
+
+    if ((pktId != FPM_DATAPACKET && pktId != FPM_ENDDATAPACKET) || dataState != DataState::RECEIVING_TEMPLATE) {
+        badPacketsIn++;
+        return;
+    }
+
+    dataIn.insert(dataIn.end(), payload, payload + len);
+
+    if (pktId == FPM_ENDDATAPACKET) {
+        charBuffer(dataSlot)->swap(dataIn);
+        dataIn.clear();
+        dataState = DataState::NONE;
+    }
+}
+
+void FPMEmulator::handleCommand(const uint8_t * p, uint16_t len)
+{
+    const uint8_t OK = static_cast<uint8_t>(FPMStatus::OK);
+    uint8_t cmd = p[0];
+    uint8_t out[FPM_MAX_PACKET_LEN];
+
+    switch (cmd)
+    {
+        case FPM_HANDSHAKE:
+            sendAck(cmd, static_cast<uint8_t>(FPMStatus::HANDSHAKE_OK));
+            break;
+
+        case FPM_VERIFYPASSWORD:
+        {
+            if (len < 5) { sendAck(cmd, static_cast<uint8_t>(FPMStatus::PACKETRECIEVEERR)); break; }
+            uint32_t pwd = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 8) | p[4];
+            sendAck(cmd, (pwd == cfg.password) ? OK : static_cast<uint8_t>(FPMStatus::PASSFAIL));
+            break;
+        }
+
+        case FPM_SETPASSWORD:
+            cfg.password = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 8) | p[4];
+            sendAck(cmd, OK);
+            break;
+
+        case FPM_SETADDRESS:
+            /* ACKed from the old address */
+            sendAck(cmd, OK);
+            cfg.address = ((uint32_t)p[1] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 8) | p[4];
+            break;
+
+        case FPM_READSYSPARAM:
+        {
+            uint16_t plen = static_cast<uint16_t>(cfg.packetLen);
+            uint16_t baud = static_cast<uint16_t>(cfg.baudRate);
+            uint16_t sec = static_cast<uint16_t>(cfg.securityLevel);
+
+            out[0] = 0; out[1] = 0;
+            out[2] = 0; out[3] = 0x09;
+            out[4] = cfg.capacity >> 8; out[5] = cfg.capacity & 0xFF;
+            out[6] = sec >> 8; out[7] = sec & 0xFF;
+            out[8] = cfg.address >> 24; out[9] = cfg.address >> 16;
+            out[10] = cfg.address >> 8; out[11] = cfg.address;
+            out[12] = plen >> 8; out[13] = plen & 0xFF;
+            out[14] = baud >> 8; out[15] = baud & 0xFF;
+
+            sendAck(cmd, OK, out, FPM_SYS_PARAMS_LEN);
+            break;
+        }
+
+        case FPM_SETSYSPARAM:
+        {
+            uint8_t param = p[1], value = p[2];
+            uint8_t code = OK;
+
+            if (param == static_cast<uint8_t>(FPMParameter::BAUD_RATE) && value >= 1 && value <= 12) {
+                /* the ACK still goes out at the old rate */
+                sendAck(cmd, OK);
+                cfg.baudRate = static_cast<FPMBaud>(value);
+                break;
+            }
+            else if (param == static_cast<uint8_t>(FPMParameter::SECURITY_LEVEL) && value >= 1 && value <= 5)
+                cfg.securityLevel = static_cast<FPMSecurityLevel>(value);
+            else if (param == static_cast<uint8_t>(FPMParameter::PACKET_LENGTH) && value <= 3)
+                cfg.packetLen = static_cast<FPMPacketLength>(value);
+            else
+                code = static_cast<uint8_t>(FPMStatus::INVALIDREG);
+
+            sendAck(cmd, code);
+            break;
+        }
+
+        case FPM_READPRODINFO:
+        {
+            if (!cfg.hasProductInfo) { sendAck(cmd, static_cast<uint8_t>(FPMStatus::PACKETRECIEVEERR)); break; }
+
+            memset(out, 0, FPM_PRODUCT_INFO_LEN);
+            memcpy(&out[0], "FPM-EMULATOR", 12);
+            memcpy(&out[16], "0001", 4);
+            memcpy(&out[20], "00000001", 8);
+            out[28] = 1; out[29] = 0;
+            memcpy(&out[30], "EMU", 3);
+            out[38] = cfg.imageWidth >> 8; out[39] = cfg.imageWidth & 0xFF;
+            out[40] = cfg.imageHeight >> 8; out[41] = cfg.imageHeight & 0xFF;
+            out[42] = cfg.templateSize >> 8; out[43] = cfg.templateSize & 0xFF;
+            out[44] = cfg.capacity >> 8; out[45] = cfg.capacity & 0xFF;
+
+            sendAck(cmd, OK, out, FPM_PRODUCT_INFO_LEN);
+            break;
+        }
+
+        case FPM_GETIMAGE:
+        case FPM_GETIMAGE_ONLY:
+            if (!fingerPresent) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::NOFINGER));
+                break;
+            }
+
+            generateImage();
+            imageCaptured = true;
+            sendAck(cmd, OK);
+            break;
+
+        case FPM_IMAGE2TZ:
+        {
+            std::vector<uint8_t> * cb = charBuffer(p[1]);
+            if (cb == NULL || !imageCaptured) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::FEATUREFAIL));
+                break;
+            }
+
+            extractFeatures(*cb);
+            sendAck(cmd, OK);
+            break;
+        }
+
+        case FPM_REGMODEL:
+            if (charBuffers[0].empty() || identityOf(charBuffers[0]) != identityOf(charBuffers[1])) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::ENROLLMISMATCH));
+                break;
+            }
+
+            charBuffers[1] = charBuffers[0];
+            sendAck(cmd, OK);
+            break;
+
+        case FPM_STORE:
+        {
+            std::vector<uint8_t> * cb = charBuffer(p[1]);
+            uint16_t id = (p[2] << 8) | p[3];
+
+            if (cb == NULL || id >= cfg.capacity) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::BADLOCATION));
+                break;
+            }
+
+            database[id] = *cb;
+            sendAck(cmd, OK);
+            break;
+        }
+
+        case FPM_LOAD:
+        {
+            std::vector<uint8_t> * cb = charBuffer(p[1]);
+            uint16_t id = (p[2] << 8) | p[3];
+
+            if (cb == NULL || id >= cfg.capacity || database[id].empty()) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::DBREADFAIL));
+                break;
+            }
+
+            *cb = database[id];
+            sendAck(cmd, OK);
+            break;
+        }
+
+        case FPM_UPCHAR:
+        {
+            std::vector<uint8_t> * cb = charBuffer(p[1]);
+            if (cb == NULL || cb->empty()) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::UPLOADFEATUREFAIL));
+                break;
+            }
+
+            sendAck(cmd, OK);
+            sendData(cmd, *cb);
+            break;
+        }
+
+        case FPM_DOWNCHAR:
+            if (charBuffer(p[1]) == NULL) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::PACKETRESPONSEFAIL));
+                break;
+            }
+
+            dataSlot = p[1];
+            dataIn.clear();
+            sendAck(cmd, OK);
+            dataState = DataState::RECEIVING_TEMPLATE;
+            break;
+
+        case FPM_IMGUPLOAD:
+            if (!imageCaptured) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::UPLOADFAIL));
+                break;
+            }
+
+            sendAck(cmd, OK);
+            sendData(cmd, image);
+            break;
+
+        case FPM_DELETE:
+        {
+            uint16_t id = (p[1] << 8) | p[2];
+            uint16_t howMany = (p[3] << 8) | p[4];
+
+            if ((uint32_t)id + howMany > cfg.capacity) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::DELETEFAIL));
+                break;
+            }
+
+            for (uint16_t i = 0; i < howMany; i++) {
+                database[id + i].clear();
+            }
+
+            sendAck(cmd, OK);
+            break;
+        }
+
+        case FPM_EMPTYDATABASE:
+            for (size_t i = 0; i < database.size(); i++) {
+                database[i].clear();
+            }
+
+            sendAck(cmd, OK);
+            break;
+
+        case FPM_SEARCH:
+        case FPM_HISPEEDSEARCH:
+        {
+            std::vector<uint8_t> * cb = charBuffer(p[1]);
+            uint16_t start = (p[2] << 8) | p[3];
+            uint16_t count = (p[4] << 8) | p[5];
+
+            memset(out, 0, 4);
+
+            if (cb == NULL || cb->empty()) {
+                sendAck(cmd, static_cast<uint8_t>(FPMStatus::NOTFOUND), out, 4);
+                break;
+            }
+
+            uint32_t identity = identityOf(*cb);
+            uint32_t end = min((uint32_t)start + count, (uint32_t)cfg.capacity);
+            uint32_t searchUs = 0;
+
+            for (uint32_t id = start; id < end; id++) {
+                if (database[id].empty()) continue;
+
+                searchUs += cfg.searchUsPerTemplate;
+
+                if (identityOf(database[id]) == identity) {
+                    out[0] = id >> 8; out[1] = id & 0xFF;
+                    out[2] = FPM_EMU_MATCH_SCORE >> 8; out[3] = FPM_EMU_MATCH_SCORE & 0xFF;
+                    sendAck(cmd, OK, out, 4, searchUs);
+                    return;
+                }
+            }
+
+            sendAck(cmd, static_cast<uint8_t>(FPMStatus::NOTFOUND), out, 4, searchUs);
+            break;
+        }
+
+        case FPM_PAIRMATCH:
+        {
+            bool match = !charBuffers[0].empty() && identityOf(charBuffers[0]) == identityOf(charBuffers[1]);
+            uint16_t score = match ? FPM_EMU_MATCH_SCORE : 0;
+
+            out[0] = score >> 8; out[1] = score & 0xFF;
+            sendAck(cmd, match ? OK : static_cast<uint8_t>(FPMStatus::NOMATCH), out, 2);
+            break;
+        }
+
+        case FPM_TEMPLATECOUNT:
+        {
+            uint16_t count = 0;
+            for (size_t i = 0; i < database.size(); i++) {
+                if (!database[i].empty()) count++;
+            }
+
+            out[0] = count >> 8; out[1] = count & 0xFF;
+            sendAck(cmd, OK, out, 2);
+            break;
+        }
+
+        case FPM_READTEMPLATEINDEX:
+        {
+            const uint16_t INDEX_LEN = FPM_TEMPLATES_PER_PAGE / 8;
+            uint32_t base = (uint32_t)p[1] * FPM_TEMPLATES_PER_PAGE;
+
+            memset(out, 0, INDEX_LEN);
+            for (uint16_t i = 0; i < FPM_TEMPLATES_PER_PAGE; i++) {
+                if (base + i < database.size() && !database[base + i].empty()) {
+                    out[i / 8] |= (1 << (i % 8));
+                }
+            }
+
+            sendAck(cmd, OK, out, INDEX_LEN);
+            break;
+        }
+
+        case FPM_GETRANDOM:
+        {
+            uint32_t number = rng();
+            out[0] = number >> 24; out[1] = number >> 16; out[2] = number >> 8; out[3] = number;
+            sendAck(cmd, OK, out, 4);
+            break;
+        }
+
+        case FPM_LEDON:
+        case FPM_LEDOFF:
+        case FPM_LEDCONTROL:
+        case FPM_STANDBY:
+            sendAck(cmd, OK);
+            break;
+
+        default:
+            sendAck(cmd, static_cast<uint8_t>(FPMStatus::PACKETRECIEVEERR));
+            break;
+    }
+}
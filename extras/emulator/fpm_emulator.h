@@ -0,0 +1,161 @@
+/***************************************************
+  Host-side emulator for the FPMxx/R30x/ZFMxx family of fingerprint sensors.
+
+  FPMEmulator is an Arduino Stream that speaks the sensor protocol, so it can be
+  handed directly to the FPM constructor in place of a serial port.
+  It is meant for benchmarks and regression checks of the packet layer on a PC, not on an MCU.
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_EMULATOR_H_
+#define FPM_EMULATOR_H_
+
+#include <Arduino.h>
+#include <fpm.h>
+
+#include <deque>
+#include <vector>
+#include <random>
+
+struct FPMEmulatorConfig
+{
+    uint32_t address;
+    uint32_t password;
+    uint16_t capacity;
+    FPMSecurityLevel securityLevel;
+    FPMPacketLength packetLen;
+    FPMBaud baudRate;
+
+    uint16_t templateSize;
+    uint16_t imageWidth;
+    uint16_t imageHeight;
+
+    /* whether FPM_READPRODINFO is understood, as on the R503 */
+    bool hasProductInfo;
+
+    /* delay (in microseconds) before the ACK of any command becomes readable,
+     * unless overridden per-command with FPMEmulator::setCommandLatency() */
+    uint32_t commandLatencyUs;
+
+    /* extra delay (in microseconds) added to a search for every occupied slot it goes through */
+    uint32_t searchUsPerTemplate;
+
+    /* time (in microseconds) after power-up before the sensor listens to anything */
+    uint32_t bootTimeUs;
+
+    /* when true, sensor->host bytes are released no faster than the configured baud rate */
+    bool paceToBaudRate;
+
+    /* probability that any packet sent to the host will have one bit flipped */
+    double corruptionRate;
+    uint32_t seed;
+
+    FPMEmulatorConfig();
+};
+
+class FPMEmulator : public Stream
+{
+    public:
+    FPMEmulator(const FPMEmulatorConfig & cfg = FPMEmulatorConfig());
+
+    /* The host end of the link; if #baud doesn't match the sensor's rate,
+     * nothing gets through in either direction, as with a real UART. */
+    void begin(unsigned long baud);
+
+    /* restarts the sensor, which then ignores the host until its boot time is up */
+    void powerCycle(void);
+
+    /* Stream interface */
+    int available(void);
+    int read(void);
+    int peek(void);
+    size_t write(uint8_t c);
+    size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+
+    /* per-command ACK latency in microseconds, overriding the configured default */
+    void setCommandLatency(uint8_t command, uint32_t latencyUs);
+    void setCorruptionRate(double rate);
+
+    /* whether a finger is on the sensor; a different #fingerSeed yields a different print */
+    void setFinger(bool present, uint32_t fingerSeed = 1);
+
+    /* replace the sensor's image buffer, packed 2 pixels per byte */
+    void setImage(const uint8_t * image, size_t len);
+
+    /* directly populate the template database */
+    void storeTemplate(uint16_t id, const uint8_t * tmpl, size_t len);
+    bool isOccupied(uint16_t id) const;
+
+    const FPMEmulatorConfig & config(void) const { return cfg; }
+
+    /* traffic counters */
+    uint32_t packetsIn;
+    uint32_t packetsOut;
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+    uint32_t badPacketsIn;
+    
+    /* number of write() calls made by the host */
+    uint32_t writeCalls;
+
+    private:
+    enum class InState { HEADER, METADATA, PAYLOAD };
+    enum class DataState { NONE, RECEIVING_TEMPLATE };
+
+    FPMEmulatorConfig cfg;
+    unsigned long hostBaud;
+    unsigned long poweredAt;
+
+    /* host->sensor packet parser */
+    InState inState;
+    uint16_t inHeader;
+    std::vector<uint8_t> inPacket;
+    uint16_t inExpected;
+
+    /* sensor->host bytes, ready to be read from #rxPos onwards */
+    std::vector<uint8_t> rxReady;
+    size_t rxPos;
+
+    struct PendingBytes {
+        unsigned long readyAt;
+        std::vector<uint8_t> bytes;
+    };
+    std::deque<PendingBytes> rxPending;
+    unsigned long lastReadyAt;
+
+    uint32_t latencies[256];
+    std::mt19937 rng;
+
+    /* sensor state */
+    std::vector<std::vector<uint8_t> > database;
+    std::vector<uint8_t> charBuffers[2];
+    std::vector<uint8_t> image;
+    bool fingerPresent;
+    bool imageCaptured;
+    uint32_t fingerSeed;
+
+    DataState dataState;
+    uint8_t dataSlot;
+    std::vector<uint8_t> dataIn;
+
+    void releasePending(void);
+    bool linkUp(void) const;
+
+    void handlePacket(uint8_t pktId, const uint8_t * payload, uint16_t len);
+    void handleCommand(const uint8_t * payload, uint16_t len);
+
+    void sendAck(uint8_t cmd, uint8_t confirmCode, const uint8_t * data = NULL, uint16_t len = 0, uint32_t extraLatencyUs = 0);
+    void sendData(uint8_t cmd, const std::vector<uint8_t> & data);
+    void queuePacket(uint8_t pktId, const uint8_t * payload, uint16_t len, unsigned long readyAt);
+
+    uint16_t packetLength(void) const;
+    std::vector<uint8_t> * charBuffer(uint8_t slot);
+    void generateImage(void);
+    void extractFeatures(std::vector<uint8_t> & tmpl);
+    static uint32_t identityOf(const std::vector<uint8_t> & tmpl);
+};
+
+#endif
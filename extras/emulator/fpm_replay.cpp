@@ -0,0 +1,158 @@
+/***************************************************
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm_replay.h"
+
+FPMReplayStream::FPMReplayStream(const uint8_t * trace, size_t len, bool realTime) :
+    trace(trace, trace + len), isValid(false), realTime(realTime)
+{
+    parse();
+    rewind();
+}
+
+void FPMReplayStream::parse(void)
+{
+    if (trace.size() < FPM_TRACE_MAGIC_LEN + 1 || memcmp(&trace[0], FPM_TRACE_MAGIC, FPM_TRACE_MAGIC_LEN) != 0 ||
+        trace[FPM_TRACE_MAGIC_LEN] != FPM_TRACE_VERSION)
+    {
+        return;
+    }
+
+    size_t pos = FPM_TRACE_MAGIC_LEN + 1;
+    uint32_t time = 0;
+
+    while (pos < trace.size())
+    {
+        Record record;
+        uint8_t tag = trace[pos++];
+
+        record.toSensor = (tag & FPM_TRACE_WRITE) != 0;
+        record.length = (tag & FPM_TRACE_LENGTH_MASK) + 1;
+
+        uint32_t delta = 0;
+        uint8_t shift = 0;
+        bool more = true;
+
+        while (more && pos < trace.size() && shift < 32) {
+            uint8_t byte = trace[pos++];
+            delta |= (uint32_t)(byte & 0x7F) << shift;
+            more = (byte & 0x80) != 0;
+            shift += 7;
+        }
+
+        /* a truncated trace just ends early */
+        if (more || pos + record.length > trace.size()) break;
+
+        time += delta;
+        record.time = time;
+        record.offset = pos;
+        records.push_back(record);
+
+        pos += record.length;
+    }
+
+    isValid = true;
+}
+
+void FPMReplayStream::rewind(void)
+{
+    current = 0;
+    position = 0;
+    clockOffset = micros();
+
+    bytesRead = 0;
+    bytesWritten = 0;
+    mismatches = 0;
+}
+
+bool FPMReplayStream::finished(void)
+{
+    return current >= records.size();
+}
+
+void FPMReplayStream::skipEmpty(void)
+{
+    if (current < records.size() && position == records[current].length) {
+        current++;
+        position = 0;
+    }
+}
+
+bool FPMReplayStream::released(const Record & record, unsigned long now)
+{
+    return !realTime || (unsigned long)(now - clockOffset) >= record.time;
+}
+
+bool FPMReplayStream::readable(void)
+{
+    return current < records.size() && !records[current].toSensor && released(records[current], micros());
+}
+
+int FPMReplayStream::available(void)
+{
+    const unsigned long now = micros();
+    int count = 0;
+
+    /* everything up to the next write, as long as it's due; at least a packet's worth,
+     * since FPM waits for whole chunks */
+    for (size_t i = current; i < records.size() && count < 2 * FPM_MAX_PACKET_LEN; i++)
+    {
+        const Record & record = records[i];
+
+        if (record.toSensor || !released(record, now)) break;
+        count += record.length - ((i == current) ? position : 0);
+    }
+
+    return count;
+}
+
+int FPMReplayStream::read(void)
+{
+    if (!readable()) return -1;
+
+    int c = trace[records[current].offset + position++];
+    bytesRead++;
+    skipEmpty();
+
+    return c;
+}
+
+int FPMReplayStream::peek(void)
+{
+    if (!readable()) return -1;
+
+    return trace[records[current].offset + position];
+}
+
+size_t FPMReplayStream::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t FPMReplayStream::write(const uint8_t * buffer, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        bytesWritten++;
+
+        /* anything the trace didn't expect, or didn't expect yet, is taken but doesn't count */
+        if (current >= records.size() || !records[current].toSensor) {
+            mismatches++;
+            continue;
+        }
+
+        const Record & record = records[current];
+
+        if (trace[record.offset + position] != buffer[i]) mismatches++;
+
+        /* restart the clock from the write, so that the reads after it keep their original delays */
+        if (position == 0) clockOffset = micros() - record.time;
+
+        position++;
+        skipEmpty();
+    }
+
+    return size;
+}
@@ -0,0 +1,78 @@
+/***************************************************
+  Host-side replay of a trace captured with FPMTraceStream.
+
+  FPMReplayStream plays the sensor's side of a trace back to an FPM object, so that the same calls
+  that were made in the field see the same bytes, corrupted frames, stalls and all.
+  Like FPMEmulator, it is meant for a PC, not an MCU.
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_REPLAY_H_
+#define FPM_REPLAY_H_
+
+#include <Arduino.h>
+#include <fpm.h>
+#include <fpm_trace.h>
+
+#include <vector>
+
+class FPMReplayStream : public Stream
+{
+    public:
+    /** #realTime releases each read from the sensor no earlier than it came in the trace,
+     *  counting from the write just before it; otherwise it's released as soon as that write has been made. */
+    FPMReplayStream(const uint8_t * trace, size_t len, bool realTime = false);
+
+    /* false if the trace has no valid header */
+    bool valid(void) { return isValid; }
+
+    /* Starts over from the beginning of the trace */
+    void rewind(void);
+
+    /* true once every record has been played back */
+    bool finished(void);
+
+    /* Stream interface */
+    int available(void);
+    int read(void);
+    int peek(void);
+    size_t write(uint8_t c);
+    size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+
+    /* bytes played back to FPM, bytes it wrote, and those that differ from the trace (or go beyond it) */
+    uint32_t bytesRead;
+    uint32_t bytesWritten;
+    uint32_t mismatches;
+
+    private:
+    struct Record {
+        bool toSensor;
+        uint32_t time;          /* since the start of the trace */
+        size_t offset;          /* of its bytes, in the trace */
+        uint8_t length;
+    };
+
+    std::vector<uint8_t> trace;
+    std::vector<Record> records;
+    bool isValid;
+    bool realTime;
+
+    /* the current record, and how far into it */
+    size_t current;
+    uint8_t position;
+
+    /* the replay clock: trace time 0 is at micros() == #clockOffset, as of the last write */
+    unsigned long clockOffset;
+
+    void parse(void);
+    void skipEmpty(void);
+    bool released(const Record & record, unsigned long now);
+    
+    /* true if the current record is a read that's due */
+    bool readable(void);
+};
+
+#endif
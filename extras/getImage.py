@@ -3,57 +3,11 @@
 
 import serial, time, argparse, struct
     
-IMAGE_WIDTH = 256
-IMAGE_HEIGHT = 288
-IMAGE_DEPTH = 8
-
 IMAGE_START_SIGNATURE = b'\xAA'
 
-# Assemble BMP header for a grayscale image
-
-def assembleBMPHeader(width, height, depth, includePalette=False):
-    # Define the formats of the header and palette entries
-    # See https://gibberlings3.github.io/iesdp/file_formats/ie_formats/bmp.htm for details.
-    bmpHeader = struct.Struct("<2s3L LLl2H6L")
-    bmpPaletteEntry = struct.Struct("4B")
-    
-    # width of the image raster in bytes, including any padding
-    byteWidth = ((depth * width + 31) // 32) * 4
-    
-    numColours = 2**depth
-    bmpPaletteSize = bmpPaletteEntry.size * numColours
-    imageSize = byteWidth * height
-    
-    if includePalette:
-        fileSize = bmpHeader.size + bmpPaletteSize + imageSize
-        rasterOffset = bmpHeader.size + bmpPaletteSize
-    else:
-        fileSize = bmpHeader.size + imageSize
-        rasterOffset = bmpHeader.size
-    
-    BMP_INFOHEADER_SZ = 40
-    TYPICAL_PIXELS_PER_METER = 2835     # 72 DPI, boiler-plate
-    
-    # Pack the BMP header
-    # Height is negative because the image is received top to bottom and will be similarly stored
-    bmpHeaderBytes = bmpHeader.pack(b"BM", fileSize, 0, rasterOffset, 
-                                    BMP_INFOHEADER_SZ, width, -height, 1, depth, 
-                                    0, imageSize, TYPICAL_PIXELS_PER_METER, TYPICAL_PIXELS_PER_METER, 0, 0)
-    
-    # Pack the palette, if needed
-    if includePalette:
-        bmpPaletteBytes = []
-        
-        # Equal measures of each colour component yields a scale
-        # of grays, from black to white
-        for index in range(numColours):
-            R = G = B = A = index
-            bmpPaletteBytes.append(bmpPaletteEntry.pack(R, G, B, A))
-        
-        bmpPaletteBytes = b''.join(bmpPaletteBytes)
-        return bmpHeaderBytes + bmpPaletteBytes
-        
-    return bmpHeaderBytes
+# The Arduino sends a complete BMP file (see FPMImageWriter), whose header gives its total size
+BMP_SIGNATURE = b'BM'
+BMP_SIZE_FIELD = struct.Struct("<L")
 
 def getFingerprintImage(portNum, baudRate, outputFileName):
     try:
@@ -63,7 +17,6 @@ def getFingerprintImage(portNum, baudRate, outputFileName):
         return False
         
     outFile = open(outputFileName, "wb")
-    outFile.write(assembleBMPHeader(IMAGE_WIDTH, IMAGE_HEIGHT, IMAGE_DEPTH, True))
     
     # Give some time for the Arduino reset
     time.sleep(1)
@@ -75,21 +28,28 @@ def getFingerprintImage(portNum, baudRate, outputFileName):
             currByte = port.read()
             print(currByte.decode(errors='ignore'), end='')
         
-        # The datasheet says the sensor sends 1 byte for every 2 pixels
-        totalBytesExpected = (IMAGE_WIDTH * IMAGE_HEIGHT) // 2
+        # The signature and size of the file come first
+        header = port.read(len(BMP_SIGNATURE) + BMP_SIZE_FIELD.size)
         
-        for i in range(totalBytesExpected):
-            currByte = port.read()
+        if len(header) != len(BMP_SIGNATURE) + BMP_SIZE_FIELD.size or not header.startswith(BMP_SIGNATURE):
+            print("No BMP header received.")
+            return False
+            
+        fileSize, = BMP_SIZE_FIELD.unpack(header[len(BMP_SIGNATURE):])
+        outFile.write(header)
+        
+        totalBytesExpected = fileSize - len(header)
+        
+        while totalBytesExpected:
+            chunk = port.read(min(totalBytesExpected, 4096))
             
             # Exit if we failed to read anything within the defined timeout
-            if not currByte:
+            if not chunk:
                 print("Read timed out.")
                 return False
                 
-            # Since each received byte contains info for 2 adjacent pixels,
-            # assume that both pixels were originally close enough in colour
-            # to now be assigned the same colour
-            outFile.write(currByte * 2)
+            outFile.write(chunk)
+            totalBytesExpected -= len(chunk)
         
         # print anything that's left, until the inter-byte timeout fires
         while currByte:
@@ -115,10 +75,10 @@ if __name__ == "__main__":
     parser = argparse.ArgumentParser(description="Read, assemble and save a fingerprint image from the Arduino.")
     
     parser.add_argument("portNum", help="COM/Serial port (e.g. COM3 or /dev/ttyACM1)")
-    parser.add_argument("baudRate", type=int, help="Baud rate (e.g. 57600)")
+    parser.add_argument("baudRate", type=int, help="Baud rate (e.g. 115200)")
     parser.add_argument("outputFileName", help="Output image file name or path (should end with .bmp)")
     
-    # e.g. python3 getImage.py COM3 57600 print.bmp
+    # e.g. python3 getImage.py COM3 115200 print.bmp
     
     args = parser.parse_args()
     
@@ -0,0 +1,128 @@
+/***************************************************
+  Minimal stand-in for the Arduino core, just enough to build the FPM library
+  on a Linux/POSIX host (with the sensor emulator in extras/emulator).
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_HOST_ARDUINO_H_
+#define FPM_HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <thread>
+#include <type_traits>
+
+inline unsigned long micros(void)
+{
+    using namespace std::chrono;
+    return (unsigned long)duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline unsigned long millis(void)
+{
+    using namespace std::chrono;
+    return (unsigned long)duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline void delay(unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline void delayMicroseconds(unsigned int us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+inline void yield(void)
+{
+
+}
+
+template <typename T, typename U>
+inline typename std::common_type<T, U>::type min(T a, U b) { return (a < b) ? a : b; }
+
+template <typename T, typename U>
+inline typename std::common_type<T, U>::type max(T a, U b) { return (a > b) ? a : b; }
+
+/* flash storage is ordinary memory on the host */
+#define PROGMEM
+#define PSTR(s)                 (s)
+#define F(s)                    (s)
+#define pgm_read_byte(addr)     (*(const uint8_t *)(addr))
+#define pgm_read_ptr(addr)      (*(void * const *)(addr))
+#define memcpy_P                memcpy
+#define snprintf_P              snprintf
+#define printf_P                printf
+
+class Print
+{
+    public:
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t * buffer, size_t size)
+    {
+        size_t n = 0;
+        while (size--) {
+            if (write(*buffer++) == 0) break;
+            n++;
+        }
+        return n;
+    }
+
+    size_t write(const char * str) { return write((const uint8_t *)str, strlen(str)); }
+
+    virtual int availableForWrite(void) { return 0; }
+    virtual void flush(void) { }
+};
+
+class Stream : public Print
+{
+    public:
+    Stream() : timeout(1000) { }
+
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+
+    void setTimeout(unsigned long ms) { timeout = ms; }
+
+    /* as in the AVR core, this is not virtual and reads a byte at a time */
+    size_t readBytes(uint8_t * buffer, size_t length)
+    {
+        size_t count = 0;
+        while (count < length) {
+            int c = timedRead();
+            if (c < 0) break;
+            *buffer++ = (uint8_t)c;
+            count++;
+        }
+        return count;
+    }
+
+    size_t readBytes(char * buffer, size_t length) { return readBytes((uint8_t *)buffer, length); }
+
+    protected:
+    unsigned long timeout;
+
+    int timedRead(void)
+    {
+        unsigned long start = millis();
+        do {
+            int c = read();
+            if (c >= 0) return c;
+        } while (millis() - start < timeout);
+        return -1;
+    }
+};
+
+#endif
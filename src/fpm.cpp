@@ -5,60 +5,258 @@
 
 #include "fpm.h"
 #include "fpm_logging.h"
+#include "fpm_sinks.h"
 
 #include <Arduino.h>
 
-#define FPM_CHECKSUM_LENGTH     2
+const uint16_t FPM::packetLengths[] = {32, 64, 128, 256};
+
+#if (FPM_METRICS)
+    #define FPM_METRICS_COUNT(field, n)     (metrics.field += (n))
+    
+    static const uint8_t metricsCommands[FPM_METRICS_COMMAND_COUNT] = FPM_METRICS_COMMANDS;
+#else
+    #define FPM_METRICS_COUNT(field, n)
+#endif
 
-enum class FPMState {
-    READ_HEADER,
-    READ_METADATA,
-    READ_PAYLOAD,
-    READ_CHECKSUM
+#if (FPM_LOG_LEVEL_PACKET != FPM_LOG_LEVEL_SILENT)
+
+#define FPM_LOG_EVENT_FORMAT(name, fmt)     static const char logFormat_##name[] PROGMEM = fmt;
+#define FPM_LOG_EVENT_FORMAT_PTR(name, fmt) logFormat_##name,
+
+FPM_LOG_EVENTS(FPM_LOG_EVENT_FORMAT)
+
+static const char * const logFormats[] PROGMEM = {
+    FPM_LOG_EVENTS(FPM_LOG_EVENT_FORMAT_PTR)
 };
 
-const uint16_t FPM::packetLengths[] = {32, 64, 128, 256};
+static void printLogEvent(uint8_t id, uint32_t arg, uint16_t arg2)
+{
+    printf("[+]");
+    printf_P((const char *)pgm_read_ptr(&logFormats[id]), (unsigned long)arg, arg2);
+    printf("\r\n");
+}
+
+#endif
 
-FPM::FPM(Stream * ss) : 
-    port(ss), password(FPM_DEFAULT_PASSWORD),
-    address(FPM_DEFAULT_ADDRESS), useFixedParams(false)
+#if (FPM_LOG_LEVEL_PACKET != FPM_LOG_LEVEL_SILENT) && (FPM_LOG_MODE == FPM_LOG_MODE_DEFERRED)
+
+static_assert((FPM_LOG_RING_SZ & (FPM_LOG_RING_SZ - 1)) == 0, "FPM_LOG_RING_SZ must be a power of 2");
+
+/* shared by every FPM object, and not safe to record into from more than one thread at a time.
+ * #logHead and #logTail run freely; the ring holds the last FPM_LOG_RING_SZ events before #logHead */
+static FPMLogEvent logRing[FPM_LOG_RING_SZ];
+static uint16_t logHead;
+static uint16_t logTail;
+
+void fpmLogRecord(uint8_t id, uint32_t arg, uint16_t arg2)
 {
+    FPMLogEvent * event = &logRing[logHead++ & (FPM_LOG_RING_SZ - 1)];
     
+    event->time = micros();
+    event->arg = arg;
+    event->arg2 = arg2;
+    event->id = id;
 }
 
-bool FPM::begin(uint32_t pwd, uint32_t addr, FPMSystemParams * params) 
+uint16_t FPM::drainLog(uint16_t maxEvents)
+{
+    uint16_t pending = logHead - logTail;
+    
+    /* anything older than a full ring has been overwritten */
+    if (pending > FPM_LOG_RING_SZ) {
+        printf("[+]%u events lost\r\n", pending - FPM_LOG_RING_SZ);
+        logTail = logHead - FPM_LOG_RING_SZ;
+        pending = FPM_LOG_RING_SZ;
+    }
+    
+    uint16_t count = 0;
+    
+    while (count < pending && count < maxEvents)
+    {
+        const FPMLogEvent * event = &logRing[logTail++ & (FPM_LOG_RING_SZ - 1)];
+        
+        printf("%10lu ", (unsigned long)event->time);
+        printLogEvent(event->id, event->arg, event->arg2);
+        count++;
+    }
+    
+    return count;
+}
+
+#else
+
+#if (FPM_LOG_LEVEL_PACKET != FPM_LOG_LEVEL_SILENT)
+void fpmLogPrint(uint8_t id, uint32_t arg, uint16_t arg2)
+{
+    printLogEvent(id, arg, arg2);
+}
+#endif
+
+uint16_t FPM::drainLog(uint16_t)
 {
-    delay(1000);            /* 500 ms at least according to datasheet */
+    return 0;
+}
+
+#endif
+
+/* where a frame starts in the TX buffer, after the start code and address */
+#define FPM_FRAME_OFFSET        6
+
+/* A command frame, from the packet ID to the checksum; the start code and address are already in the TX buffer.
+ * The checksum doesn't cover the address, so the same frame does for any address. */
+typedef struct {
+    uint8_t length;
+    uint8_t bytes[7];
+} FPMFrameBytes;
+
+static constexpr uint16_t frameChecksum(uint8_t payloadLen, uint8_t cmd, uint8_t arg)
+{
+    return FPM_COMMANDPACKET + payloadLen + FPM_CHECKSUM_LENGTH + cmd + arg;
+}
+
+static constexpr FPMFrameBytes commandFrame(uint8_t cmd)
+{
+    return { 6, { FPM_COMMANDPACKET, 0, 1 + FPM_CHECKSUM_LENGTH, cmd,
+                  (uint8_t)(frameChecksum(1, cmd, 0) >> 8), (uint8_t)frameChecksum(1, cmd, 0) } };
+}
+
+static constexpr FPMFrameBytes commandFrame(uint8_t cmd, uint8_t arg)
+{
+    return { 7, { FPM_COMMANDPACKET, 0, 2 + FPM_CHECKSUM_LENGTH, cmd, arg,
+                  (uint8_t)(frameChecksum(2, cmd, arg) >> 8), (uint8_t)frameChecksum(2, cmd, arg) } };
+}
+
+static_assert(commandFrame(FPM_GETIMAGE).bytes[5] == 0x05, "GETIMAGE frame checksum");
+
+/* in the same order as FPMFrame */
+static const FPMFrameBytes fixedFrames[] PROGMEM = {
+    commandFrame(FPM_GETIMAGE),
+    commandFrame(FPM_GETIMAGE_ONLY),
+    commandFrame(FPM_IMAGE2TZ, 1),
+    commandFrame(FPM_IMAGE2TZ, 2),
+    commandFrame(FPM_REGMODEL),
+    commandFrame(FPM_EMPTYDATABASE),
+    commandFrame(FPM_TEMPLATECOUNT),
+    commandFrame(FPM_READSYSPARAM),
+    commandFrame(FPM_READPRODINFO),
+    commandFrame(FPM_GETRANDOM),
+    commandFrame(FPM_HANDSHAKE),
+    commandFrame(FPM_LEDON),
+    commandFrame(FPM_LEDOFF),
+    commandFrame(FPM_STANDBY)
+};
+
+FPM::FPM(Stream * ss, FPMSensorFamily family) : 
+    port(ss), family(family), familyBit(1 << static_cast<uint8_t>(family)), password(FPM_DEFAULT_PASSWORD),
+    address(FPM_DEFAULT_ADDRESS), useFixedParams(false), useCachedParams(false),
+    baudHandler(NULL), baudHandlerCtx(NULL), readTimeout(FPM_DEFAULT_TIMEOUT), probing(false), templateSize(0),
+    rxState(FPMState::IDLE), rxChunked(false), ackLen(0), slotOpSlot(0)
+{
+    prepareTxHeader();
+    setStagingBuffer(NULL, 0);
     
-#if (FPM_LOG_LEVEL != FPM_LOG_LEVEL_SILENT)
+#if (FPM_METRICS)
+    resetMetrics();
+#endif
+    invalidateIndexCache();
+    forgetSlots(0, 0xFFFF);
+}
+
+bool FPM::begin(uint32_t pwd, uint32_t addr, FPMSystemParams * params) 
+{
+#if (FPM_LOG_LEVEL != FPM_LOG_LEVEL_SILENT) || (FPM_LOG_LEVEL_PACKET != FPM_LOG_LEVEL_SILENT)
     printf_begin();
 #endif
     
+    if ((familyBit & FPM_SENSOR_FAMILIES) == 0) {
+        FPM_LOGLN_ERROR("begin: sensor family not in FPM_SENSOR_FAMILIES");
+        return false;
+    }
+    
     address = addr;
     password = pwd;
+    prepareTxHeader();
+    invalidateIndexCache();
+    forgetSlots(0, 0xFFFF);
+    
+    /* the sensor takes a while to start up, but rather than wait out the worst case,
+     * keep asking until it answers */
+    const uint16_t timeout = readTimeout;
+    readTimeout = FPM_STARTUP_POLL_INTERVAL;
+    
+    uint32_t start = millis();
+    FPMStatus status;
+    
+    probing = true;
+    
+    do {
+        status = sendPassword();
+    } while (FPM::isErrorCode(status) && (uint32_t)(millis() - start) < FPM_STARTUP_TIMEOUT);
     
-    if (!verifyPassword(password)) {
+    readTimeout = timeout;
+    
+    /* no answer at all, so maybe the port isn't at the sensor's baud rate;
+     * if so, any cached params are out of date too */
+    if (FPM::isErrorCode(status) && detectBaud()) {
+        useCachedParams = false;
+        status = sendPassword();
+    }
+    
+    probing = false;
+    
+    if (FPM::isErrorCode(status)) {
+        FPM_LOGLN_ERROR("begin: no answer from the sensor after %lu ms", (unsigned long)(millis() - start));
+    }
+    
+    if (status != FPMStatus::OK) {
         FPM_LOGLN_ERROR("begin: password verification failed");
+        useCachedParams = false;
         return false;
     }
     
+    FPM_LOGLN_VERBOSE("begin: sensor ready after %lu ms", (unsigned long)(millis() - start));
+    
     /* check if the user has supplied fixed parameters manually, 
      * this is needed for some sensors like the R308, which don't support SET_PARAM */
+    if (params == NULL && hasTrait(FPM_TRAIT_FIXED_PARAMS)) {
+        FPM_LOGLN_ERROR("begin: this sensor needs fixed params");
+        return false;
+    }
+    
     if (params != NULL) {
         useFixedParams = true;
         memcpy(&sysParams, params, sizeof(FPMSystemParams));
         FPM_LOGLN_VERBOSE("begin: using fixed params");
     }
+    else if (useCachedParams && sysParams.deviceAddr == address) {
+        FPM_LOGLN_VERBOSE("begin: using cached params");
+    }
     else if (readParams() != FPMStatus::OK) {
         FPM_LOGLN_ERROR("begin: read params failed");
+        useCachedParams = false;
         return false;
     }
     
+    useCachedParams = false;
     return true;
 }
 
+void FPM::setCachedParams(const FPMSystemParams * params, const FPMProductInfo * info)
+{
+    useCachedParams = (params != NULL);
+    if (useCachedParams) memcpy(&sysParams, params, sizeof(FPMSystemParams));
+    
+    if (info != NULL && info->templateSize != 0) templateSize = info->templateSize;
+}
+
 bool FPM::verifyPassword(uint32_t pwd) 
 {    
+    return sendPassword() == FPMStatus::OK;
+}
+
+FPMStatus FPM::sendPassword(void)
+{
     buffer[0] = FPM_VERIFYPASSWORD;
     buffer[1] = (password >> 24) & 0xff; buffer[2] = (password >> 16) & 0xff;
     buffer[3] = (password >> 8) & 0xff; buffer[4] = password & 0xff;
@@ -69,7 +267,7 @@ bool FPM::verifyPassword(uint32_t pwd)
     uint16_t readLen;   
     FPMStatus status = readAckGetResponse(&confirmCode, &readLen);
     
-    return (!FPM::isErrorCode(status) && confirmCode == FPMStatus::OK);
+    return FPM::isErrorCode(status) ? status : confirmCode;
 }
 
 FPMStatus FPM::setPassword(uint32_t pwd) 
@@ -87,39 +285,57 @@ FPMStatus FPM::setAddress(uint32_t addr)
     buffer[1] = (addr >> 24) & 0xff; buffer[2] = (addr >> 16) & 0xff;
     buffer[3] = (addr >> 8) & 0xff; buffer[4] = addr & 0xff;
     
-    return writeCommandGetResponse(5);
+    FPMStatus status = writeCommandGetResponse(5);
+    
+    /* the sensor only answers to its new address from now on */
+    if (status == FPMStatus::OK) {
+        address = addr;
+        prepareTxHeader();
+    }
+    
+    return status;
 }
 
 FPMStatus FPM::getImage(void) 
 {
-    buffer[0] = FPM_GETIMAGE;
-    return writeCommandGetResponse(1);
+    if (!beginGetImage()) return FPMStatus::PENDING;
+    return waitResponse();
+}
+
+bool FPM::beginGetImage(void) 
+{
+    return beginCommand(FPMFrame::GETIMAGE);
 }
 
 /* tested with ZFM60 modules only */
 FPMStatus FPM::getImageOnly(void) 
 {
-    buffer[0] = FPM_GETIMAGE_ONLY;
-    return writeCommandGetResponse(1);
+    if (!hasTrait(FPM_TRAIT_LED_ON_OFF)) return FPMStatus::INVALID_PARAMS;
+    
+    return writeCommandGetResponse(FPMFrame::GETIMAGE_ONLY);
 }
 
 /* tested with ZFM60 modules only */
 FPMStatus FPM::ledOn(void) 
 {
-    buffer[0] = FPM_LEDON;
-    return writeCommandGetResponse(1);
+    if (!hasTrait(FPM_TRAIT_LED_ON_OFF)) return FPMStatus::INVALID_PARAMS;
+    
+    return writeCommandGetResponse(FPMFrame::LEDON);
 }
 
 /* tested with ZFM60 modules only */
 FPMStatus FPM::ledOff(void) 
 {
-    buffer[0] = FPM_LEDOFF;
-    return writeCommandGetResponse(1);
+    if (!hasTrait(FPM_TRAIT_LED_ON_OFF)) return FPMStatus::INVALID_PARAMS;
+    
+    return writeCommandGetResponse(FPMFrame::LEDOFF);
 }
 
 /* tested with R503 modules only */
 FPMStatus FPM::ledConfigure(uint8_t controlCode, uint8_t speed, uint8_t colour, uint8_t numCycles)
  {
+    if (!hasTrait(FPM_TRAIT_LED_CONTROL)) return FPMStatus::INVALID_PARAMS;
+    
     buffer[0] = FPM_LEDCONTROL;
     buffer[1] = controlCode; buffer[2] = speed;
     buffer[3] = colour; buffer[4] = numCycles;
@@ -129,41 +345,73 @@ FPMStatus FPM::ledConfigure(uint8_t controlCode, uint8_t speed, uint8_t colour,
 
 FPMStatus FPM::standby(void) 
 {
-    buffer[0] = FPM_STANDBY;
-    return writeCommandGetResponse(1);
+    if (!hasTrait(FPM_TRAIT_STANDBY)) return FPMStatus::INVALID_PARAMS;
+    
+    return writeCommandGetResponse(FPMFrame::STANDBY);
 }
 
 FPMStatus FPM::image2Tz(uint8_t slot) 
 {
+    if (!beginImage2Tz(slot)) return FPMStatus::PENDING;
+    return waitResponse();
+}
+
+bool FPM::beginImage2Tz(uint8_t slot) 
+{
+    if (isBusy()) return false;
+    
+    /* the usual slots have their own frames */
+    if (slot == 1) return beginCommand(FPMFrame::IMAGE2TZ_1);
+    if (slot == 2) return beginCommand(FPMFrame::IMAGE2TZ_2);
+    
     buffer[0] = FPM_IMAGE2TZ; 
     buffer[1] = slot;
-    return writeCommandGetResponse(2);
+    return beginCommand(2);
 }
 
-
 FPMStatus FPM::generateTemplate(void) 
 {
-    buffer[0] = FPM_REGMODEL;
-    return writeCommandGetResponse(1);
+    if (!beginGenerateTemplate()) return FPMStatus::PENDING;
+    return waitResponse();
 }
 
+bool FPM::beginGenerateTemplate(void) 
+{
+    return beginCommand(FPMFrame::REGMODEL);
+}
 
 FPMStatus FPM::storeTemplate(uint16_t id, uint8_t slot) 
 {
+    if (!beginStoreTemplate(id, slot)) return FPMStatus::PENDING;
+    return waitResponse();
+}
+
+bool FPM::beginStoreTemplate(uint16_t id, uint8_t slot) 
+{
+    if (isBusy()) return false;
+    
     buffer[0] = FPM_STORE;
     buffer[1] = slot;
     buffer[2] = id >> 8; buffer[3] = id & 0xFF;
     
-    return writeCommandGetResponse(4);
+    return beginCommand(4);
 }
 
 FPMStatus FPM::loadTemplate(uint16_t id, uint8_t slot) 
 {
+    if (!beginLoadTemplate(id, slot)) return FPMStatus::PENDING;
+    return waitResponse();
+}
+
+bool FPM::beginLoadTemplate(uint16_t id, uint8_t slot) 
+{
+    if (isBusy()) return false;
+    
     buffer[0] = FPM_LOAD;
     buffer[1] = slot;
     buffer[2] = id >> 8; buffer[3] = id & 0xFF;
     
-    return writeCommandGetResponse(4);
+    return beginCommand(4);
 }
 
 FPMStatus FPM::setBaudRate(FPMBaud baudRate)
@@ -199,6 +447,16 @@ FPMStatus FPM::setParam(FPMParameter param, uint8_t value)
     if (FPM::isErrorCode(status)) return status;
     if (confirmCode != FPMStatus::OK) return confirmCode;
     
+    /* the sensor switches to the new baud rate right after the ACK, 
+     * so the port has to follow before anything can be read back */
+    if (param == FPMParameter::BAUD_RATE)
+    {
+        sysParams.baudRate = static_cast<FPMBaud>(value);
+        
+        if (baudHandler != NULL) baudHandler(FPM::baudToBps(sysParams.baudRate), baudHandlerCtx);
+        return confirmCode;
+    }
+    
     /* wait for a bit and then read back the params,
      * to update our local copy */
     delay(100);
@@ -226,9 +484,7 @@ FPMStatus FPM::readParams(FPMSystemParams * params)
         return FPMStatus::OK;
     }
     
-    buffer[0] = FPM_READSYSPARAM;
-    
-	writePacket(FPM_COMMANDPACKET, buffer, 1);
+    writeFrame(FPMFrame::READSYSPARAM);
     FPMStatus confirmCode;
     uint16_t readLen = 0;
     
@@ -255,9 +511,9 @@ FPMStatus FPM::readParams(FPMSystemParams * params)
 
 FPMStatus FPM::readProductInfo(FPMProductInfo * info) 
 {    
-    buffer[0] = FPM_READPRODINFO;
+    if (!hasTrait(FPM_TRAIT_PRODUCT_INFO)) return FPMStatus::INVALID_PARAMS;
     
-	writePacket(FPM_COMMANDPACKET, buffer, 1);
+    writeFrame(FPMFrame::READPRODINFO);
     FPMStatus confirmCode;
     uint16_t readLen = 0;
     
@@ -301,13 +557,23 @@ FPMStatus FPM::readProductInfo(FPMProductInfo * info)
     reverseBytes(&info->databaseSize, sizeof(info->databaseSize));
     ptr += sizeof(info->databaseSize);
     
+    if (info->templateSize != 0) templateSize = info->templateSize;
+    
     return confirmCode;
 }
 
 FPMStatus FPM::downloadImage(void) 
 {
+    if (!beginDownloadImage()) return FPMStatus::PENDING;
+    return waitResponse();
+}
+
+bool FPM::beginDownloadImage(void) 
+{
+    if (isBusy()) return false;
+    
 	buffer[0] = FPM_IMGUPLOAD;
-    return writeCommandGetResponse(1);
+    return beginCommand(1);
 }
 
 bool FPM::readDataPacket(uint8_t * destBuffer, Stream * destStream, uint16_t * readLen, bool * readComplete) 
@@ -315,7 +581,7 @@ bool FPM::readDataPacket(uint8_t * destBuffer, Stream * destStream, uint16_t * r
     uint8_t pktId;
     FPMStatus status;
     
-    if (destBuffer == NULL && destStream == NULL)
+    if ((destBuffer == NULL && destStream == NULL) || readComplete == NULL)
     {
         return false;
     }
@@ -337,6 +603,41 @@ bool FPM::readDataPacket(uint8_t * destBuffer, Stream * destStream, uint16_t * r
     return false;
 }
 
+FPMStatus FPM::pollDataPacket(uint8_t * destBuffer, Stream * destStream, uint16_t * readLen, bool * readComplete)
+{
+    uint8_t pktId;
+    
+    if ((destBuffer == NULL && destStream == NULL) || readLen == NULL || readComplete == NULL)
+    {
+        return FPMStatus::INVALID_PARAMS;
+    }
+    
+    /* start a new read, if one isn't already in progress */
+    if (rxState == FPMState::IDLE)
+    {
+        startPacketRead(destBuffer, destStream, *readLen);
+    }
+    
+    FPMStatus status = pollPacket(readLen, &pktId);
+    
+    if (status == FPMStatus::PENDING) return status;
+    
+    if (FPM::isErrorCode(status)) {
+        FPM_LOGLN_ERROR("pollDataPacket: failed with status 0x%X", static_cast<uint16_t>(status));
+        return status;
+    }
+    
+    if (pktId != FPM_DATAPACKET && pktId != FPM_ENDDATAPACKET) 
+    {
+        FPM_LOGLN_ERROR("Wrong PID: 0x%X", pktId);
+        FPM_METRICS_COUNT(wrongPacketId, 1);
+        return FPMStatus::READ_ERROR;
+    }
+    
+    *readComplete = (pktId == FPM_ENDDATAPACKET);
+    return FPMStatus::OK;
+}
+
 bool FPM::writeDataPacket(uint8_t * srcBuffer, Stream * srcStream, uint16_t * writeLen, bool writeComplete) 
 {
     const uint16_t PACKET_LEN = FPM::packetLengths[static_cast<uint16_t>(sysParams.packetLen)];
@@ -357,6 +658,56 @@ bool FPM::writeDataPacket(uint8_t * srcBuffer, Stream * srcStream, uint16_t * wr
     return true;
 }
 
+uint8_t * FPM::beginDataPacket(uint16_t writeLen, bool writeComplete, uint16_t * space)
+{
+    const uint8_t pktId = writeComplete ? FPM_ENDDATAPACKET : FPM_DATAPACKET;
+    const uint16_t totalLen = writeLen + FPM_CHECKSUM_LENGTH;
+    
+    txBuffer[6] = pktId;
+    txBuffer[7] = (uint8_t)(totalLen >> 8);
+    txBuffer[8] = (uint8_t)(totalLen);
+    
+    txSum = (totalLen >> 8) + (totalLen & 0xFF) + pktId;
+    txLen = writeLen;
+    txStaged = (FPM_HEADER_LEN + totalLen <= FPM_TX_BUFFER_SZ);
+    
+    /* the payload goes straight into place in the staging buffer, or else out through the general buffer */
+    if (txStaged) {
+        *space = writeLen;
+        return &txBuffer[FPM_HEADER_LEN];
+    }
+    
+    port->write(txBuffer, FPM_HEADER_LEN);
+    *space = FPM_BUFFER_SZ;
+    return buffer;
+}
+
+void FPM::putDataChunk(uint8_t * chunk, uint16_t len)
+{
+    if (!txStaged) port->write(chunk, len);
+    
+    for (uint16_t i = 0; i < len; i++) {
+        txSum += chunk[i];
+    }
+}
+
+void FPM::endDataPacket(void)
+{
+    uint8_t * chksum = txStaged ? &txBuffer[FPM_HEADER_LEN + txLen] : buffer;
+    chksum[0] = (uint8_t)(txSum >> 8);
+    chksum[1] = (uint8_t)txSum;
+    
+    if (txStaged)
+        port->write(txBuffer, FPM_HEADER_LEN + txLen + FPM_CHECKSUM_LENGTH);
+    else
+        port->write(chksum, FPM_CHECKSUM_LENGTH);
+    
+    FPM_LOG_EVENT(FPM_LOG_LEVEL_VERBOSE, WRITE, txBuffer[6], txLen);
+    
+    FPM_METRICS_COUNT(packetsOut, 1);
+    FPM_METRICS_COUNT(bytesOut, FPM_HEADER_LEN + txLen + FPM_CHECKSUM_LENGTH);
+}
+
 FPMStatus FPM::downloadTemplate(uint8_t slot) 
 {
     buffer[0] = FPM_UPCHAR;
@@ -372,6 +723,105 @@ FPMStatus FPM::uploadTemplate(uint8_t slot)
     return writeCommandGetResponse(2);
 }
     
+FPMStatus FPM::readTemplate(uint16_t id, uint8_t * destBuffer, uint16_t * readLen, uint8_t slot)
+{
+    if (destBuffer == NULL || readLen == NULL) return FPMStatus::INVALID_PARAMS;
+    
+    if (templateSize != 0 && *readLen < templateSize)
+    {
+        FPM_LOGLN_ERROR("readTemplate: buffer of %u bytes is too small", *readLen);
+        return FPMStatus::BUFFER_TOO_SMALL;
+    }
+    
+    FPMStatus status = loadTemplate(id, slot);
+    if (status != FPMStatus::OK) return status;
+    
+    return fetchTemplate(destBuffer, readLen, slot);
+}
+
+FPMStatus FPM::fetchTemplate(uint8_t * destBuffer, uint16_t * readLen, uint8_t slot)
+{
+    if (destBuffer == NULL || readLen == NULL) return FPMStatus::INVALID_PARAMS;
+    
+    if (templateSize != 0 && *readLen < templateSize)
+    {
+        FPM_LOGLN_ERROR("fetchTemplate: buffer of %u bytes is too small", *readLen);
+        return FPMStatus::BUFFER_TOO_SMALL;
+    }
+    
+    FPMStatus status = downloadTemplate(slot);
+    if (status != FPMStatus::OK) return status;
+    
+    /* now read every packet of the template, straight into the buffer; if the template size isn't known yet
+     * and it turns out too large, the rest is still read (and counted), so that the sensor is left idle */
+    FPMSpanSink sink(destBuffer, *readLen);
+    bool readComplete = false;
+    
+    while (!readComplete)
+    {
+        uint16_t len = 0;
+        
+        while ((status = pollDataPacket(sink, &len, &readComplete)) == FPMStatus::PENDING)
+        {
+            yield();
+        }
+        
+        if (status != FPMStatus::OK)
+        {
+            FPM_LOGLN_ERROR("fetchTemplate: failed after reading %u bytes", (uint16_t)(sink.length + sink.overflow));
+            return status;
+        }
+    }
+    
+    templateSize = sink.length + sink.overflow;
+    *readLen = sink.length;
+    
+    if (sink.overflow != 0)
+    {
+        FPM_LOGLN_ERROR("fetchTemplate: template of %u bytes, buffer of %u", templateSize, (uint16_t)sink.size);
+        return FPMStatus::BUFFER_TOO_SMALL;
+    }
+    
+    return FPMStatus::OK;
+}
+
+FPMStatus FPM::writeTemplate(uint16_t id, uint8_t * srcBuffer, uint16_t writeLen, uint8_t slot)
+{
+    FPMStatus status = sendTemplate(srcBuffer, writeLen, slot);
+    if (status != FPMStatus::OK) return status;
+    
+    return storeTemplate(id, slot);
+}
+
+FPMStatus FPM::sendTemplate(uint8_t * srcBuffer, uint16_t writeLen, uint8_t slot)
+{
+    const uint16_t PACKET_LEN = FPM::packetLengths[static_cast<uint16_t>(sysParams.packetLen)];
+    
+    if (srcBuffer == NULL || writeLen == 0) return FPMStatus::INVALID_PARAMS;
+    
+    FPMStatus status = uploadTemplate(slot);
+    if (status != FPMStatus::OK) return status;
+    
+    /* send the whole template back-to-back, one packet-length at a time */
+    uint16_t written = 0;
+    
+    while (written < writeLen)
+    {
+        uint16_t len = min((uint16_t)(writeLen - written), PACKET_LEN);
+        uint8_t pktId = (written + len == writeLen) ? FPM_ENDDATAPACKET : FPM_DATAPACKET;
+        
+        writePacket(pktId, srcBuffer + written, len);
+        written += len;
+    }
+    
+    return FPMStatus::OK;
+}
+
+uint16_t FPM::getTemplateSize(void)
+{
+    return templateSize;
+}
+
 FPMStatus FPM::deleteTemplate(uint16_t id, uint16_t howMany) 
 {
     buffer[0] = FPM_DELETE;
@@ -383,30 +833,81 @@ FPMStatus FPM::deleteTemplate(uint16_t id, uint16_t howMany)
 
 FPMStatus FPM::emptyDatabase(void) 
 {
-    buffer[0] = FPM_EMPTYDATABASE;
-    
-    return writeCommandGetResponse(1);
+    return writeCommandGetResponse(FPMFrame::EMPTYDATABASE);
 }
 
 FPMStatus FPM::searchDatabase(uint16_t * finger_id, uint16_t * score, uint8_t slot) 
+{
+    if (!beginSearch(slot)) return FPMStatus::PENDING;
+    
+    FPMStatus confirmCode = waitResponse();
+    if (confirmCode != FPMStatus::OK) return confirmCode;
+    
+    return getSearchResult(finger_id, score);
+}
+
+bool FPM::beginSearch(uint8_t slot) 
 {
     /* search from ID 0 to 'capacity' */
-    buffer[0] = FPM_SEARCH;
-    buffer[1] = slot;
-    buffer[2] = 0x00; buffer[3] = 0x00;
-    buffer[4] = (uint8_t)(sysParams.capacity >> 8); 
-    buffer[5] = (uint8_t)(sysParams.capacity & 0xFF);
+    return beginSearch(slot, 0, sysParams.capacity, FPMSearchMode::NORMAL);
+}
+
+FPMStatus FPM::searchDatabase(uint16_t * finger_id, uint16_t * score, uint8_t slot, uint16_t startId, uint16_t count, 
+                              FPMSearchMode mode)
+{
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    /* blocking anyway, so it's worth loading the occupancy cache first, for beginSearch() to trim the range */
+    if (mode == FPMSearchMode::AUTO && !isBusy()) loadIndexCache();
+#endif
+
+    if (!beginSearch(slot, startId, count, mode)) return FPMStatus::PENDING;
     
-    writePacket(FPM_COMMANDPACKET, buffer, 6);
+    FPMStatus confirmCode = waitResponse();
+    if (confirmCode != FPMStatus::OK) return confirmCode;
     
-    FPMStatus confirmCode;
-    uint16_t readLen = 0;
+    return getSearchResult(finger_id, score);
+}
+
+bool FPM::beginSearch(uint8_t slot, uint16_t startId, uint16_t count, FPMSearchMode mode) 
+{
+    if (isBusy()) return false;
     
-    FPMStatus status = readAckGetResponse(&confirmCode, &readLen);
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    uint16_t first, last;
     
-    if (FPM::isErrorCode(status)) return status;
-    if (confirmCode != FPMStatus::OK) return confirmCode;
-    if (readLen != 4) return FPMStatus::READ_ERROR;
+    /* skip the empty slots at either end of the range, there's nothing to match there */
+    if (mode == FPMSearchMode::AUTO && count != 0 && getOccupiedRange(&first, &last))
+    {
+        uint32_t lo = max(startId, first);
+        uint32_t end = min((uint32_t)startId + count, (uint32_t)last + 1);
+        
+        if (end > lo) {
+            startId = lo;
+            count = end - lo;
+        }
+        else {
+            /* nothing at all in range, but the sensor must still be asked, for the sake of poll(); 
+             * #startId itself is empty, so that it can only come back with NOTFOUND */
+            count = 1;
+        }
+    }
+#endif
+
+    /* no high-speed search on some sensors, like the R551 */
+    buffer[0] = (mode == FPMSearchMode::NORMAL || !hasTrait(FPM_TRAIT_HISPEED_SEARCH)) ? FPM_SEARCH : FPM_HISPEEDSEARCH;
+
+    buffer[1] = slot;
+    buffer[2] = (uint8_t)(startId >> 8); 
+    buffer[3] = (uint8_t)(startId & 0xFF);
+    buffer[4] = (uint8_t)(count >> 8); 
+    buffer[5] = (uint8_t)(count & 0xFF);
+    
+    return beginCommand(6);
+}
+
+FPMStatus FPM::getSearchResult(uint16_t * finger_id, uint16_t * score)
+{
+    if (ackLen != 4) return FPMStatus::READ_ERROR;
 
     *finger_id = buffer[1];
     *finger_id <<= 8;
@@ -416,36 +917,68 @@ FPMStatus FPM::searchDatabase(uint16_t * finger_id, uint16_t * score, uint8_t sl
     *score <<= 8;
     *score |= buffer[4];
 
-    return confirmCode;
+    return FPMStatus::OK;
 }
 
 FPMStatus FPM::matchTemplatePair(uint16_t * score) 
 {
-    buffer[0] = FPM_PAIRMATCH;
-    
-    writePacket(FPM_COMMANDPACKET, buffer, 1);
+    if (!beginMatchTemplatePair()) return FPMStatus::PENDING;
     
-    FPMStatus confirmCode;
-    uint16_t readLen = 0;
+    FPMStatus confirmCode = waitResponse();
+    if (confirmCode != FPMStatus::OK) return confirmCode;
     
-    FPMStatus status = readAckGetResponse(&confirmCode, &readLen);
+    return getMatchScore(score);
+}
+
+bool FPM::beginMatchTemplatePair(void) 
+{
+    if (isBusy()) return false;
     
-    if (FPM::isErrorCode(status)) return status;
-    if (confirmCode != FPMStatus::OK) return confirmCode;
-    if (readLen != 2) return FPMStatus::READ_ERROR;
+    buffer[0] = FPM_PAIRMATCH;
+    return beginCommand(1);
+}
+
+FPMStatus FPM::verify(uint16_t id, uint16_t * score)
+{
+    if (id >= sysParams.capacity) return FPMStatus::INVALID_PARAMS;
+    
+    /* no need to load the template again, if it's still there from the last time */
+    if (slotIds[1] != id)
+    {
+        FPMStatus status = loadTemplate(id, 2);
+        if (status != FPMStatus::OK) return status;
+    }
+    
+    return matchTemplatePair(score);
+}
+
+FPMStatus FPM::getMatchScore(uint16_t * score)
+{
+    if (ackLen != 2) return FPMStatus::READ_ERROR;
     
     *score = buffer[1]; 
     *score <<= 8;
     *score |= buffer[2];
 
-    return confirmCode;
+    return FPMStatus::OK;
 }
 
 FPMStatus FPM::getTemplateCount(uint16_t * templateCount) 
 {
-    buffer[0] = FPM_TEMPLATECOUNT;
-    
-    writePacket(FPM_COMMANDPACKET, buffer, 1);
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    if (loadIndexCache())
+    {
+        *templateCount = 0;
+        
+        for (uint16_t i = 0; i < (sysParams.capacity + 31) / 32; i++) {
+            *templateCount += __builtin_popcountl(indexCache[i]);
+        }
+        
+        return FPMStatus::OK;
+    }
+#endif
+
+    writeFrame(FPMFrame::TEMPLATECOUNT);
     
     FPMStatus confirmCode;
     uint16_t readLen = 0;
@@ -463,7 +996,30 @@ FPMStatus FPM::getTemplateCount(uint16_t * templateCount)
     return confirmCode;
 }
 
-FPMStatus FPM::getFreeIndex(uint8_t page, int16_t * id) 
+/* stops at the first gap in a run of occupied IDs, #ctx being the next ID expected */
+static bool nextFreeId(uint16_t id, void * ctx)
+{
+    uint16_t * candidate = (uint16_t *)ctx;
+    
+    if (id != *candidate) return false;
+    
+    (*candidate)++;
+    return true;
+}
+
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+
+static bool setIndexCacheBit(uint16_t id, void * ctx)
+{
+    uint32_t * cache = (uint32_t *)ctx;
+    
+    if (id < FPM_INDEX_CACHE_SLOTS) cache[id / 32] |= (1UL << (id % 32));
+    return true;
+}
+
+#endif
+
+FPMStatus FPM::readIndexTable(uint8_t page, uint16_t * readLen)
 {
     buffer[0] = FPM_READTEMPLATEINDEX; 
     buffer[1] = page;
@@ -471,11 +1027,31 @@ FPMStatus FPM::getFreeIndex(uint8_t page, int16_t * id)
     writePacket(FPM_COMMANDPACKET, buffer, 2);
     
     FPMStatus confirmCode; 
-    uint16_t readLen = 0;
     
-    FPMStatus status = readAckGetResponse(&confirmCode, &readLen);
+    FPMStatus status = readAckGetResponse(&confirmCode, readLen);
     
     if (FPM::isErrorCode(status)) return status;
+    return confirmCode;
+}
+
+FPMStatus FPM::getFreeIndex(uint8_t page, int16_t * id) 
+{
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    if (loadIndexCache())
+    {
+        /* the IDs covered by this page of the index */
+        const int32_t pageStart = (int32_t)FPM_TEMPLATES_PER_PAGE * page - indexOffset();
+        
+        getFreeId(id, max(pageStart, (int32_t)0));
+        
+        if (*id >= pageStart + FPM_TEMPLATES_PER_PAGE) *id = -1;
+        return FPMStatus::OK;
+    }
+#endif
+
+    uint16_t readLen = 0;
+    
+    FPMStatus confirmCode = readIndexTable(page, &readLen);
     if (confirmCode != FPMStatus::OK) return confirmCode;
     
     /* each bit within a byte represents the occupancy status of a slot
@@ -487,13 +1063,11 @@ FPMStatus FPM::getFreeIndex(uint8_t page, int16_t * id)
         
         for (uint8_t bit_mask = 0x01, fid = 0; bit_mask != 0; bit_mask <<= 1, fid++) {
             if ((bit_mask & group) == 0) {
-                #if defined(FPM_R551_MODULE)
-                if (page == 0 && group_idx == 0 && fid == 0)     /* Skip LSb of first group */
+                /* with off-by-one IDs, the LSb of the first group is no ID at all */
+                int32_t candidate = (int32_t)(FPM_TEMPLATES_PER_PAGE * page) + (group_idx * 8) + fid - indexOffset();
+                if (candidate < 0)
                     continue;
-                *id = (FPM_TEMPLATES_PER_PAGE * page) + (group_idx * 8) + fid - 1;      /* all IDs are off by one */
-                #else
-                *id = (FPM_TEMPLATES_PER_PAGE * page) + (group_idx * 8) + fid;
-                #endif
+                *id = candidate;
                 return confirmCode;
             }
         }
@@ -503,11 +1077,172 @@ FPMStatus FPM::getFreeIndex(uint8_t page, int16_t * id)
     return confirmCode;
 }
 
-FPMStatus FPM::getRandomNumber(uint32_t * number) 
+FPMStatus FPM::getFreeId(int16_t * id, uint16_t fromId)
+{
+    *id = -1;
+    
+    if (fromId >= sysParams.capacity) return FPMStatus::OK;
+    
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    if (loadIndexCache())
+    {
+        /* mark everything before #fromId as taken, then the first zero bit is the free ID */
+        uint16_t wordIdx = fromId / 32;
+        uint32_t freeBits = ~indexCache[wordIdx] & (0xFFFFFFFFUL << (fromId % 32));
+        
+        while (freeBits == 0 && ++wordIdx < (sysParams.capacity + 31) / 32) {
+            freeBits = ~indexCache[wordIdx];
+        }
+        
+        if (freeBits != 0)
+        {
+            uint16_t freeId = wordIdx * 32 + __builtin_ctzl(freeBits);
+            if (freeId < sysParams.capacity) *id = freeId;
+        }
+        
+        return FPMStatus::OK;
+    }
+#endif
+
+    /* otherwise, the first free ID is the first one not taken, after a run of occupied IDs starting at #fromId */
+    uint16_t candidate = fromId;
+    
+    FPMStatus status = walkIndexTable(fromId, nextFreeId, &candidate);
+    if (status != FPMStatus::OK) return status;
+    
+    if (candidate < sysParams.capacity) *id = candidate;
+    return FPMStatus::OK;
+}
+
+FPMStatus FPM::forEachTemplate(uint16_t fromId, bool (*callback)(uint16_t id, void * ctx), void * ctx)
+{
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    if (loadIndexCache())
+    {
+        for (uint16_t wordIdx = fromId / 32; wordIdx < (sysParams.capacity + 31) / 32; wordIdx++)
+        {
+            uint32_t bits = indexCache[wordIdx];
+            if (wordIdx == fromId / 32) bits &= (0xFFFFFFFFUL << (fromId % 32));
+            
+            while (bits != 0)
+            {
+                uint8_t bit = __builtin_ctzl(bits);
+                bits &= bits - 1;
+                
+                if (!callback(wordIdx * 32 + bit, ctx)) return FPMStatus::OK;
+            }
+        }
+        
+        return FPMStatus::OK;
+    }
+#endif
+
+    return walkIndexTable(fromId, callback, ctx);
+}
+
+void FPM::invalidateIndexCache(void)
+{
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    indexCacheValid = false;
+    indexOpCount = 0;
+#endif
+}
+
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+
+bool FPM::loadIndexCache(void)
 {
-    buffer[0] = FPM_GETRANDOM;
+    if (indexCacheValid) return true;
+    if (sysParams.capacity > FPM_INDEX_CACHE_SLOTS) return false;
     
-    writePacket(FPM_COMMANDPACKET, buffer, 1);
+    memset(indexCache, 0, sizeof(indexCache));
+    
+    indexCacheValid = (walkIndexTable(0, setIndexCacheBit, indexCache) == FPMStatus::OK);
+    return indexCacheValid;
+}
+
+bool FPM::getOccupiedRange(uint16_t * first, uint16_t * last)
+{
+    /* loading it would take a round trip per page, too long for a begin*() method */
+    if (!indexCacheValid) return false;
+    
+    const int16_t numWords = (sysParams.capacity + 31) / 32;
+    int16_t lo = 0, hi = numWords - 1;
+    
+    while (lo < numWords && indexCache[lo] == 0) lo++;
+    if (lo == numWords) return false;
+    
+    while (indexCache[hi] == 0) hi--;
+    
+    *first = lo * 32 + __builtin_ctzl(indexCache[lo]);
+    /* unsigned long may well be wider than 32 bits */
+    *last = hi * 32 + 31 - (__builtin_clzl(indexCache[hi]) - (8 * sizeof(unsigned long) - 32));
+    return true;
+}
+
+void FPM::updateIndexCache(uint16_t start, uint16_t count, bool occupied)
+{
+    /* emptying the database leaves nothing to load */
+    if (!indexCacheValid && start == 0 && count >= sysParams.capacity && !occupied)
+    {
+        indexCacheValid = (sysParams.capacity <= FPM_INDEX_CACHE_SLOTS);
+    }
+    
+    if (!indexCacheValid) return;
+    
+    uint32_t end = min((uint32_t)start + count, (uint32_t)sysParams.capacity);
+    
+    for (uint32_t id = start; id < end; id++)
+    {
+        if (occupied)
+            indexCache[id / 32] |= (1UL << (id % 32));
+        else
+            indexCache[id / 32] &= ~(1UL << (id % 32));
+    }
+}
+
+#endif
+
+FPMStatus FPM::walkIndexTable(uint16_t fromId, bool (*callback)(uint16_t id, void * ctx), void * ctx)
+{
+    const uint16_t OFFSET = indexOffset();
+    
+    /* a local copy of each page, since the callback is free to issue commands of its own */
+    uint8_t groups[FPM_TEMPLATES_PER_PAGE / 8];
+    const uint16_t lastBit = sysParams.capacity + OFFSET;
+    
+    for (uint16_t page = (fromId + OFFSET) / FPM_TEMPLATES_PER_PAGE; 
+         page * FPM_TEMPLATES_PER_PAGE < lastBit; page++)
+    {
+        uint16_t readLen = 0;
+        
+        FPMStatus confirmCode = readIndexTable(page, &readLen);
+        if (confirmCode != FPMStatus::OK) return confirmCode;
+        
+        readLen = min(readLen, (uint16_t)sizeof(groups));
+        memcpy(groups, &buffer[1], readLen);
+        
+        for (uint16_t group_idx = 0; group_idx < readLen; group_idx++) {
+            if (groups[group_idx] == 0)         /* if group is all empty */
+                continue;
+            
+            for (uint8_t bit_mask = 0x01, fid = 0; bit_mask != 0; bit_mask <<= 1, fid++) {
+                uint16_t bit = (FPM_TEMPLATES_PER_PAGE * page) + (group_idx * 8) + fid;
+                
+                if ((bit_mask & groups[group_idx]) == 0 || bit < fromId + OFFSET || bit >= lastBit)
+                    continue;
+                
+                if (!callback(bit - OFFSET, ctx)) return FPMStatus::OK;
+            }
+        }
+    }
+    
+    return FPMStatus::OK;
+}
+
+FPMStatus FPM::getRandomNumber(uint32_t * number) 
+{
+    writeFrame(FPMFrame::GETRANDOM);
     
     FPMStatus confirmCode;
     uint16_t readLen = 0;
@@ -530,8 +1265,42 @@ FPMStatus FPM::getRandomNumber(uint32_t * number)
 }
 
 bool FPM::handshake(void) {
-    buffer[0] = FPM_HANDSHAKE;
-    return writeCommandGetResponse(1) == FPMStatus::HANDSHAKE_OK;
+    return writeCommandGetResponse(FPMFrame::HANDSHAKE) == FPMStatus::HANDSHAKE_OK;
+}
+
+uint8_t FPM::loadFrame(FPMFrame frame)
+{
+    static_assert(sizeof(fixedFrames) / sizeof(fixedFrames[0]) == (size_t)FPMFrame::COUNT, "one frame per FPMFrame");
+    
+    const FPMFrameBytes * src = &fixedFrames[static_cast<uint8_t>(frame)];
+    const uint8_t len = pgm_read_byte(&src->length);
+    
+    memcpy_P(&txBuffer[FPM_FRAME_OFFSET], src->bytes, len);
+    
+    /* the payload, between the header and the checksum */
+    memcpy(buffer, &txBuffer[FPM_HEADER_LEN], FPM_FRAME_OFFSET + len - FPM_HEADER_LEN - FPM_CHECKSUM_LENGTH);
+    
+    return len;
+}
+
+void FPM::sendFrame(uint8_t frameLen)
+{
+    port->write(txBuffer, FPM_FRAME_OFFSET + frameLen);
+    
+    FPM_LOG_EVENT(FPM_LOG_LEVEL_VERBOSE, WRITE, FPM_COMMANDPACKET, 
+                  FPM_FRAME_OFFSET + frameLen - FPM_HEADER_LEN - FPM_CHECKSUM_LENGTH);
+    
+    FPM_METRICS_COUNT(packetsOut, 1);
+    FPM_METRICS_COUNT(bytesOut, FPM_FRAME_OFFSET + frameLen);
+    
+#if (FPM_METRICS)
+    startCommandMetrics(buffer[0]);
+#endif
+}
+
+void FPM::writeFrame(FPMFrame frame)
+{
+    sendFrame(loadFrame(frame));
 }
 
 void FPM::writePacket(uint8_t pktId, uint8_t * srcBuffer, uint16_t writeLen)
@@ -539,24 +1308,38 @@ void FPM::writePacket(uint8_t pktId, uint8_t * srcBuffer, uint16_t writeLen)
     writePacket(srcBuffer, NULL, &writeLen, pktId);
 }
 
+void FPM::prepareTxHeader(void)
+{
+    txBuffer[0] = (uint8_t)(FPM_STARTCODE >> 8);
+    txBuffer[1] = (uint8_t)FPM_STARTCODE;
+    txBuffer[2] = (uint8_t)(address >> 24);
+    txBuffer[3] = (uint8_t)(address >> 16);
+    txBuffer[4] = (uint8_t)(address >> 8);
+    txBuffer[5] = (uint8_t)(address);
+}
+
 FPMStatus FPM::writePacket(uint8_t * srcBuffer, Stream * srcStream, uint16_t * writeLen, uint8_t pktId) 
 {
     /* Add length of checksum to get the total length */
-    uint16_t totalLen = *writeLen + 2;
-    
-    /* write the header */
-    port->write((uint8_t)(FPM_STARTCODE >> 8));
-    port->write((uint8_t)FPM_STARTCODE);
-    port->write((uint8_t)(address >> 24));
-    port->write((uint8_t)(address >> 16));
-    port->write((uint8_t)(address >> 8));
-    port->write((uint8_t)(address));
-    port->write((uint8_t)pktId);
-    port->write((uint8_t)(totalLen >> 8));
-    port->write((uint8_t)(totalLen));
+    uint16_t totalLen = *writeLen + FPM_CHECKSUM_LENGTH;
+    
+    /* the rest of the header, after the start code and address */
+    txBuffer[6] = pktId;
+    txBuffer[7] = (uint8_t)(totalLen >> 8);
+    txBuffer[8] = (uint8_t)(totalLen);
     
     /* begin calculating the checksum */
     uint16_t sum = (totalLen >> 8) + (totalLen & 0xFF) + pktId;
+    
+    /* if the whole packet fits in the staging buffer, it gets sent with a single write at the end.
+     * Otherwise, the header, payload and checksum are written separately. */
+    const bool staged = (FPM_HEADER_LEN + totalLen <= FPM_TX_BUFFER_SZ);
+    uint8_t * payload = &txBuffer[FPM_HEADER_LEN];
+    
+    if (!staged)
+    {
+        port->write(txBuffer, FPM_HEADER_LEN);
+    }
             
     /* for the payload, read it from the Stream if one has been provided */
     if (srcStream != NULL)
@@ -567,7 +1350,7 @@ FPMStatus FPM::writePacket(uint8_t * srcBuffer, Stream * srcStream, uint16_t * w
         uint32_t lastRead = millis();
         
         /* read from the given Stream in chunks,
-         * and write to the sensor simultaneously */
+         * and stage them or write them to the sensor simultaneously */
         while ((uint32_t)(millis() - lastRead) < FPM_DEFAULT_TIMEOUT)
         {
             uint16_t toWrite = min(remaining, CHUNK_SIZE);
@@ -576,11 +1359,13 @@ FPMStatus FPM::writePacket(uint8_t * srcBuffer, Stream * srcStream, uint16_t * w
             
             lastRead = millis();
             
-            srcStream->readBytes(buffer, toWrite);
-            port->write(buffer, toWrite);
+            uint8_t * chunk = staged ? payload + (*writeLen - remaining) : buffer;
+            srcStream->readBytes(chunk, toWrite);
+            
+            if (!staged) port->write(chunk, toWrite);
             
             for (int i = 0; i < toWrite; i++) {
-                sum += buffer[i];
+                sum += chunk[i];
             }
             
             remaining -= toWrite;
@@ -591,10 +1376,18 @@ FPMStatus FPM::writePacket(uint8_t * srcBuffer, Stream * srcStream, uint16_t * w
         /* if we actually timed out, just return */
         if (millis() - lastRead >= FPM_DEFAULT_TIMEOUT)
         {
-            FPM_LOGLN_ERROR("writePacket: timed out while reading from Stream");
+            FPM_LOG_EVENT(FPM_LOG_LEVEL_ERROR, WRITE_TIMEOUT, 0, 0);
             return FPMStatus::TIMEOUT;
         }
     }
+    else if (staged)
+    {
+        /* copy the payload into place and accumulate the checksum in the same pass */
+        for (int i = 0; i < *writeLen; i++) {
+            payload[i] = srcBuffer[i];
+            sum += srcBuffer[i];
+        }
+    }
     else
     {
         /* just write the payload straight from the provided buffer */
@@ -606,52 +1399,135 @@ FPMStatus FPM::writePacket(uint8_t * srcBuffer, Stream * srcStream, uint16_t * w
     }
     
     /* finally, the checksum */
-    port->write((uint8_t)(sum >> 8));
-    port->write((uint8_t)sum);
+    uint8_t * chksum = staged ? payload + *writeLen : buffer;
+    chksum[0] = (uint8_t)(sum >> 8);
+    chksum[1] = (uint8_t)sum;
+    
+    if (staged)
+        port->write(txBuffer, FPM_HEADER_LEN + totalLen);
+    else
+        port->write(chksum, FPM_CHECKSUM_LENGTH);
+    
+    FPM_LOG_EVENT(FPM_LOG_LEVEL_VERBOSE, WRITE, pktId, *writeLen);
+    
+    FPM_METRICS_COUNT(packetsOut, 1);
+    FPM_METRICS_COUNT(bytesOut, FPM_HEADER_LEN + totalLen);
+    
+#if (FPM_METRICS)
+    if (pktId == FPM_COMMANDPACKET && srcBuffer != NULL) startCommandMetrics(srcBuffer[0]);
+#endif
+    
     return FPMStatus::LIB_OK;
 }
 
 FPMStatus FPM::readPacket(uint8_t * destBuffer, Stream * destStream, uint16_t * readLen, uint8_t * pktId) 
 {
-    /* Basic sanity check */
-    if (destStream == NULL && readLen == NULL)
+    /* Basic sanity check: a buffer, like a read into it, needs #readLen */
+    if ((destStream == NULL || destBuffer != NULL) && readLen == NULL)
     {
         return FPMStatus::INVALID_PARAMS;
     }
     
-    FPMState state = FPMState::READ_HEADER;
+    startPacketRead(destBuffer, destStream, (readLen != NULL) ? *readLen : 0);
     
-    uint16_t header = 0;
-    uint16_t packetLen = 0;
-    uint16_t remaining = 0;
-    uint16_t chksum = 0;
-    const uint16_t CHUNK_SIZE = 32;
+    FPMStatus status;
+    while ((status = pollPacket(readLen, pktId)) == FPMStatus::PENDING)
+    {
+        yield();
+    }
     
-    uint32_t lastRead = millis();
+    return status;
+}
+
+void FPM::startPacketRead(uint8_t * destBuffer, Stream * destStream, uint16_t maxLen)
+{
+    rxState = FPMState::READ_HEADER;
+    rxHeader = 0;
+    rxDestBuffer = destBuffer;
+    rxDestStream = destStream;
+    rxChunked = false;
+    rxMaxLen = maxLen;
+    rxLastRead = millis();
+    
+    FPM_LOG_EVENT(FPM_LOG_LEVEL_VERBOSE, READ_START, 0, 0);
+}
+
+FPMStatus FPM::checkReadTimeout(void)
+{
+    if ((uint32_t)(millis() - rxLastRead) < readTimeout)
+        return FPMStatus::PENDING;
     
-    FPM_LOG_VERBOSE("\r\n");
+    rxState = FPMState::IDLE;
     
-    while ((uint32_t)(millis() - lastRead) < FPM_DEFAULT_TIMEOUT)
+    /* while begin() is probing, most probes go unanswered; it reports the one timeout that matters itself */
+    FPM_LOG_EVENT((probing ? FPM_LOG_LEVEL_VERBOSE : FPM_LOG_LEVEL_ERROR), READ_TIMEOUT, 0, 0);
+    FPM_METRICS_COUNT(timeouts, 1);
+    return FPMStatus::TIMEOUT;
+}
+
+void FPM::setStagingBuffer(uint8_t * buf, uint16_t len)
+{
+    if (buf != NULL && len != 0) {
+        rxStaging = buf;
+        rxStagingLen = len;
+    }
+    else {
+        /* the TX staging buffer is idle while a packet is being read,
+         * so borrow everything after its pre-filled header */
+        rxStaging = &txBuffer[FPM_HEADER_LEN];
+        rxStagingLen = FPM_TX_BUFFER_SZ - FPM_HEADER_LEN;
+    }
+}
+
+uint16_t FPM::readChunk(uint8_t * dest, uint16_t len, uint16_t sum)
+{
+#if defined(ARDUINO_ARCH_ESP32) || defined(ARDUINO_ARCH_ESP8266)
+    /* these cores override readBytes() with a bulk copy out of the UART driver */
+    port->readBytes(dest, len);
+    
+    for (uint16_t i = 0; i < len; i++) {
+        sum += dest[i];
+    }
+#else
+    /* elsewhere, readBytes() reads a byte at a time anyway, checking for a timeout after each.
+     * Since these bytes are already available, skip that, and checksum each byte as it's copied. */
+    for (uint16_t i = 0; i < len; i++) {
+        uint8_t byte = port->read();
+        dest[i] = byte;
+        sum += byte;
+    }
+#endif
+
+    return sum;
+}
+
+FPMStatus FPM::pollPacket(uint16_t * readLen, uint8_t * pktId)
+{
+    /* keep going for as long as there are enough bytes available to make progress */
+    while (true)
     {        
-        switch (state)
+        switch (rxState)
         {
+            case FPMState::IDLE:
+                return FPMStatus::INVALID_PARAMS;
+                
             case FPMState::READ_HEADER:
             {
                 if (port->available() == 0)
-                    break;
+                    return checkReadTimeout();
                 
                 /* check if we've just read the header */
                 uint8_t byte = port->read();
-                lastRead = millis();
+                rxLastRead = millis();
                 
-                header <<= 8; header |= byte;
-                if (header != FPM_STARTCODE)
+                rxHeader <<= 8; rxHeader |= byte;
+                if (rxHeader != FPM_STARTCODE)
                     break;
                 
-                FPM_LOGLN_VERBOSE("Found Header");
+                FPM_LOG_EVENT(FPM_LOG_LEVEL_VERBOSE, HEADER, 0, 0);
                 
-                header = 0;
-                state = FPMState::READ_METADATA;
+                rxHeader = 0;
+                rxState = FPMState::READ_METADATA;
                 break;
             }
                 
@@ -660,9 +1536,9 @@ FPMStatus FPM::readPacket(uint8_t * destBuffer, Stream * destStream, uint16_t *
                 /* metadata consists of:
                  * Address (4), Packet ID (1), Length (2) */
                 if (port->available() < (4 + 1 + 2))
-                    break;
+                    return checkReadTimeout();
                     
-                lastRead = millis();
+                rxLastRead = millis();
                 
                 /* Read, reverse and compare address */
                 uint32_t addr;
@@ -670,152 +1546,449 @@ FPMStatus FPM::readPacket(uint8_t * destBuffer, Stream * destStream, uint16_t *
                 reverseBytes(&addr, 4);
                 
                 if (addr != address) {
-                    state = FPMState::READ_HEADER;
-                    FPM_LOGLN_ERROR("Wrong address: 0x%X", addr);
+                    rxState = FPMState::READ_HEADER;
+                    FPM_LOG_EVENT(FPM_LOG_LEVEL_ERROR, WRONG_ADDRESS, addr, 0);
+                    FPM_METRICS_COUNT(wrongAddress, 1);
                     break;
                 }
                 
-                FPM_LOGLN_VERBOSE("Address: 0x%X", addr);
+                FPM_LOG_EVENT(FPM_LOG_LEVEL_VERBOSE, ADDRESS, addr, 0);
                 
                 /* read packet ID */
-                *pktId = port->read();
-                chksum = *pktId;
-                FPM_LOGLN_VERBOSE("PID: 0x%X", *pktId);
+                rxPktId = port->read();
+                rxChksum = rxPktId;
+                FPM_LOG_EVENT(FPM_LOG_LEVEL_VERBOSE, PACKET_ID, rxPktId, 0);
                 
                 /* read and compare length */
-                port->readBytes((uint8_t *)&packetLen, 2);
-                reverseBytes(&packetLen, 2);
+                port->readBytes((uint8_t *)&rxPacketLen, 2);
+                reverseBytes(&rxPacketLen, 2);
                 
                 /* ensure packet length is within acceptable bounds */
-                if (packetLen <= FPM_CHECKSUM_LENGTH ||
-                    packetLen > FPM_MAX_PACKET_LEN + FPM_CHECKSUM_LENGTH ||
-                    (destStream == NULL && readLen != NULL && packetLen > (*readLen) + FPM_CHECKSUM_LENGTH)) 
+                if (rxPacketLen <= FPM_CHECKSUM_LENGTH ||
+                    rxPacketLen > FPM_MAX_PACKET_LEN + FPM_CHECKSUM_LENGTH ||
+                    (rxDestStream == NULL && !rxChunked && rxPacketLen > rxMaxLen + FPM_CHECKSUM_LENGTH)) 
                 {
-                    state = FPMState::READ_HEADER;
-                    FPM_LOGLN_ERROR("Length is invalid or too large: %u", packetLen);
+                    rxState = FPMState::READ_HEADER;
+                    FPM_LOG_EVENT(FPM_LOG_LEVEL_ERROR, BAD_LENGTH, rxPacketLen, 0);
+                    FPM_METRICS_COUNT(badLength, 1);
                     break;
                 }
                 
-                FPM_LOGLN_VERBOSE("Length: %u", packetLen - FPM_CHECKSUM_LENGTH);
+                FPM_LOG_EVENT(FPM_LOG_LEVEL_VERBOSE, LENGTH, rxPacketLen - FPM_CHECKSUM_LENGTH, 0);
                 
                 /* number of bytes left to read, excluding checksum */
-                remaining = packetLen - FPM_CHECKSUM_LENGTH;
+                rxRemaining = rxPacketLen - FPM_CHECKSUM_LENGTH;
                 
-                chksum += packetLen >> 8; chksum += packetLen & 0xFF;
-                state = (remaining == 0) ? FPMState::READ_CHECKSUM : FPMState::READ_PAYLOAD;
+                rxChksum += rxPacketLen >> 8; rxChksum += rxPacketLen & 0xFF;
+                rxState = (rxRemaining == 0) ? FPMState::READ_CHECKSUM : FPMState::READ_PAYLOAD;
                 break;
             }
             
             case FPMState::READ_PAYLOAD:
             {
-                /* wait until we've received the chunk size or everything that's left,
+                /* wait until we've received the minimum chunk size or everything that's left,
                  * whichever is lesser */
-                uint16_t toRead = min(remaining, CHUNK_SIZE);
-                if (port->available() < toRead) break;
+                int available = port->available();
+                if (available < (int)min(rxRemaining, (uint16_t)FPM_RX_CHUNK_MIN)) 
+                    return checkReadTimeout();
                 
-                lastRead = millis();
+                rxLastRead = millis();
                 
-                /* temporary reference to the chunk that will be read soon */
-                uint8_t * tmpRef;
+                /* then take everything that's available, up to the rest of the payload */
+                uint16_t toRead = min(rxRemaining, (uint16_t)available);
+                uint8_t * chunk;
                 
-                /* if a Stream has been provided,
-                 * read in the data first, then write it to the Stream */
-                if (destStream != NULL) {
-                    port->readBytes(buffer, toRead);
-                    destStream->write(buffer, toRead);
-                    tmpRef = buffer;
+                /* if a sink has been provided, read into its window if it has one, or else stage the data first. 
+                 * The same goes for a Stream. Otherwise a buffer must have been provided, so read directly into it */
+                if (rxChunked && rxWindowLen != 0) {
+                    toRead = min(toRead, rxWindowLen);
+                    chunk = rxWindow;
+                }
+                else if (rxDestStream != NULL || rxChunked) {
+                    toRead = min(toRead, rxStagingLen);
+                    chunk = rxStaging;
                 }
-                /* otherwise a buffer must have been provided,
-                 * so read directly into it */
                 else {
-                    port->readBytes(destBuffer, toRead);
-                    tmpRef = destBuffer;
-                    destBuffer += toRead;
+                    chunk = rxDestBuffer;
+                    rxDestBuffer += toRead;
+                }
+                
+                rxChksum = readChunk(chunk, toRead, rxChksum);
+                
+                if (rxDestStream != NULL) {
+                    rxDestStream->write(chunk, toRead);
                 }
                 
-                /* accumulate checksum */
+            #if (FPM_LOG_LEVEL_PACKET >= FPM_LOG_LEVEL_V_VERBOSE)
+                #if (FPM_LOG_MODE == FPM_LOG_MODE_DEFERRED)
+                {
+                    /* just the first few bytes, to tell the chunks apart */
+                    uint32_t head = 0;
+                    
+                    for (uint8_t i = 0; i < 4; i++) {
+                        head = (head << 8) | ((i < toRead) ? chunk[i] : 0);
+                    }
+                    
+                    FPM_LOG_EVENT(FPM_LOG_LEVEL_V_VERBOSE, PAYLOAD, head, toRead);
+                }
+                #else
                 for (int i = 0; i < toRead; i++)
                 {
-                    chksum += tmpRef[i];
-                    FPM_LOG_V_VERBOSE("%X ", tmpRef[i]);
+                    printf("%X ", chunk[i]);
                 }
                 
-                FPM_LOG_V_VERBOSE("\r\n");
+                printf("\r\n");
+                #endif
+            #endif
+                
+                rxRemaining -= toRead;
+                rxState = (rxRemaining == 0) ? FPMState::READ_CHECKSUM : rxState;
+                
+                /* hand the chunk back to the sink, before anything else is read */
+                if (rxChunked) {
+                    rxChunk = chunk;
+                    rxChunkLen = toRead;
+                    return FPMStatus::PENDING;
+                }
                 
-                remaining -= toRead;
-                state = (remaining == 0) ? FPMState::READ_CHECKSUM : state;
                 break;  
             }
             
             case FPMState::READ_CHECKSUM:
             {
                 if (port->available() < FPM_CHECKSUM_LENGTH)
-                    break;
+                    return checkReadTimeout();
                 
-                lastRead = millis();
+                rxLastRead = millis();
                 
                 uint16_t pktChksum = 0;
                 port->readBytes((uint8_t *)&pktChksum, FPM_CHECKSUM_LENGTH);
                 reverseBytes(&pktChksum, FPM_CHECKSUM_LENGTH);
                 
-                if (pktChksum != chksum) {
-                    state = FPMState::READ_HEADER;
-                    FPM_LOGLN_ERROR("Wrong checksum: 0x%X != 0x%X", pktChksum, chksum);
+                if (pktChksum != rxChksum) {
+                    rxState = FPMState::READ_HEADER;
+                    FPM_LOG_EVENT(FPM_LOG_LEVEL_ERROR, WRONG_CHECKSUM, pktChksum, rxChksum);
+                    FPM_METRICS_COUNT(wrongChecksum, 1);
                     break;
                 }
                 
-                FPM_LOGLN_VERBOSE("Read complete.");
-                if (readLen != NULL)    *readLen = packetLen - FPM_CHECKSUM_LENGTH;
+                FPM_LOG_EVENT(FPM_LOG_LEVEL_VERBOSE, READ_COMPLETE, 0, 0);
+                FPM_METRICS_COUNT(packetsIn, 1);
+                FPM_METRICS_COUNT(bytesIn, FPM_HEADER_LEN + rxPacketLen);
+                rxState = FPMState::IDLE;
+                
+                *pktId = rxPktId;
+                if (readLen != NULL)    *readLen = rxPacketLen - FPM_CHECKSUM_LENGTH;
                 
                 return FPMStatus::LIB_OK;
             }
         }
-        
-        yield();
     }
+}
+
+void FPM::startChunkedRead(void)
+{
+    startPacketRead(NULL, NULL, 0);
+    rxChunked = true;
+}
+
+FPMStatus FPM::pollChunk(uint8_t * window, uint16_t windowLen, uint8_t ** chunk, uint16_t * chunkLen, 
+                         uint16_t * readLen, uint8_t * pktId)
+{
+    rxWindow = window;
+    rxWindowLen = (window != NULL) ? windowLen : 0;
+    rxChunkLen = 0;
     
-    FPM_LOGLN_ERROR("readPacket timeout.\r\n");
-    return FPMStatus::TIMEOUT;
+    FPMStatus status = pollPacket(readLen, pktId);
+    
+    *chunk = rxChunk;
+    *chunkLen = rxChunkLen;
+    
+    if (status == FPMStatus::PENDING) return status;
+    
+    if (FPM::isErrorCode(status)) {
+        FPM_LOGLN_ERROR("pollDataPacket: failed with status 0x%X", static_cast<uint16_t>(status));
+        return status;
+    }
+    
+    if (*pktId != FPM_DATAPACKET && *pktId != FPM_ENDDATAPACKET) 
+    {
+        FPM_LOGLN_ERROR("Wrong PID: 0x%X", *pktId);
+        FPM_METRICS_COUNT(wrongPacketId, 1);
+        return FPMStatus::READ_ERROR;
+    }
+    
+    return FPMStatus::OK;
 }
 
 FPMStatus FPM::readAckGetResponse(FPMStatus * confirmCode, uint16_t * readLen) 
 {   
-    uint8_t pktId = 0;
-    *readLen = FPM_BUFFER_SZ;
-    FPMStatus status = readPacket(buffer, NULL, readLen, &pktId);
+    startPacketRead(buffer, NULL, FPM_BUFFER_SZ);
+    FPMStatus status = waitResponse();
     
     /* most likely timed out */
     if (FPM::isErrorCode(status)) return status;
     
+    *confirmCode = status;
+    if (readLen != NULL) *readLen = ackLen;
+    return FPMStatus::LIB_OK;
+}
+
+FPMStatus FPM::poll(void)
+{
+    uint8_t pktId = 0;
+    uint16_t readLen = 0;
+    FPMStatus status = pollPacket(&readLen, &pktId);
+    
+    if (status == FPMStatus::PENDING) return status;
+    
     /* wrong pkt id */
-    if (pktId != FPM_ACKPACKET) {
+    if (status == FPMStatus::LIB_OK && pktId != FPM_ACKPACKET) {
         FPM_LOGLN_ERROR("Wrong PID: 0x%X", pktId);
-        return FPMStatus::READ_ERROR;
+        FPM_METRICS_COUNT(wrongPacketId, 1);
+        status = FPMStatus::READ_ERROR;
     }
     
-    *confirmCode = static_cast<FPMStatus>(buffer[0]);
+    commandDone(status == FPMStatus::LIB_OK ? static_cast<FPMStatus>(buffer[0]) : status);
+    
+#if (FPM_METRICS)
+    endCommandMetrics(status == FPMStatus::LIB_OK ? static_cast<FPMStatus>(buffer[0]) : status);
+#endif
+
+    /* most likely timed out */
+    if (status != FPMStatus::LIB_OK) return status;
     
     /* minus confirmation code */
-    if (readLen != NULL) *readLen = *readLen - 1;
-    return FPMStatus::LIB_OK;
+    ackLen = readLen - 1;
+
+    return static_cast<FPMStatus>(buffer[0]);
 }
 
-FPMStatus FPM::writeCommandGetResponse(uint16_t payloadLen)
+FPMStatus FPM::waitResponse(void)
+{
+    FPMStatus status;
+    while ((status = poll()) == FPMStatus::PENDING)
+    {
+        yield();
+    }
+    
+    return status;
+}
+
+bool FPM::isBusy(void)
+{
+    return rxState != FPMState::IDLE;
+}
+
+void FPM::noteCommand(void)
+{
+    /* the ID, for a store or load, or else the start of the range, for a delete */
+    const uint16_t id = (buffer[0] == FPM_DELETE) ? ((uint16_t)buffer[1] << 8) | buffer[2] : 
+                                                     ((uint16_t)buffer[2] << 8) | buffer[3];
+    
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    indexOpCount = 0;
+#endif
+    slotOpSlot = 0;
+    
+    switch (buffer[0])
+    {
+        case FPM_STORE:
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+            indexOpStart = id;
+            indexOpCount = 1;
+            indexOpOccupied = true;
+#endif
+            /* the other slot no longer matches what's in the database under that ID */
+            forgetSlots(id, 1);
+            slotOpSlot = buffer[1];
+            slotOpId = id;
+            break;
+            
+        case FPM_LOAD:
+            setSlotId(buffer[1], FPM_SLOT_UNKNOWN);
+            slotOpSlot = buffer[1];
+            slotOpId = id;
+            break;
+            
+        case FPM_DELETE:
+        {
+            const uint16_t count = ((uint16_t)buffer[3] << 8) | buffer[4];
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+            indexOpStart = id;
+            indexOpCount = count;
+            indexOpOccupied = false;
+#endif
+            forgetSlots(id, count);
+            break;
+        }
+            
+        case FPM_EMPTYDATABASE:
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+            indexOpStart = 0;
+            indexOpCount = sysParams.capacity;
+            indexOpOccupied = false;
+#endif
+            forgetSlots(0, 0xFFFF);
+            break;
+            
+        /* these overwrite one or both buffers with something new */
+        case FPM_IMAGE2TZ:
+        case FPM_DOWNCHAR:
+            setSlotId(buffer[1], FPM_SLOT_UNKNOWN);
+            break;
+            
+        case FPM_REGMODEL:
+            forgetSlots(0, 0xFFFF);
+            break;
+            
+        /* the buffers don't survive the sensor going to sleep */
+        case FPM_STANDBY:
+            forgetSlots(0, 0xFFFF);
+            break;
+            
+        default:
+            break;
+    }
+}
+
+void FPM::commandDone(FPMStatus status)
+{
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    if (indexOpCount != 0)
+    {
+        /* if the sensor has confirmed a change to the database, the cache should follow suit.
+         * But without a proper ACK, there's no telling whether the change was made or not. */
+        if (FPM::isErrorCode(status))
+            invalidateIndexCache();
+        else if (status == FPMStatus::OK)
+            updateIndexCache(indexOpStart, indexOpCount, indexOpOccupied);
+        
+        indexOpCount = 0;
+    }
+#endif
+
+    if (slotOpSlot != 0 && status == FPMStatus::OK)
+    {
+        setSlotId(slotOpSlot, slotOpId);
+    }
+    
+    slotOpSlot = 0;
+}
+
+#if (FPM_METRICS)
+
+void FPM::getMetrics(FPMMetrics * dest)
+{
+    memcpy(dest, &metrics, sizeof(FPMMetrics));
+}
+
+void FPM::resetMetrics(void)
+{
+    memset(&metrics, 0, sizeof(FPMMetrics));
+    
+    for (uint8_t i = 0; i < FPM_METRICS_COMMAND_COUNT; i++) {
+        metrics.commands[i].command = metricsCommands[i];
+    }
+    
+    metricsCommand = 0xFF;
+}
+
+void FPM::startCommandMetrics(uint8_t command)
 {
+    /* the last entry catches everything else */
+    uint8_t i = 0;
+    while (i < FPM_METRICS_COMMAND_COUNT - 1 && metricsCommands[i] != command) i++;
+    
+    metricsCommand = i;
+    metricsStart = micros();
+}
+
+void FPM::endCommandMetrics(FPMStatus status)
+{
+    if (metricsCommand == 0xFF) return;
+    
+    FPMCommandMetrics * cmd = &metrics.commands[metricsCommand];
+    metricsCommand = 0xFF;
+    
+    const uint32_t elapsed = micros() - metricsStart;
+    
+    cmd->count++;
+    cmd->totalMicros += elapsed;
+    if (elapsed > cmd->maxMicros) cmd->maxMicros = elapsed;
+    
+    uint8_t bucket = 0;
+    for (uint32_t t = elapsed >> 8; t != 0 && bucket < FPM_METRICS_BUCKETS - 1; t >>= 1) {
+        bucket++;
+    }
+    
+    cmd->histogram[bucket]++;
+    
+    if (status == FPMStatus::TIMEOUT)
+        cmd->timeouts++;
+    else if (FPM::isErrorCode(status))
+        cmd->errors++;
+    else if (status != FPMStatus::OK && status != FPMStatus::HANDSHAKE_OK)
+        cmd->notOk++;
+}
+
+#endif
+
+void FPM::setSlotId(uint8_t slot, uint16_t id)
+{
+    if (slot >= 1 && slot <= FPM_TRACKED_SLOTS) slotIds[slot - 1] = id;
+}
+
+void FPM::forgetSlots(uint16_t start, uint16_t count)
+{
+    for (uint8_t i = 0; i < FPM_TRACKED_SLOTS; i++)
+    {
+        if (slotIds[i] != FPM_SLOT_UNKNOWN && slotIds[i] >= start && (uint32_t)slotIds[i] < (uint32_t)start + count)
+        {
+            slotIds[i] = FPM_SLOT_UNKNOWN;
+        }
+    }
+}
+
+bool FPM::beginCommand(uint16_t payloadLen)
+{
+    /* nothing is sent while another command is in progress; the begin*() methods check 
+     * before filling in the buffer, since it still holds that command's response */
+    if (isBusy()) return false;
+    
+    /* note any change this command makes to the database or the buffers */
+    noteCommand();
+    
     writePacket(FPM_COMMANDPACKET, buffer, payloadLen);
+    startPacketRead(buffer, NULL, FPM_BUFFER_SZ);
+    return true;
+}
+
+bool FPM::beginCommand(FPMFrame frame)
+{
+    if (isBusy()) return false;
     
-    FPMStatus confirmCode;
-    uint16_t readLen;
-    FPMStatus status = readAckGetResponse(&confirmCode, &readLen);
+    const uint8_t frameLen = loadFrame(frame);
     
-    /* if we read an ACK packet successfully,
-     * return its confirmation code, otherwise let the caller know why the read failed */
-    return (FPM::isErrorCode(status)) ? status : confirmCode;
+    /* note any change this command makes to the database or the buffers */
+    noteCommand();
+    
+    sendFrame(frameLen);
+    startPacketRead(buffer, NULL, FPM_BUFFER_SZ);
+    return true;
 }
 
-inline bool FPM::isErrorCode(FPMStatus status)
+FPMStatus FPM::writeCommandGetResponse(FPMFrame frame)
 {
-    return static_cast<uint16_t>(status) > static_cast<uint16_t>(FPMStatus::LIB_OK) &&
-            static_cast<uint16_t>(status) <= static_cast<uint16_t>(FPMStatus::ERROR_END);
+    if (!beginCommand(frame)) return FPMStatus::PENDING;
+    return waitResponse();
+}
+
+FPMStatus FPM::writeCommandGetResponse(uint16_t payloadLen)
+{
+    /* if we read an ACK packet successfully,
+     * return its confirmation code, otherwise let the caller know why the read failed */
+    if (!beginCommand(payloadLen)) return FPMStatus::PENDING;
+    return waitResponse();
 }
 
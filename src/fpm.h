@@ -13,9 +13,68 @@
 #include <stddef.h>
 
 /* R551 is different in a few ways (no high-speed search, off-by-one template indices)
-   uncomment this line if you have one of those sensors. */
+   uncomment this line if you have one of those sensors. 
+   It's the same as setting FPM_SENSOR_FAMILIES to FPM_FAMILY_R551 (see below). */
 //#define FPM_R551_MODULE
 
+/* Sensor families, each with its own quirks (see the FPM_TRAIT_* masks below).
+   GENERIC tries every command and makes no adjustments, as the library always did. */
+enum class FPMSensorFamily : uint8_t {
+    GENERIC,
+    R307,       /* also FPM10, R305, ZFM20 */
+    R308,
+    R503,
+    R551,
+    ZFM60,
+    Z70
+};
+
+#define FPM_FAMILY_GENERIC          0x01
+#define FPM_FAMILY_R307             0x02
+#define FPM_FAMILY_R308             0x04
+#define FPM_FAMILY_R503             0x08
+#define FPM_FAMILY_R551             0x10
+#define FPM_FAMILY_ZFM60            0x20
+#define FPM_FAMILY_Z70              0x40
+#define FPM_FAMILY_ALL              0x7F
+
+/* The families this firmware may drive, one per FPM object (given to its constructor).
+   Anything that none of them support is compiled out, and anything that all of them do 
+   is done without checking; only the quirks that differ between them are checked at run-time. */
+#ifndef FPM_SENSOR_FAMILIES
+    #if defined(FPM_R551_MODULE)
+        #define FPM_SENSOR_FAMILIES     FPM_FAMILY_R551
+    #else
+        #define FPM_SENSOR_FAMILIES     FPM_FAMILY_ALL
+    #endif
+#endif
+
+/* The family of an FPM object, unless given to its constructor */
+#ifndef FPM_DEFAULT_FAMILY
+    #if defined(FPM_R551_MODULE)
+        #define FPM_DEFAULT_FAMILY      FPMSensorFamily::R551
+    #else
+        #define FPM_DEFAULT_FAMILY      FPMSensorFamily::GENERIC
+    #endif
+#endif
+
+/* Sensor traits, as the families that have each one */
+
+/* template IDs are off by one in the index table; IDs in commands are sent as they are */
+#define FPM_TRAIT_INDEX_OFFSET      (FPM_FAMILY_R551)
+/* FPM_HISPEEDSEARCH */
+#define FPM_TRAIT_HISPEED_SEARCH    (FPM_FAMILY_ALL & ~FPM_FAMILY_R551)
+/* readProductInfo() */
+#define FPM_TRAIT_PRODUCT_INFO      (FPM_FAMILY_GENERIC | FPM_FAMILY_R503)
+/* ledConfigure(), for the LED ring */
+#define FPM_TRAIT_LED_CONTROL       (FPM_FAMILY_GENERIC | FPM_FAMILY_R503)
+/* ledOn(), ledOff() and getImageOnly() */
+#define FPM_TRAIT_LED_ON_OFF        (FPM_FAMILY_GENERIC | FPM_FAMILY_ZFM60)
+/* standby() */
+#define FPM_TRAIT_STANDBY           (FPM_FAMILY_GENERIC | FPM_FAMILY_R503 | FPM_FAMILY_R551)
+/* no READ_SYSPARAM/SET_SYSPARAM, so params must be given to begin() */
+#define FPM_TRAIT_FIXED_PARAMS      (FPM_FAMILY_R308)
+
 /* signature and packet ids */
 #define FPM_STARTCODE               0xEF01
 
@@ -94,6 +153,13 @@ enum class FPMStatus : uint16_t {
     NO_FREE_INDEX       = 0xFF03,
     /* returned for any invalid params */
     INVALID_PARAMS      = 0xFF04,
+    /* returned by the non-blocking API while a command or packet is still in progress,
+     * and by a command that can't be sent until it's done */
+    PENDING             = 0xFF05,
+    /* returned when a destination Stream won't accept any more bytes */
+    WRITE_ERROR         = 0xFF06,
+    /* returned when a template doesn't fit in the buffer given for it */
+    BUFFER_TOO_SMALL    = 0xFF07,
     
     /* end of library status codes */
     ERROR_END           = 0xFFF0
@@ -102,12 +168,35 @@ enum class FPMStatus : uint16_t {
 #define FPM_MAX_PACKET_LEN          256
 #define FPM_PKT_OVERHEAD_LEN        12
 
+/* Start code (2), Address (4), Packet ID (1), Length (2) */
+#define FPM_HEADER_LEN              9
+#define FPM_CHECKSUM_LENGTH         2
+
 /* Length in bytes of the system parameters read from the sensor */
 #define FPM_SYS_PARAMS_LEN          16
 
 /* default timeout for reading responses/data */
 #define FPM_DEFAULT_TIMEOUT         2000
 
+/* timeout for each response while looking for the sensor's baud rate */
+#ifndef FPM_BAUD_PROBE_TIMEOUT
+    #define FPM_BAUD_PROBE_TIMEOUT  100
+#endif
+
+/* how long begin() keeps asking for the sensor after power-up (500 ms at least according to datasheet),
+ * and how long it waits for each answer */
+#ifndef FPM_STARTUP_TIMEOUT
+    #define FPM_STARTUP_TIMEOUT     1000
+#endif
+
+#ifndef FPM_STARTUP_POLL_INTERVAL
+    #define FPM_STARTUP_POLL_INTERVAL   50
+#endif
+
+/* number of CharBuffer slots whose contents are tracked, for verify() */
+#define FPM_TRACKED_SLOTS           2
+#define FPM_SLOT_UNKNOWN            0xFFFF
+
 /* max number of templates in each "page" returned by FPM_READTEMPLATEINDEX command */
 #define FPM_TEMPLATES_PER_PAGE      256
 
@@ -156,6 +245,31 @@ enum class FPMPacketLength : uint16_t {
     PLEN_256
 };
  
+/* search modes */
+enum class FPMSearchMode : uint8_t {
+    /* exactly the range given, with FPM_SEARCH */
+    NORMAL,
+    /* exactly the range given, with FPM_HISPEEDSEARCH, where the sensor supports it */
+    HIGH_SPEED,
+    /* the range given, trimmed to the occupied IDs within it if the occupancy cache is already loaded
+     * (beginSearch() never loads it, searchDatabase() does), with FPM_HISPEEDSEARCH (0x1B) wherever 
+     * the sensor family has it -- which includes GENERIC, so use NORMAL on a sensor that rejects it */
+    AUTO
+};
+
+/* Called to reopen the port to the sensor at a new baud rate (in bits/s), 
+ * e.g. with Serial1.end() and Serial1.begin(baud) */
+typedef void (*FPMBaudHandler)(uint32_t baud, void * ctx);
+
+/* Outcome of tuneLink() for each configuration tried */
+typedef struct {
+    FPMBaud baudRate;
+    FPMPacketLength packetLen;
+    /* template bytes moved per second (both ways), 0 if any round trip failed */
+    uint32_t bytesPerSec;
+    uint8_t errors;
+} FPMLinkResult;
+
 typedef struct {
     uint16_t statusReg;
     uint16_t systemId;
@@ -198,6 +312,89 @@ typedef struct {
  * FPM_PRODUCT_INFO_LEN is the max payload length for ACKed commands, +1 for confirmation code */
 #define FPM_BUFFER_SZ               (FPM_PRODUCT_INFO_LEN + 1)
 
+/* Size of the staging buffer in which outgoing packets are assembled, to be sent with a single write.
+ * Packets too large for it are sent in 3 writes instead (header, payload, checksum).
+ * By default, AVR only stages command packets, to save RAM. */
+#ifndef FPM_TX_BUFFER_SZ
+    #if defined(ARDUINO_ARCH_AVR)
+        #define FPM_TX_BUFFER_SZ    (FPM_HEADER_LEN + FPM_BUFFER_SZ + FPM_CHECKSUM_LENGTH)
+    #else
+        #define FPM_TX_BUFFER_SZ    (FPM_HEADER_LEN + FPM_MAX_PACKET_LEN + FPM_CHECKSUM_LENGTH)
+    #endif
+#endif
+
+/* Payload bytes are only read once at least this many have arrived (or the rest of the payload, if less), 
+ * and then everything available is read at once, up to the packet length. 
+ * Keep it below the size of the port's RX buffer. */
+#ifndef FPM_RX_CHUNK_MIN
+    #define FPM_RX_CHUNK_MIN        32
+#endif
+
+/* Number of template slots tracked by the occupancy cache, in RAM (1 bit each).
+ * Once loaded, free IDs and template counts are found without querying the sensor.
+ * Sensors with a larger capacity are queried as usual; set it to 0 to do without the cache entirely. */
+#ifndef FPM_INDEX_CACHE_SLOTS
+    #if defined(ARDUINO_ARCH_AVR)
+        #define FPM_INDEX_CACHE_SLOTS   256
+    #else
+        #define FPM_INDEX_CACHE_SLOTS   3072
+    #endif
+#endif
+
+/* Set to 1 to keep counts of the packets, bytes and errors on the link, and of each command's latency (see FPMMetrics).
+ * It takes about 700 bytes of RAM per sensor, so it's left out on AVR by default. */
+#ifndef FPM_METRICS
+    #if defined(ARDUINO_ARCH_AVR)
+        #define FPM_METRICS             0
+    #else
+        #define FPM_METRICS             1
+    #endif
+#endif
+
+/* Buckets in each command's latency histogram: bucket #i counts the commands that took 
+ * under 2^(i+8) us (256 us, 512 us...), and the last one counts all the rest */
+#define FPM_METRICS_BUCKETS         14
+
+/* The commands timed separately; anything else is counted under command 0 */
+#define FPM_METRICS_COMMANDS        { FPM_GETIMAGE, FPM_IMAGE2TZ, FPM_REGMODEL, FPM_STORE, FPM_LOAD, FPM_UPCHAR, FPM_DOWNCHAR, \
+                                      FPM_IMGUPLOAD, FPM_DELETE, FPM_SEARCH, FPM_HISPEEDSEARCH, FPM_PAIRMATCH, \
+                                      FPM_TEMPLATECOUNT, FPM_READTEMPLATEINDEX, 0 }
+#define FPM_METRICS_COMMAND_COUNT   15
+
+/* Round trips of a command: from the start of its packet to the end of its ACK */
+typedef struct {
+    uint8_t command;
+    uint32_t count;
+    uint32_t totalMicros;
+    uint32_t maxMicros;
+    uint16_t histogram[FPM_METRICS_BUCKETS];
+    
+    /* ACKs other than OK (e.g. NOFINGER), and those that never came, or came garbled */
+    uint16_t notOk;
+    uint16_t timeouts;
+    uint16_t errors;
+} FPMCommandMetrics;
+
+typedef struct {
+    /* whole packets, including headers and checksums */
+    uint32_t packetsIn;
+    uint32_t packetsOut;
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+    
+    /* packets dropped while looking for the next header, and reads that timed out */
+    uint16_t wrongChecksum;
+    uint16_t wrongAddress;
+    uint16_t badLength;
+    uint16_t wrongPacketId;
+    uint16_t timeouts;
+    
+    FPMCommandMetrics commands[FPM_METRICS_COMMAND_COUNT];
+} FPMMetrics;
+
+/* Flags for the database backup container */
+#define FPM_BACKUP_COMPRESSED       0x01
+
 /* Default parameters to be used with R308 (and similar)
 
    statusReg: 0x0000,
@@ -212,14 +409,31 @@ typedef struct {
  
 class Stream;
 
+/* states of the packet reader */
+enum class FPMState : uint8_t {
+    IDLE,
+    READ_HEADER,
+    READ_METADATA,
+    READ_PAYLOAD,
+    READ_CHECKSUM
+};
+
 class FPM 
 {
     public:
-    FPM(Stream * ss);
+    /* #family must be one of FPM_SENSOR_FAMILIES */
+    FPM(Stream * ss, FPMSensorFamily family = FPM_DEFAULT_FAMILY);
     
     /** #params argument is only for R308 sensors that must be set manually. 
-        Make sure to use the defaults listed above -- only capacity and packet length are actually relevant */
+        Make sure to use the defaults listed above -- only capacity and packet length are actually relevant.
+        The sensor is polled until it responds, rather than waiting out its whole startup time;
+        if it doesn't respond at all and a port handler is set, every other baud rate is tried. */
     bool begin(uint32_t password = FPM_DEFAULT_PASSWORD, uint32_t address = FPM_DEFAULT_ADDRESS, FPMSystemParams * params = NULL);
+    
+    /** Params (and optionally product info) saved from an earlier session, e.g. in EEPROM,
+     *  so that the next begin() doesn't have to read them from the sensor. Call it before begin().
+     *  They're only used if the sensor is found at the same baud rate and address. */
+    void setCachedParams(const FPMSystemParams * params, const FPMProductInfo * info = NULL);
 
     bool verifyPassword(uint32_t pwd);
     FPMStatus getImage(void);
@@ -232,6 +446,8 @@ class FPM
     /** loads template with ID #id from the database into buffer #slot */
     FPMStatus loadTemplate(uint16_t id, uint8_t slot = 1);
     
+    /** Once the sensor has acknowledged the new rate, the port is reopened with the handler 
+     *  set by setPortBaudHandler(), if any */
     FPMStatus setBaudRate(FPMBaud baudRate);
     FPMStatus setSecurityLevel(FPMSecurityLevel securityLevel);
     FPMStatus setPacketLength(FPMPacketLength packetLen);
@@ -256,17 +472,76 @@ class FPM
     
     /** initiates the transfer of a template from the MCU to buffer #slot */
     FPMStatus uploadTemplate(uint8_t slot = 1);
+    
+    /** Reads the template with ID #id from the database into #destBuffer, by way of buffer #slot.
+     *  #readLen should hold the size of #destBuffer; afterwards, it holds the template length actually read.
+     *  Returns FPMStatus::BUFFER_TOO_SMALL if the template doesn't fit, having read it all the same, so that 
+     *  getTemplateSize() then returns its length. */
+    FPMStatus readTemplate(uint16_t id, uint8_t * destBuffer, uint16_t * readLen, uint8_t slot = 1);
+    
+    /** Writes the template of length #writeLen in #srcBuffer to the database at ID #id, by way of buffer #slot.
+     *  It is split into packets of the current packet length automatically. */
+    FPMStatus writeTemplate(uint16_t id, uint8_t * srcBuffer, uint16_t writeLen, uint8_t slot = 1);
+    
+    /** Same as readTemplate() and writeTemplate(), but only between #slot and the MCU, 
+     *  leaving the database alone. Handy for moving templates from one sensor to another. */
+    FPMStatus fetchTemplate(uint8_t * destBuffer, uint16_t * readLen, uint8_t slot = 1);
+    FPMStatus sendTemplate(uint8_t * srcBuffer, uint16_t writeLen, uint8_t slot = 1);
+    
+#if (FPM_METRICS)
+    /* A copy of the metrics since the last resetMetrics(), e.g. to be exported now and then */
+    void getMetrics(FPMMetrics * dest);
+    void resetMetrics(void);
+#endif
+    
+    /** Returns the length of this sensor's templates, or 0 if it's not known yet.
+     *  It is learnt from readProductInfo(), if supported, or else from the first template read. */
+    uint16_t getTemplateSize(void);
+    
     FPMStatus deleteTemplate(uint16_t id, uint16_t howMany = 1);
     FPMStatus searchDatabase(uint16_t * finger_id, uint16_t * score, uint8_t slot = 1);
+    
+    /** Searches only the #count IDs from #startId onwards, for the features in buffer #slot */
+    FPMStatus searchDatabase(uint16_t * finger_id, uint16_t * score, uint8_t slot, uint16_t startId, uint16_t count, 
+                             FPMSearchMode mode = FPMSearchMode::AUTO);
     FPMStatus getTemplateCount(uint16_t * template_cnt);
+    
+    /** Streams every occupied template with an ID of at least #fromId into #dest, 
+     *  as a self-describing container with a header, an index of IDs and a checksum per template.
+     *  With #compress, runs of zeros in each template are encoded compactly.
+     *  If not NULL, #lastId holds the ID of the last template backed up successfully, or -1.
+     *  To resume an interrupted backup, start a new container from the next ID. */
+    FPMStatus backupDatabase(Stream * dest, bool compress = false, uint16_t fromId = 0, int16_t * lastId = NULL);
+    
+    /** Restores every template in a container written by backupDatabase(), read from #src.
+     *  Templates with IDs below #fromId are checked, but not restored, to resume an interrupted restore.
+     *  If not NULL, #lastId holds the ID of the last template restored successfully, or -1. */
+    FPMStatus restoreDatabase(Stream * src, uint16_t fromId = 0, int16_t * lastId = NULL);
+    
     FPMStatus getFreeIndex(uint8_t page, int16_t * id);
+    
+    /** Finds the first free ID from #fromId onwards, across all pages, or -1 if there's none. 
+     *  With the occupancy cache, this doesn't need the sensor at all, after the first call. */
+    FPMStatus getFreeId(int16_t * id, uint16_t fromId = 0);
+    
+    /** Discards the occupancy cache, so that it gets reloaded from the sensor when next needed.
+     *  Only needed if the database is changed by some other means than this object. */
+    void invalidateIndexCache(void);
     FPMStatus matchTemplatePair(uint16_t * score);
+    
+    /** 1:1 match of the features in buffer 1 (after image2Tz()) against the template with ID #id, 
+     *  which is loaded into buffer 2 only if it's not already there. Returns FPMStatus::NOMATCH if they don't match.
+     *  If the sensor is power-cycled behind this object's back, call begin() again before relying on this. */
+    FPMStatus verify(uint16_t id, uint16_t * score);
     FPMStatus setPassword(uint32_t pwd);
     FPMStatus setAddress(uint32_t addr);
     FPMStatus getRandomNumber(uint32_t * number);
 
     /* these 3 have been tested successfully only on ZFM60 so far. 
-       May yet work on other/newer sensors */
+       May yet work on other/newer sensors.
+       
+       These and the next few return FPMStatus::INVALID_PARAMS if the sensor's family 
+       doesn't support them (see the FPM_TRAIT_* masks) */
     FPMStatus ledOn(void);
     FPMStatus ledOff(void);
     FPMStatus getImageOnly(void);
@@ -283,16 +558,199 @@ class FPM
      * Supported by Z70 at least */
     bool handshake(void);
     
+    /** Non-blocking API:
+     *  Each begin*() method sends its command and returns immediately.
+     *  poll() must then be called repeatedly, reading only the bytes already received, until it returns
+     *  something other than FPMStatus::PENDING -- the confirmation code of the ACK, or a library error code.
+     *  Only one command may be in progress at a time: each returns true once its command has been sent, 
+     *  or false, without sending anything, while isBusy(). The blocking methods then return FPMStatus::PENDING. */
+    bool beginGetImage(void);
+    bool beginImage2Tz(uint8_t slot = 1);
+    bool beginGenerateTemplate(void);
+    bool beginStoreTemplate(uint16_t id, uint8_t slot = 1);
+    bool beginLoadTemplate(uint16_t id, uint8_t slot = 1);
+    bool beginSearch(uint8_t slot = 1);
+    bool beginSearch(uint8_t slot, uint16_t startId, uint16_t count, FPMSearchMode mode = FPMSearchMode::AUTO);
+    bool beginMatchTemplatePair(void);
+    bool beginDownloadImage(void);
+    FPMStatus poll(void);
+    
+    /* once poll() has returned FPMStatus::OK for a search or a pair-match, fetch the results */
+    FPMStatus getSearchResult(uint16_t * finger_id, uint16_t * score);
+    FPMStatus getMatchScore(uint16_t * score);
+    
+    /** Non-blocking version of readDataPacket(), with the same arguments. 
+     *  Returns FPMStatus::PENDING until a DATA packet has been read completely, then FPMStatus::OK */
+    FPMStatus pollDataPacket(uint8_t * destBuffer, Stream * destStream, uint16_t * readLen, bool * readComplete);
+    
+    /** The same, for any class with these (non-virtual) methods, such as those in fpm_sinks.h:
+     *      uint8_t * window(uint16_t * len)            where the next bytes can be read straight into, if anywhere
+     *      void put(const uint8_t * data, uint16_t len)    called with each chunk, whether it was read into the window or not
+     *  Each call to the sink is resolved at compile time. #readLen only returns the length read. 
+     *  These are defined in fpm_sinks.h, which must be included to use them. */
+    template <class Sink>
+    bool readDataPacket(Sink & sink, uint16_t * readLen, bool * readComplete);
+    
+    template <class Sink>
+    FPMStatus pollDataPacket(Sink & sink, uint16_t * readLen, bool * readComplete);
+    
+    /** Writes a DATA packet of up to #writeLen bytes, from any class with these (non-virtual) methods:
+     *      uint32_t available(void)                        bytes left to send
+     *      uint16_t read(uint8_t * dest, uint16_t len)     copies the next #len bytes into #dest
+     *  #writeLen is clipped to the packet length and to what's available; 
+     *  it returns false if there's nothing to send. */
+    template <class Source>
+    bool writeDataPacket(Source & source, uint16_t * writeLen, bool writeComplete);
+    
+    /* true while a command or packet read is still in progress */
+    bool isBusy(void);
+    
+    /** Provide a buffer through which data packets are staged, when they are read into a Stream.
+     *  Each chunk is written to the Stream with a single call, so a buffer as large as the 
+     *  packet length means a single write per packet. By default, the spare room in the 
+     *  TX staging buffer is used, which is already large enough except on AVR.
+     *  Pass NULL to go back to the default. */
+    void setStagingBuffer(uint8_t * buf, uint16_t len);
+    
+    /* for reopening the port whenever the baud rate changes, see FPMBaudHandler */
+    void setPortBaudHandler(FPMBaudHandler handler, void * ctx = NULL);
+    
+    /* how long to wait for each response or data packet, FPM_DEFAULT_TIMEOUT by default */
+    void setReadTimeout(uint16_t timeout);
+    
+    /** Steps through every baud rate from the current one up to 115200, and every packet length at each of them,
+     *  timing #rounds template round trips (to buffer 2 and back, checked byte for byte) at each step. 
+     *  Then it settles on the fastest configuration without errors. 
+     *  Needs the port handler, and a template in buffer 2 or at least one in the database. #probeBuffer must fit a template.
+     *  If #results is given, #numResults should hold its length; afterwards, it holds the number of results filled in.
+     *  Note that the settings are written to the sensor's flash at every step. */
+    FPMStatus tuneLink(uint8_t * probeBuffer, uint16_t bufLen, FPMLinkResult * results = NULL, 
+                       uint8_t * numResults = NULL, uint8_t rounds = 3);
+    
+    static uint32_t baudToBps(FPMBaud baudRate);
+    
+    /** Prints up to #maxEvents of the packet layer's events, logged since the last call, and returns how many.
+     *  Only in FPM_LOG_MODE_DEFERRED (see fpm_logging.h); call it between transfers. */
+    static uint16_t drainLog(uint16_t maxEvents = 0xFFFF);
+    
+    FPMSensorFamily getFamily(void) { return family; }
+    
+    /** True if this sensor's family has the trait #traitFamilies (one of the FPM_TRAIT_* masks). 
+     *  It's a constant, unless FPM_SENSOR_FAMILIES holds families that differ on that trait. */
+    inline bool hasTrait(uint8_t traitFamilies)
+    {
+        return ((FPM_SENSOR_FAMILIES & ~traitFamilies) == 0) ? true :
+               ((FPM_SENSOR_FAMILIES & traitFamilies) == 0) ? false :
+               (familyBit & traitFamilies) != 0;
+    }
+    
+    /* 1 if template IDs in the index table are off by one, else 0 */
+    inline uint16_t indexOffset(void) { return hasTrait(FPM_TRAIT_INDEX_OFFSET) ? 1 : 0; }
+    
     static const uint16_t packetLengths[];
         
     private:
     uint8_t buffer[FPM_BUFFER_SZ];
+    
+    /* outgoing packets are assembled here, behind a pre-filled start code and address */
+    uint8_t txBuffer[FPM_TX_BUFFER_SZ];
+    
     Stream * port;
+    FPMSensorFamily family;
+    uint8_t familyBit;
     uint32_t password;
     uint32_t address;
     
     FPMSystemParams sysParams;
     bool useFixedParams;
+    bool useCachedParams;
+    
+    FPMBaudHandler baudHandler;
+    void * baudHandlerCtx;
+    uint16_t readTimeout;
+    /* true while begin() waits for the sensor to answer, when timeouts are expected */
+    bool probing;
+    uint16_t templateSize;
+    
+    /* packet reader state, kept across calls so that poll() can resume a read where it left off */
+    FPMState rxState;
+    uint8_t rxPktId;
+    uint16_t rxHeader;
+    uint16_t rxPacketLen;
+    uint16_t rxRemaining;
+    uint16_t rxChksum;
+    uint16_t rxMaxLen;
+    uint8_t * rxDestBuffer;
+    Stream * rxDestStream;
+    uint8_t * rxStaging;
+    uint16_t rxStagingLen;
+    uint32_t rxLastRead;
+    
+    /* when reading into a sink: where the next chunk may go, and where the last one went */
+    bool rxChunked;
+    uint8_t * rxWindow;
+    uint16_t rxWindowLen;
+    uint8_t * rxChunk;
+    uint16_t rxChunkLen;
+    
+    /* DATA packet being written from a source, see beginDataPacket() */
+    uint16_t txSum;
+    uint16_t txLen;
+    bool txStaged;
+    
+    /* payload length of the last ACK read by poll(), excluding the confirmation code */
+    uint16_t ackLen;
+    
+    /* ID of the template in each CharBuffer slot, if it's known to be an unmodified copy from the database */
+    uint16_t slotIds[FPM_TRACKED_SLOTS];
+    
+    /* the slot to be assigned the ID #slotOpId, once the command in progress succeeds */
+    uint8_t slotOpSlot;
+    uint16_t slotOpId;
+    
+    /* tries every baud rate with the port handler, until the sensor responds */
+    bool detectBaud(void);
+    
+    /* sends the password, returning the sensor's answer or a library error */
+    FPMStatus sendPassword(void);
+    
+    /* times #rounds template round trips of #len bytes, returning the number that failed */
+    uint8_t probeLink(uint8_t * probeBuffer, uint16_t len, uint8_t rounds, uint32_t * bytesPerSec);
+    
+    /* bookkeeping for the effects of each command, before it's sent and after its ACK */
+    void noteCommand(void);
+    void commandDone(FPMStatus status);
+    void setSlotId(uint8_t slot, uint16_t id);
+    void forgetSlots(uint16_t start, uint16_t count);
+    
+#if (FPM_METRICS)
+    FPMMetrics metrics;
+    
+    /* the command in progress, as an index into metrics.commands, or 0xFF if none; and when it was sent */
+    uint8_t metricsCommand;
+    uint32_t metricsStart;
+    
+    void startCommandMetrics(uint8_t command);
+    void endCommandMetrics(FPMStatus status);
+#endif
+    
+#if (FPM_INDEX_CACHE_SLOTS > 0)
+    /* occupancy of each ID in the database, 32 to a word */
+    uint32_t indexCache[(FPM_INDEX_CACHE_SLOTS + 31) / 32];
+    bool indexCacheValid;
+    
+    /* the change made to the database by the command in progress, if any, 
+     * applied to the cache once the sensor has confirmed it */
+    uint16_t indexOpStart;
+    uint16_t indexOpCount;
+    bool indexOpOccupied;
+    
+    bool loadIndexCache(void);
+    
+    /* the lowest and highest occupied IDs, if the cache is already loaded and the database isn't empty */
+    bool getOccupiedRange(uint16_t * first, uint16_t * last);
+    void updateIndexCache(uint16_t start, uint16_t count, bool occupied);
+#endif
     
     /**
      *   @brief         Send a simple packet to the sensor.
@@ -317,6 +775,36 @@ class FPM
      *   @return                    If successful, LIB_OK. Else, an error code.
      */
     FPMStatus writePacket(uint8_t * srcBuffer, Stream * srcStream, uint16_t * writeLen, uint8_t pktId);
+    
+    /* Fill in the start code and address at the head of the TX staging buffer */
+    void prepareTxHeader(void);
+    
+    /* Commands with fixed payloads, whose frames are worked out at compile-time (see fixedFrames, in fpm.cpp) */
+    enum class FPMFrame : uint8_t {
+        GETIMAGE,
+        GETIMAGE_ONLY,
+        IMAGE2TZ_1,
+        IMAGE2TZ_2,
+        REGMODEL,
+        EMPTYDATABASE,
+        TEMPLATECOUNT,
+        READSYSPARAM,
+        READPRODINFO,
+        GETRANDOM,
+        HANDSHAKE,
+        LEDON,
+        LEDOFF,
+        STANDBY,
+        COUNT
+    };
+    
+    /* Copy a precomputed command frame behind the pre-filled start code and address, and its payload
+     * to the library buffer, as if it had been filled in there. Returns the frame's length. */
+    uint8_t loadFrame(FPMFrame frame);
+    /* Send the frame last loaded, of length #frameLen, with a single write */
+    void sendFrame(uint8_t frameLen);
+    /* Load and send a frame */
+    void writeFrame(FPMFrame frame);
     /**
      *   @brief         Read a packet (ACK or DATA) and after parsing its header,
                         copy the payload into the supplied buffer or write it directly to the supplied Stream.
@@ -336,6 +824,43 @@ class FPM
      */
     FPMStatus readPacket(uint8_t * destBuffer, Stream * destStream, uint16_t * readLen, uint8_t * pktId); 
     
+    /**
+     *   @brief         Reset the packet reader, to begin reading a new packet.
+                        The arguments are the same as for readPacket(), 
+                        except #maxLen which is only checked when #destStream is NULL.
+     */
+    void startPacketRead(uint8_t * destBuffer, Stream * destStream, uint16_t maxLen);
+    
+    /**
+     *   @brief         Advance the packet reader using only the bytes currently available from the sensor.
+     *   @param[out]    readLen     If not NULL, it holds the payload length read, once the packet is complete.
+     *   @param[out]    pktId       If successful, this holds the received Packet ID
+     *   @return                    PENDING while incomplete, LIB_OK once complete. Else, an error code.
+     */
+    FPMStatus pollPacket(uint16_t * readLen, uint8_t * pktId);
+    
+    /* Reset the packet reader to read a DATA packet into a sink, a chunk at a time */
+    void startChunkedRead(void);
+    
+    /** Advance the packet reader, reading the next chunk into #window if it's not NULL, or else the staging buffer.
+     *  Returns PENDING after each chunk (with #chunk and #chunkLen set), or while waiting for one,
+     *  then OK once the packet is complete. Else, an error code. */
+    FPMStatus pollChunk(uint8_t * window, uint16_t windowLen, uint8_t ** chunk, uint16_t * chunkLen, 
+                        uint16_t * readLen, uint8_t * pktId);
+    
+    /** Write the header of a DATA packet of #writeLen bytes, and return where the payload should be placed,
+     *  #space bytes at a time, before each is passed to putDataChunk(). endDataPacket() adds the checksum. */
+    uint8_t * beginDataPacket(uint16_t writeLen, bool writeComplete, uint16_t * space);
+    void putDataChunk(uint8_t * chunk, uint16_t len);
+    void endDataPacket(void);
+    
+    /* Returns PENDING, or TIMEOUT if nothing has been received for too long */
+    FPMStatus checkReadTimeout(void);
+    
+    /* Read #len bytes already available from the sensor into #dest, 
+     * adding them to the checksum #sum in the same pass. Returns the new checksum. */
+    uint16_t readChunk(uint8_t * dest, uint16_t len, uint16_t sum);
+    
     /**
      *   @brief                         Read an ACK-packet from the sensor and return its confirmation code
      *   @param[out]    confirmCode     The ACK-packet confirmation code
@@ -352,10 +877,38 @@ class FPM
      *   @return                    If successful, LIB_OK. Else, an error code.
      */ 
     FPMStatus writeCommandGetResponse(uint16_t payloadLen);
+    FPMStatus writeCommandGetResponse(FPMFrame frame);
+    
+    /* Send a command from the pre-filled library buffer, and start reading its ACK without waiting */
+    bool beginCommand(uint16_t payloadLen);
+    bool beginCommand(FPMFrame frame);
+    
+    /* Block until poll() returns something other than PENDING */
+    FPMStatus waitResponse(void);
     
     FPMStatus setParam(FPMParameter param, uint8_t value);
     
+    /* Reads a page of the template index into buffer[1..], #readLen bytes in all */
+    FPMStatus readIndexTable(uint8_t page, uint16_t * readLen);
+    
+    /* Calls #callback with the ID of every occupied slot in the database, from #fromId onwards,
+     * until it returns false. The occupancy cache is used if possible, otherwise the sensor is queried. */
+    FPMStatus forEachTemplate(uint16_t fromId, bool (*callback)(uint16_t id, void * ctx), void * ctx);
+    
+    /* Same as forEachTemplate(), but always queries the sensor */
+    FPMStatus walkIndexTable(uint16_t fromId, bool (*callback)(uint16_t id, void * ctx), void * ctx);
+    
+    /* Restores #count records of #recordLen bytes each, from a backup container */
+    FPMStatus restoreRecords(Stream * src, uint8_t flags, uint16_t recordLen, uint16_t count, 
+                             uint16_t fromId, int16_t * lastId);
+    
     static inline bool isErrorCode(FPMStatus status);
 };
 
+inline bool FPM::isErrorCode(FPMStatus status)
+{
+    return static_cast<uint16_t>(status) > static_cast<uint16_t>(FPMStatus::LIB_OK) &&
+            static_cast<uint16_t>(status) <= static_cast<uint16_t>(FPMStatus::ERROR_END);
+}
+
 #endif
@@ -0,0 +1,561 @@
+/***************************************************
+  Backup and restore of the whole template database, for the FPM library
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm.h"
+#include "fpm_logging.h"
+
+#include <Arduino.h>
+
+/* Layout of the backup container; all integers are big-endian, as on the wire.
+ *
+ *   Header:    magic "FPMB" (4), version (1), flags (1), template size (2),
+ *              capacity (2), template count (2), CRC of the header so far (2)
+ *   Index:     ID of each template in ascending order (2 each), CRC of the index (2)
+ *   Records:   one per ID in the index -- ID (2), template data, CRC of the ID and the raw template (2)
+ *
+ * All CRCs are CRC-16/CCITT (polynomial 0x1021, initial value 0xFFFF).
+ *
+ * With FPM_BACKUP_COMPRESSED, a 0x00 byte in the template data is always followed by the
+ * length of the run of zeros it starts (1-255), and every other byte is stored as is.
+ * Templates end in a lot of zero padding, so this is enough to shrink them considerably. */
+
+#define FPM_BACKUP_VERSION          1
+#define FPM_BACKUP_HEADER_LEN       14
+
+static const uint8_t backupMagic[] = {'F', 'P', 'M', 'B'};
+
+static uint16_t crc16(uint16_t crc, uint8_t c)
+{
+    crc ^= (uint16_t)c << 8;
+
+    for (uint8_t i = 0; i < 8; i++) {
+        crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+
+    return crc;
+}
+
+/* read a single byte from #src, waiting for it if need be */
+static int readByte(Stream * src)
+{
+    uint32_t start = millis();
+
+    do {
+        int c = src->read();
+        if (c >= 0) return c;
+
+        yield();
+    } while ((uint32_t)(millis() - start) < FPM_DEFAULT_TIMEOUT);
+
+    return -1;
+}
+
+/* Takes in the raw bytes of a template as they're read from the sensor,
+ * and writes out its record to #dest, encoded as needed.
+ * With a NULL #dest, it only counts the template bytes. */
+class FPMRecordWriter : public Stream
+{
+    public:
+    FPMRecordWriter(Stream * dest, bool compress) :
+        rawLen(0), failed(false), dest(dest), compress(compress), crc(0xFFFF), zeros(0), outLen(0)
+    {
+
+    }
+
+    void begin(uint16_t id)
+    {
+        rawLen = 0;
+        zeros = 0;
+        crc = crc16(crc16(0xFFFF, id >> 8), id & 0xFF);
+
+        put(id >> 8);
+        put(id & 0xFF);
+    }
+
+    /* finishes the record with its CRC, returns false if #dest has refused any of it */
+    bool end(void)
+    {
+        flushZeros();
+
+        uint16_t sum = crc;
+        put(sum >> 8);
+        put(sum & 0xFF);
+
+        drain();
+        return !failed;
+    }
+
+    size_t write(uint8_t c)
+    {
+        return write(&c, 1);
+    }
+
+    size_t write(const uint8_t * buf, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            uint8_t c = buf[i];
+            crc = crc16(crc, c);
+
+            if (!compress)
+            {
+                put(c);
+            }
+            else if (c == 0)
+            {
+                if (++zeros == 0xFF) flushZeros();
+            }
+            else
+            {
+                flushZeros();
+                put(c);
+            }
+        }
+
+        rawLen += size;
+        return size;
+    }
+
+    using Print::write;
+
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+    int peek(void) { return -1; }
+
+    uint16_t rawLen;
+    bool failed;
+
+    private:
+    Stream * dest;
+    bool compress;
+    uint16_t crc;
+    uint8_t zeros;
+
+    /* encoded bytes are collected here, to be written out a chunk at a time */
+    uint8_t out[32];
+    uint8_t outLen;
+
+    void flushZeros(void)
+    {
+        if (zeros == 0) return;
+
+        put(0x00);
+        put(zeros);
+        zeros = 0;
+    }
+
+    void put(uint8_t c)
+    {
+        out[outLen++] = c;
+        if (outLen == sizeof(out)) drain();
+    }
+
+    void drain(void)
+    {
+        if (dest != NULL && outLen != 0 && dest->write(out, outLen) != outLen) failed = true;
+        outLen = 0;
+    }
+};
+
+/* Reads a record from #src, serving up the raw bytes of its template, so that they can be
+ * sent straight to the sensor with writePacket() */
+class FPMRecordReader : public Stream
+{
+    public:
+    FPMRecordReader(Stream * src, bool compressed) :
+        src(src), compressed(compressed), crc(0xFFFF), remaining(0), zeros(0), failed(false)
+    {
+
+    }
+
+    void begin(uint16_t id, uint16_t len)
+    {
+        crc = crc16(crc16(0xFFFF, id >> 8), id & 0xFF);
+        remaining = len;
+        zeros = 0;
+        failed = false;
+    }
+
+    /* reads the CRC at the end of the record, returns true if the record is intact */
+    bool end(void)
+    {
+        while (remaining) read();
+
+        uint16_t sum = next() << 8;
+        sum |= next();
+
+        return !failed && zeros == 0 && sum == crc;
+    }
+
+    int available(void)
+    {
+        return remaining;
+    }
+
+    int read(void)
+    {
+        if (remaining == 0) return -1;
+
+        uint8_t c = 0;
+
+        if (zeros != 0)
+        {
+            zeros--;
+        }
+        else
+        {
+            c = next();
+
+            if (c == 0 && compressed)
+            {
+                uint8_t run = next();
+
+                if (run == 0) failed = true;
+                else zeros = run - 1;
+            }
+        }
+
+        crc = crc16(crc, c);
+        remaining--;
+
+        return c;
+    }
+
+    int peek(void) { return -1; }
+    size_t write(uint8_t c) { (void)c; return 0; }
+
+    private:
+    Stream * src;
+    bool compressed;
+    uint16_t crc;
+    uint16_t remaining;
+    uint8_t zeros;
+
+    /* once anything has gone wrong, the rest of the record reads as zeros, without waiting on #src */
+    bool failed;
+
+    uint8_t next(void)
+    {
+        if (failed) return 0;
+
+        int c = readByte(src);
+        if (c < 0)
+        {
+            failed = true;
+            return 0;
+        }
+
+        return (uint8_t)c;
+    }
+};
+
+typedef struct {
+    FPM * fpm;
+    Stream * dest;
+    FPMRecordWriter * writer;
+    uint16_t count;
+    uint16_t done;
+    uint16_t crc;
+    int16_t firstId;
+    int16_t lastId;
+    FPMStatus status;
+} FPMBackupContext;
+
+/* read the template with ID #id into #dest */
+static FPMStatus downloadRecord(FPM * fpm, uint16_t id, Stream * dest)
+{
+    FPMStatus status = fpm->loadTemplate(id);
+    if (status != FPMStatus::OK) return status;
+
+    status = fpm->downloadTemplate();
+    if (status != FPMStatus::OK) return status;
+
+    bool readComplete = false;
+
+    while (!readComplete)
+    {
+        uint16_t readLen = 0;
+
+        while ((status = fpm->pollDataPacket(NULL, dest, &readLen, &readComplete)) == FPMStatus::PENDING)
+        {
+            yield();
+        }
+
+        if (status != FPMStatus::OK) return status;
+    }
+
+    return FPMStatus::OK;
+}
+
+static bool countTemplate(uint16_t id, void * ctx)
+{
+    FPMBackupContext * backup = (FPMBackupContext *)ctx;
+
+    if (backup->count == 0) backup->firstId = id;
+    backup->count++;
+
+    return true;
+}
+
+static bool indexTemplate(uint16_t id, void * ctx)
+{
+    FPMBackupContext * backup = (FPMBackupContext *)ctx;
+    uint8_t entry[2] = { (uint8_t)(id >> 8), (uint8_t)(id & 0xFF) };
+
+    if (backup->dest->write(entry, 2) != 2)
+    {
+        backup->status = FPMStatus::WRITE_ERROR;
+        return false;
+    }
+
+    backup->crc = crc16(crc16(backup->crc, entry[0]), entry[1]);
+
+    /* the index must not grow beyond the count in the header */
+    return ++backup->done < backup->count;
+}
+
+static bool backupTemplate(uint16_t id, void * ctx)
+{
+    FPMBackupContext * backup = (FPMBackupContext *)ctx;
+    const uint16_t TEMPLATE_SZ = backup->fpm->getTemplateSize();
+
+    backup->writer->begin(id);
+    backup->status = downloadRecord(backup->fpm, id, backup->writer);
+
+    if (backup->status == FPMStatus::OK && backup->writer->rawLen != TEMPLATE_SZ)
+    {
+        FPM_LOGLN_ERROR("backupDatabase: template %u has %u bytes, not %u", id, backup->writer->rawLen, TEMPLATE_SZ);
+        backup->status = FPMStatus::READ_ERROR;
+    }
+
+    if (backup->status == FPMStatus::OK && !backup->writer->end())
+    {
+        backup->status = FPMStatus::WRITE_ERROR;
+    }
+
+    if (backup->status != FPMStatus::OK) return false;
+
+    backup->lastId = id;
+    return ++backup->done < backup->count;
+}
+
+FPMStatus FPM::backupDatabase(Stream * dest, bool compress, uint16_t fromId, int16_t * lastId)
+{
+    if (dest == NULL) return FPMStatus::INVALID_PARAMS;
+    if (lastId != NULL) *lastId = -1;
+
+    FPMRecordWriter writer(dest, compress);
+    FPMBackupContext ctx = { this, dest, &writer, 0, 0, 0xFFFF, -1, -1, FPMStatus::OK };
+
+    /* first, count the templates to be backed up, since the header comes before them all */
+    FPMStatus status = forEachTemplate(fromId, countTemplate, &ctx);
+    if (status != FPMStatus::OK) return status;
+
+    /* the template size is also needed upfront, so if it's not known yet, read the first template to find out */
+    if (templateSize == 0 && ctx.count != 0)
+    {
+        FPMRecordWriter counter(NULL, false);
+
+        status = downloadRecord(this, ctx.firstId, &counter);
+        if (status != FPMStatus::OK) return status;
+
+        templateSize = counter.rawLen;
+    }
+
+    uint8_t header[FPM_BACKUP_HEADER_LEN];
+
+    memcpy(header, backupMagic, sizeof(backupMagic));
+    header[4] = FPM_BACKUP_VERSION;
+    header[5] = compress ? FPM_BACKUP_COMPRESSED : 0;
+    header[6] = templateSize >> 8;              header[7] = templateSize & 0xFF;
+    header[8] = sysParams.capacity >> 8;        header[9] = sysParams.capacity & 0xFF;
+    header[10] = ctx.count >> 8;                header[11] = ctx.count & 0xFF;
+
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i = 0; i < FPM_BACKUP_HEADER_LEN - 2; i++) {
+        crc = crc16(crc, header[i]);
+    }
+
+    header[12] = crc >> 8;                      header[13] = crc & 0xFF;
+
+    if (dest->write(header, FPM_BACKUP_HEADER_LEN) != FPM_BACKUP_HEADER_LEN) return FPMStatus::WRITE_ERROR;
+
+    if (ctx.count == 0)
+    {
+        uint8_t sum[2] = { (uint8_t)(ctx.crc >> 8), (uint8_t)(ctx.crc & 0xFF) };
+        return (dest->write(sum, 2) == 2) ? FPMStatus::OK : FPMStatus::WRITE_ERROR;
+    }
+
+    /* then the index */
+    status = forEachTemplate(fromId, indexTemplate, &ctx);
+    if (status != FPMStatus::OK) return status;
+    if (ctx.status != FPMStatus::OK) return ctx.status;
+
+    uint8_t sum[2] = { (uint8_t)(ctx.crc >> 8), (uint8_t)(ctx.crc & 0xFF) };
+    if (dest->write(sum, 2) != 2) return FPMStatus::WRITE_ERROR;
+
+    /* and finally, each template in turn */
+    const uint16_t indexed = ctx.done;
+    ctx.done = 0;
+
+    status = forEachTemplate(fromId, backupTemplate, &ctx);
+    if (lastId != NULL) *lastId = ctx.lastId;
+
+    if (status != FPMStatus::OK) return status;
+    if (ctx.status != FPMStatus::OK) return ctx.status;
+
+    /* templates have been deleted since the index was written */
+    if (ctx.done != ctx.count || indexed != ctx.count)
+    {
+        FPM_LOGLN_ERROR("backupDatabase: database changed during the backup");
+        return FPMStatus::READ_ERROR;
+    }
+
+    return FPMStatus::OK;
+}
+
+FPMStatus FPM::restoreDatabase(Stream * src, uint16_t fromId, int16_t * lastId)
+{
+    if (src == NULL) return FPMStatus::INVALID_PARAMS;
+    if (lastId != NULL) *lastId = -1;
+
+    uint8_t header[FPM_BACKUP_HEADER_LEN];
+    uint16_t crc = 0xFFFF;
+
+    for (uint8_t i = 0; i < FPM_BACKUP_HEADER_LEN; i++)
+    {
+        int c = readByte(src);
+        if (c < 0) return FPMStatus::TIMEOUT;
+
+        header[i] = c;
+        if (i < FPM_BACKUP_HEADER_LEN - 2) crc = crc16(crc, c);
+    }
+
+    if (memcmp(header, backupMagic, sizeof(backupMagic)) != 0 || header[4] != FPM_BACKUP_VERSION ||
+        crc != (((uint16_t)header[12] << 8) | header[13]))
+    {
+        FPM_LOGLN_ERROR("restoreDatabase: invalid header");
+        return FPMStatus::READ_ERROR;
+    }
+
+    const uint8_t flags = header[5];
+    const uint16_t recordLen = ((uint16_t)header[6] << 8) | header[7];
+    const uint16_t count = ((uint16_t)header[10] << 8) | header[11];
+
+    if (templateSize != 0 && count != 0 && recordLen != templateSize)
+    {
+        FPM_LOGLN_ERROR("restoreDatabase: templates are %u bytes, not %u", recordLen, templateSize);
+        return FPMStatus::INVALID_PARAMS;
+    }
+
+    /* the index is only checked here, the records repeat their IDs */
+    crc = 0xFFFF;
+
+    for (uint32_t i = 0; i < 2UL * count; i++)
+    {
+        int c = readByte(src);
+        if (c < 0) return FPMStatus::TIMEOUT;
+
+        crc = crc16(crc, c);
+    }
+
+    int hi = readByte(src);
+    int lo = readByte(src);
+
+    if (hi < 0 || lo < 0) return FPMStatus::TIMEOUT;
+
+    if (crc != (((uint16_t)hi << 8) | lo))
+    {
+        FPM_LOGLN_ERROR("restoreDatabase: invalid index");
+        return FPMStatus::READ_ERROR;
+    }
+
+    if (count == 0) return FPMStatus::OK;
+
+    /* send the templates at the maximum packet length, and put it back afterwards */
+    const FPMPacketLength packetLen = sysParams.packetLen;
+
+    if (!useFixedParams && packetLen != FPMPacketLength::PLEN_256)
+    {
+        setPacketLength(FPMPacketLength::PLEN_256);
+    }
+
+    FPMStatus status = restoreRecords(src, flags, recordLen, count, fromId, lastId);
+
+    if (sysParams.packetLen != packetLen)
+    {
+        setPacketLength(packetLen);
+    }
+
+    return status;
+}
+
+FPMStatus FPM::restoreRecords(Stream * src, uint8_t flags, uint16_t recordLen, uint16_t count,
+                              uint16_t fromId, int16_t * lastId)
+{
+    const uint16_t PACKET_LEN = FPM::packetLengths[static_cast<uint16_t>(sysParams.packetLen)];
+
+    FPMRecordReader reader(src, flags & FPM_BACKUP_COMPRESSED);
+    int32_t prevId = -1;
+
+    for (uint16_t n = 0; n < count; n++)
+    {
+        int hi = readByte(src);
+        int lo = readByte(src);
+
+        if (hi < 0 || lo < 0) return FPMStatus::TIMEOUT;
+
+        uint16_t id = ((uint16_t)hi << 8) | lo;
+
+        if ((int32_t)id <= prevId)
+        {
+            FPM_LOGLN_ERROR("restoreDatabase: record %u is out of order", id);
+            return FPMStatus::READ_ERROR;
+        }
+
+        prevId = id;
+        reader.begin(id, recordLen);
+
+        /* templates before #fromId are only checked */
+        const bool restoring = (id >= fromId);
+
+        if (restoring)
+        {
+            FPMStatus status = uploadTemplate();
+            if (status != FPMStatus::OK) return status;
+
+            /* the template is decoded as it's sent, straight into the TX staging buffer */
+            uint16_t written = 0;
+
+            while (written < recordLen)
+            {
+                uint16_t len = min((uint16_t)(recordLen - written), PACKET_LEN);
+                uint8_t pktId = (written + len == recordLen) ? FPM_ENDDATAPACKET : FPM_DATAPACKET;
+
+                writePacket(NULL, &reader, &len, pktId);
+                written += len;
+            }
+        }
+
+        /* only commit the template to flash once it's known to be intact */
+        if (!reader.end())
+        {
+            FPM_LOGLN_ERROR("restoreDatabase: record %u is corrupt", id);
+            return FPMStatus::READ_ERROR;
+        }
+
+        if (restoring)
+        {
+            FPMStatus status = storeTemplate(id);
+            if (status != FPMStatus::OK) return status;
+
+            if (lastId != NULL) *lastId = id;
+        }
+    }
+
+    return FPMStatus::OK;
+}
@@ -0,0 +1,242 @@
+/***************************************************
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm_group.h"
+#include "fpm_logging.h"
+
+#include <Arduino.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+    #include <freertos/FreeRTOS.h>
+    #include <freertos/task.h>
+#elif defined(FPM_GROUP_STD_THREAD)
+    #include <thread>
+#endif
+
+FPMGroup::FPMGroup(void) :
+    numSensors(0), callback(NULL), callbackCtx(NULL), waitForRelease(true)
+{
+#if (FPM_GROUP_WORKERS)
+    numWorkers = 0;
+    workersRunning = false;
+    workersAlive = 0;
+#endif
+}
+
+int8_t FPMGroup::add(FPM * fpm)
+{
+    if (fpm == NULL || numSensors == FPM_GROUP_MAX_SENSORS) return -1;
+
+    sensors[numSensors] = fpm;
+    steps[numSensors] = FPMGroupStep::IDLE;
+
+    return numSensors++;
+}
+
+uint8_t FPMGroup::size(void)
+{
+    return numSensors;
+}
+
+FPM * FPMGroup::sensor(uint8_t sensorIdx)
+{
+    return (sensorIdx < numSensors) ? sensors[sensorIdx] : NULL;
+}
+
+FPMGroupStep FPMGroup::getStep(uint8_t sensorIdx)
+{
+    return (sensorIdx < numSensors) ? steps[sensorIdx] : FPMGroupStep::IDLE;
+}
+
+void FPMGroup::startIdentify(FPMIdentifyCallback callback, void * ctx, bool waitForRelease)
+{
+    this->callback = callback;
+    this->callbackCtx = ctx;
+    this->waitForRelease = waitForRelease;
+
+    /* get every sensor capturing at once, only then wait on any of them */
+    for (uint8_t i = 0; i < numSensors; i++)
+    {
+        if (steps[i] != FPMGroupStep::IDLE) continue;
+
+        sensors[i]->beginGetImage();
+        steps[i] = FPMGroupStep::CAPTURE;
+    }
+}
+
+void FPMGroup::stop(void)
+{
+#if (FPM_GROUP_WORKERS)
+    stopWorkers();
+#endif
+
+    for (uint8_t i = 0; i < numSensors; i++)
+    {
+        /* let any command in progress finish, so that its ACK isn't mistaken for that of the next one */
+        while (sensors[i]->isBusy() && sensors[i]->poll() == FPMStatus::PENDING)
+        {
+            yield();
+        }
+
+        steps[i] = FPMGroupStep::IDLE;
+    }
+}
+
+void FPMGroup::poll(void)
+{
+    for (uint8_t i = 0; i < numSensors; i++)
+    {
+        advance(i);
+    }
+}
+
+void FPMGroup::advance(uint8_t sensorIdx)
+{
+    FPM * fpm = sensors[sensorIdx];
+    FPMGroupStep step = steps[sensorIdx];
+
+    if (step == FPMGroupStep::IDLE) return;
+
+    FPMStatus status = fpm->poll();
+    if (status == FPMStatus::PENDING) return;
+
+    switch (step)
+    {
+        case FPMGroupStep::CAPTURE:
+            if (status == FPMStatus::OK)
+            {
+                fpm->beginImage2Tz(1);
+                step = FPMGroupStep::EXTRACT;
+                break;
+            }
+
+            /* no finger yet, so just try again */
+            if (status != FPMStatus::NOFINGER) report(sensorIdx, status);
+
+            fpm->beginGetImage();
+            break;
+
+        case FPMGroupStep::EXTRACT:
+            if (status == FPMStatus::OK)
+            {
+                fpm->beginSearch(1);
+                step = FPMGroupStep::SEARCH;
+                break;
+            }
+
+            report(sensorIdx, status);
+
+            fpm->beginGetImage();
+            step = waitForRelease ? FPMGroupStep::RELEASE : FPMGroupStep::CAPTURE;
+            break;
+
+        case FPMGroupStep::SEARCH:
+        {
+            uint16_t fingerId = 0, score = 0;
+
+            if (status == FPMStatus::OK) status = fpm->getSearchResult(&fingerId, &score);
+            report(sensorIdx, status, fingerId, score);
+
+            fpm->beginGetImage();
+            step = waitForRelease ? FPMGroupStep::RELEASE : FPMGroupStep::CAPTURE;
+            break;
+        }
+
+        case FPMGroupStep::RELEASE:
+            /* keep capturing until the finger is gone */
+            if (status == FPMStatus::NOFINGER) step = FPMGroupStep::CAPTURE;
+
+            fpm->beginGetImage();
+            break;
+
+        default:
+            break;
+    }
+
+    steps[sensorIdx] = step;
+}
+
+void FPMGroup::report(uint8_t sensorIdx, FPMStatus status, uint16_t fingerId, uint16_t score)
+{
+    FPM_LOGLN_VERBOSE("FPMGroup: sensor %u, status 0x%X", sensorIdx, static_cast<uint16_t>(status));
+
+    if (callback != NULL) callback(sensorIdx, status, fingerId, score, callbackCtx);
+}
+
+#if (FPM_GROUP_WORKERS)
+
+#if defined(ARDUINO_ARCH_ESP32)
+
+static void workerTask(void * arg)
+{
+    FPMGroupWorkerArgs * args = (FPMGroupWorkerArgs *)arg;
+    args->group->runWorker(args->workerIdx);
+
+    vTaskDelete(NULL);
+}
+
+#endif
+
+bool FPMGroup::startWorkers(uint8_t numWorkers)
+{
+    if (workersRunning || numWorkers == 0 || numWorkers > FPM_GROUP_MAX_SENSORS) return false;
+
+    this->numWorkers = numWorkers;
+    workersRunning = true;
+
+    for (uint8_t w = 0; w < numWorkers; w++)
+    {
+        workerArgs[w].group = this;
+        workerArgs[w].workerIdx = w;
+        workersAlive++;
+
+#if defined(ARDUINO_ARCH_ESP32)
+        if (xTaskCreatePinnedToCore(workerTask, "fpm_group", 4096, &workerArgs[w], 1, NULL,
+                                    w % portNUM_PROCESSORS) != pdPASS)
+        {
+            FPM_LOGLN_ERROR("FPMGroup: failed to start worker %u", w);
+            workersAlive--;
+            stopWorkers();
+            return false;
+        }
+#else
+        std::thread(&FPMGroup::runWorker, this, w).detach();
+#endif
+    }
+
+    return true;
+}
+
+void FPMGroup::stopWorkers(void)
+{
+    workersRunning = false;
+
+    while (workersAlive != 0)
+    {
+        delay(1);
+    }
+}
+
+void FPMGroup::runWorker(uint8_t workerIdx)
+{
+    while (workersRunning)
+    {
+        for (uint8_t i = workerIdx; i < numSensors; i += numWorkers)
+        {
+            advance(i);
+        }
+
+        /* give up the CPU for a bit, the sensors are far slower than this loop anyway */
+#if defined(ARDUINO_ARCH_ESP32)
+        vTaskDelay(1);
+#else
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+#endif
+    }
+
+    workersAlive--;
+}
+
+#endif
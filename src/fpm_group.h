@@ -0,0 +1,111 @@
+/***************************************************
+  Manager for several fingerprint sensors at once, each on its own port,
+  built on the non-blocking API of the FPM library
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_GROUP_H_
+#define FPM_GROUP_H_
+
+#include "fpm.h"
+
+#if defined(ARDUINO_ARCH_ESP32) || defined(FPM_GROUP_STD_THREAD)
+    #include <atomic>
+#endif
+
+/* Max number of sensors in a group */
+#ifndef FPM_GROUP_MAX_SENSORS
+    #define FPM_GROUP_MAX_SENSORS       4
+#endif
+
+/* Sensors can be spread across worker threads: FreeRTOS tasks on the ESP32,
+ * or std::thread on a PC, if FPM_GROUP_STD_THREAD is defined */
+#if defined(ARDUINO_ARCH_ESP32) || defined(FPM_GROUP_STD_THREAD)
+    #define FPM_GROUP_WORKERS           1
+#else
+    #define FPM_GROUP_WORKERS           0
+#endif
+
+/* what each sensor is up to */
+enum class FPMGroupStep : uint8_t {
+    IDLE,
+    CAPTURE,
+    EXTRACT,
+    SEARCH,
+    RELEASE
+};
+
+/** Called with the outcome of every identification attempt on sensor #sensorIdx: either FPMStatus::OK,
+ *  with the ID and score of the match, FPMStatus::NOTFOUND, or whichever error occurred along the way.
+ *  With worker threads, it is called from those threads, possibly from more than one at a time. */
+typedef void (*FPMIdentifyCallback)(uint8_t sensorIdx, FPMStatus status, uint16_t fingerId, uint16_t score, void * ctx);
+
+#if (FPM_GROUP_WORKERS)
+class FPMGroup;
+
+/* what each worker thread is started with; one per worker, held by its group */
+typedef struct {
+    FPMGroup * group;
+    uint8_t workerIdx;
+} FPMGroupWorkerArgs;
+#endif
+
+class FPMGroup
+{
+    public:
+    FPMGroup(void);
+
+    /** Adds a sensor to the group, returning its index, or -1 if the group is full.
+     *  The sensor should have been started with begin() already, with its own address and password. */
+    int8_t add(FPM * fpm);
+
+    uint8_t size(void);
+    FPM * sensor(uint8_t sensorIdx);
+
+    /** Starts identifying fingers on every sensor in the group, over and over: each one captures an image,
+     *  extracts its features into buffer 1 and searches its database, independently of the others.
+     *  With #waitForRelease, each sensor waits for the finger to be lifted before capturing again. */
+    void startIdentify(FPMIdentifyCallback callback, void * ctx = NULL, bool waitForRelease = true);
+
+    /* Stops all sensors, once any commands still in progress have completed */
+    void stop(void);
+
+    /** Advances every sensor by whatever it has sent so far, without waiting on any of them.
+     *  Call this as often as possible, e.g. from loop(), unless worker threads are running. */
+    void poll(void);
+
+    FPMGroupStep getStep(uint8_t sensorIdx);
+
+#if (FPM_GROUP_WORKERS)
+    /** Hands the sensors over to #numWorkers threads, sensor N going to thread (N % #numWorkers).
+     *  On the ESP32, each thread is pinned to core (N % cores). poll() must not be called while they run. */
+    bool startWorkers(uint8_t numWorkers = 2);
+    void stopWorkers(void);
+
+    /* not for public use, the entry point of each worker thread */
+    void runWorker(uint8_t workerIdx);
+#endif
+
+    private:
+    FPM * sensors[FPM_GROUP_MAX_SENSORS];
+    volatile FPMGroupStep steps[FPM_GROUP_MAX_SENSORS];
+    uint8_t numSensors;
+
+    FPMIdentifyCallback callback;
+    void * callbackCtx;
+    bool waitForRelease;
+
+#if (FPM_GROUP_WORKERS)
+    uint8_t numWorkers;
+    std::atomic<bool> workersRunning;
+    std::atomic<uint8_t> workersAlive;
+    FPMGroupWorkerArgs workerArgs[FPM_GROUP_MAX_SENSORS];
+#endif
+
+    void advance(uint8_t sensorIdx);
+    void report(uint8_t sensorIdx, FPMStatus status, uint16_t fingerId = 0, uint16_t score = 0);
+};
+
+#endif
@@ -0,0 +1,233 @@
+/***************************************************
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm_hotset.h"
+#include "fpm_logging.h"
+
+#include <Arduino.h>
+
+static_assert(FPM_HOTSET_AGING_PERIOD >= 1 && FPM_HOTSET_AGING_PERIOD <= 0xFFFF, "the aging period must fit the match counter");
+
+FPMHotSet::FPMHotSet(FPM * fpm, uint8_t blockSize) :
+    fpm(fpm), blockSize(min(blockSize, (uint8_t)FPM_HOTSET_MAX_BLOCK)), capacity(0), matchesSinceAging(0)
+{
+    for (uint8_t i = 0; i < FPM_HOTSET_MAX_BLOCK; i++) {
+        blockIds[i] = FPM_HOTSET_EMPTY;
+    }
+
+    for (uint8_t i = 0; i < FPM_HOTSET_TRACKED; i++) {
+        entries[i].id = FPM_HOTSET_EMPTY;
+        entries[i].hits = 0;
+    }
+}
+
+FPMStatus FPMHotSet::begin(bool reserve)
+{
+    FPMSystemParams params;
+
+    FPMStatus status = fpm->readParams(&params);
+    if (status != FPMStatus::OK) return status;
+
+    capacity = params.capacity;
+    if (blockSize >= capacity) return FPMStatus::INVALID_PARAMS;
+
+    /* anything already in the way is most likely a real user, not an old copy */
+    for (uint8_t i = 0; i < blockSize && !reserve; i++)
+    {
+        int16_t freeId;
+
+        status = fpm->getFreeId(&freeId, i);
+        if (status != FPMStatus::OK) return status;
+
+        if (freeId != i) {
+            FPM_LOGLN_ERROR("FPMHotSet: ID %u is taken, the hot block must be empty", i);
+            return FPMStatus::INVALID_PARAMS;
+        }
+    }
+
+    for (uint8_t i = 0; i < blockSize; i++) {
+        blockIds[i] = FPM_HOTSET_EMPTY;
+    }
+
+    return fpm->deleteTemplate(0, blockSize);
+}
+
+uint16_t FPMHotSet::firstUserId(void)
+{
+    return blockSize;
+}
+
+FPMStatus FPMHotSet::identify(uint16_t * fingerId, uint16_t * score, uint8_t slot)
+{
+    bool hotBlockUsed = false;
+
+    for (uint8_t i = 0; i < blockSize && !hotBlockUsed; i++) {
+        hotBlockUsed = (blockIds[i] != FPM_HOTSET_EMPTY);
+    }
+
+    /* the hot block first, it's a fraction of the size of the rest */
+    FPMStatus status = FPMStatus::NOTFOUND;
+
+    if (hotBlockUsed)
+    {
+        status = fpm->searchDatabase(fingerId, score, slot, 0, blockSize, FPMSearchMode::AUTO);
+    }
+
+    if (status == FPMStatus::OK && *fingerId < blockSize && blockIds[*fingerId] != FPM_HOTSET_EMPTY)
+    {
+        *fingerId = blockIds[*fingerId];
+        recordMatch(*fingerId);
+        return status;
+    }
+
+    if (status != FPMStatus::OK && status != FPMStatus::NOTFOUND) return status;
+
+    status = fpm->searchDatabase(fingerId, score, slot, blockSize, capacity - blockSize, FPMSearchMode::AUTO);
+
+    if (status == FPMStatus::OK) recordMatch(*fingerId);
+    return status;
+}
+
+void FPMHotSet::recordMatch(uint16_t fingerId)
+{
+    int8_t entry = -1;
+
+    for (uint8_t i = 0; i < FPM_HOTSET_TRACKED && entry == -1; i++)
+    {
+        if (entries[i].id == fingerId) entry = i;
+    }
+
+    /* not tracked yet, so take an empty entry, or else the coldest one that isn't in the hot block */
+    if (entry == -1)
+    {
+        for (uint8_t i = 0; i < FPM_HOTSET_TRACKED; i++)
+        {
+            if (entries[i].id == FPM_HOTSET_EMPTY)
+            {
+                entry = i;
+                break;
+            }
+
+            if (blockSlotOf(entries[i].id) != -1) continue;
+            if (entry == -1 || entries[i].hits < entries[entry].hits) entry = i;
+        }
+
+        if (entry == -1) return;
+
+        entries[entry].id = fingerId;
+        entries[entry].hits = 0;
+    }
+
+    if (entries[entry].hits < 0xFFFF) entries[entry].hits++;
+
+    /* age every count now and then, so that a burst of matches long ago doesn't keep an ID hot forever */
+    if (++matchesSinceAging == FPM_HOTSET_AGING_PERIOD)
+    {
+        matchesSinceAging = 0;
+
+        for (uint8_t i = 0; i < FPM_HOTSET_TRACKED; i++) {
+            entries[i].hits >>= 1;
+        }
+    }
+}
+
+uint16_t FPMHotSet::hitsOf(uint16_t fingerId)
+{
+    for (uint8_t i = 0; i < FPM_HOTSET_TRACKED; i++)
+    {
+        if (entries[i].id == fingerId) return entries[i].hits;
+    }
+
+    return 0;
+}
+
+int8_t FPMHotSet::blockSlotOf(uint16_t fingerId)
+{
+    if (fingerId == FPM_HOTSET_EMPTY) return -1;
+
+    for (uint8_t i = 0; i < blockSize; i++)
+    {
+        if (blockIds[i] == fingerId) return i;
+    }
+
+    return -1;
+}
+
+FPMStatus FPMHotSet::maintain(void)
+{
+    /* the hottest ID outside the block */
+    int8_t hottest = -1;
+
+    for (uint8_t i = 0; i < FPM_HOTSET_TRACKED; i++)
+    {
+        if (entries[i].id == FPM_HOTSET_EMPTY || entries[i].hits == 0 || blockSlotOf(entries[i].id) != -1) continue;
+        if (hottest == -1 || entries[i].hits > entries[hottest].hits) hottest = i;
+    }
+
+    if (hottest == -1) return FPMStatus::OK;
+
+    /* and the coldest slot in the block, preferably an empty one */
+    int8_t target = -1;
+    uint16_t targetHits = 0;
+
+    for (uint8_t i = 0; i < blockSize; i++)
+    {
+        uint16_t hits = (blockIds[i] == FPM_HOTSET_EMPTY) ? 0 : hitsOf(blockIds[i]);
+
+        if (target == -1 || hits < targetHits || (hits == targetHits && blockIds[i] == FPM_HOTSET_EMPTY))
+        {
+            target = i;
+            targetHits = hits;
+        }
+    }
+
+    /* only displace a copy for an ID that's clearly hotter, to avoid swapping the two back and forth */
+    if (blockIds[target] != FPM_HOTSET_EMPTY && entries[hottest].hits <= targetHits + 1) return FPMStatus::OK;
+
+    const uint16_t fingerId = entries[hottest].id;
+
+    /* until the copy is in place, the slot can't be trusted */
+    blockIds[target] = FPM_HOTSET_EMPTY;
+
+    FPMStatus status = fpm->loadTemplate(fingerId, 2);
+    if (status != FPMStatus::OK) return status;
+
+    status = fpm->storeTemplate(target, 2);
+    if (status != FPMStatus::OK) return status;
+
+    FPM_LOGLN_VERBOSE("FPMHotSet: ID %u copied to slot %u", fingerId, target);
+
+    blockIds[target] = fingerId;
+    return FPMStatus::OK;
+}
+
+FPMStatus FPMHotSet::forget(uint16_t fingerId)
+{
+    for (uint8_t i = 0; i < FPM_HOTSET_TRACKED; i++)
+    {
+        if (entries[i].id == fingerId)
+        {
+            entries[i].id = FPM_HOTSET_EMPTY;
+            entries[i].hits = 0;
+        }
+    }
+
+    int8_t blockSlot = blockSlotOf(fingerId);
+    if (blockSlot == -1) return FPMStatus::OK;
+
+    blockIds[blockSlot] = FPM_HOTSET_EMPTY;
+    return fpm->deleteTemplate(blockSlot);
+}
+
+FPMStatus FPMHotSet::storeTemplate(uint16_t fingerId, uint8_t slot)
+{
+    if (fingerId < blockSize) return FPMStatus::INVALID_PARAMS;
+
+    /* the copy would still match the old template */
+    FPMStatus status = forget(fingerId);
+    if (status != FPMStatus::OK) return status;
+
+    return fpm->storeTemplate(fingerId, slot);
+}
@@ -0,0 +1,84 @@
+/***************************************************
+  Hot-set search for the FPM library: the templates matched most often (and most recently)
+  are copied into a small block of IDs at the start of the database, which is searched first.
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_HOTSET_H_
+#define FPM_HOTSET_H_
+
+#include "fpm.h"
+
+/* Max number of IDs in the hot block */
+#ifndef FPM_HOTSET_MAX_BLOCK
+    #define FPM_HOTSET_MAX_BLOCK        16
+#endif
+
+/* Number of IDs whose match counts are tracked, in or out of the hot block */
+#ifndef FPM_HOTSET_TRACKED
+    #define FPM_HOTSET_TRACKED          (2 * FPM_HOTSET_MAX_BLOCK)
+#endif
+
+/* All match counts are halved after this many matches (1 to 65535), so that recent matches count for more */
+#ifndef FPM_HOTSET_AGING_PERIOD
+    #define FPM_HOTSET_AGING_PERIOD     64
+#endif
+
+#define FPM_HOTSET_EMPTY                0xFFFF
+
+/* The hot block takes up IDs [0, blockSize), so templates should only be enrolled from blockSize onwards,
+ * and through storeTemplate() below, so that no stale copy of an earlier template is left in the block.
+ * Copies are made between identifications, by maintain(), and the map from each copy to its original ID
+ * is only kept in RAM, so begin() clears the block. */
+class FPMHotSet
+{
+    public:
+    FPMHotSet(FPM * fpm, uint8_t blockSize = FPM_HOTSET_MAX_BLOCK);
+
+    /** Clears the hot block; call it after the sensor's begin().
+     *  Unless #reserve is true, it fails with FPMStatus::INVALID_PARAMS if there are already templates in that range,
+     *  rather than delete them. Pass true once the range is known to belong to the hot set, e.g. on every boot after the first. */
+    FPMStatus begin(bool reserve = false);
+
+    /** Searches the hot block for the features in buffer #slot, then the rest of the database if there's no match.
+     *  #fingerId is always the original ID of the template, never that of its copy. */
+    FPMStatus identify(uint16_t * fingerId, uint16_t * score, uint8_t slot = 1);
+
+    /** Copies at most one template into the hot block, if any has become hotter than one already there.
+     *  Call it whenever the sensor is otherwise idle. Uses buffer 2. */
+    FPMStatus maintain(void);
+
+    /* Drops the hot copy of #fingerId, if any. Call this whenever the original is deleted. */
+    FPMStatus forget(uint16_t fingerId);
+
+    /** Stores the features in buffer #slot at ID #fingerId, dropping any hot copy of what was there before.
+     *  Returns FPMStatus::INVALID_PARAMS for an ID in the hot block. */
+    FPMStatus storeTemplate(uint16_t fingerId, uint8_t slot = 1);
+
+    /* the first ID outside the hot block */
+    uint16_t firstUserId(void);
+
+    private:
+    typedef struct {
+        uint16_t id;
+        uint16_t hits;
+    } FPMHotSetEntry;
+
+    FPM * fpm;
+    uint8_t blockSize;
+    uint16_t capacity;
+
+    /* original ID of the copy in each slot of the hot block */
+    uint16_t blockIds[FPM_HOTSET_MAX_BLOCK];
+
+    FPMHotSetEntry entries[FPM_HOTSET_TRACKED];
+    uint16_t matchesSinceAging;
+
+    void recordMatch(uint16_t fingerId);
+    uint16_t hitsOf(uint16_t fingerId);
+    int8_t blockSlotOf(uint16_t fingerId);
+};
+
+#endif
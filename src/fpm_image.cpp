@@ -0,0 +1,741 @@
+/***************************************************
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm_image.h"
+#include "fpm_logging.h"
+
+#include <Arduino.h>
+
+#define FPM_BMP_HEADER_LEN          54
+#define FPM_BMP_PALETTE_LEN         (256 * 4)
+#define FPM_BMP_PIXELS_PER_METER    2835            /* 72 DPI, boiler-plate */
+
+/* 8-bit level for each 4-bit one, spread evenly from black (0x00) to white (0xFF) */
+static const uint8_t nibbleLevels[16] PROGMEM = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+    0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF
+};
+
+static void putLE(uint8_t * dest, uint32_t value, uint8_t len)
+{
+    for (uint8_t i = 0; i < len; i++, value >>= 8) {
+        dest[i] = value & 0xFF;
+    }
+}
+
+FPMImageWriter::FPMImageWriter(Print * dest, FPMImageFormat format, uint16_t width, uint16_t height) :
+    dest(dest), format(format), width(width), height(height),
+    cropX(0), cropY(0), cropWidth(width), cropHeight(height), scaleMult(1), scaleDiv(1),
+    pixelCount(0), srcX(0), srcY(0), column(0), outX(0), outXRemainder(0), bufferLen(0), status(FPMStatus::OK)
+{
+    updateGeometry();
+}
+
+FPMStatus FPMImageWriter::setCrop(uint16_t x, uint16_t y, uint16_t cropWidth, uint16_t cropHeight)
+{
+    if (cropWidth == 0 || cropHeight == 0 || (uint32_t)x + cropWidth > width || (uint32_t)y + cropHeight > height) {
+        return FPMStatus::INVALID_PARAMS;
+    }
+
+    cropX = x;
+    cropY = y;
+    this->cropWidth = cropWidth;
+    this->cropHeight = cropHeight;
+
+    /* a scale that no longer fits is dropped */
+    if (scaleMult != scaleDiv && setScale(scaleMult, scaleDiv) != FPMStatus::OK) {
+        scaleMult = scaleDiv = 1;
+    }
+
+    updateGeometry();
+    return FPMStatus::OK;
+}
+
+FPMStatus FPMImageWriter::setScale(uint8_t mult, uint8_t div)
+{
+    if (mult == 0 || mult > div || (uint16_t)div > (uint16_t)mult * FPM_IMAGE_MIN_SCALE) return FPMStatus::INVALID_PARAMS;
+
+    const uint16_t scaledWidth = (uint32_t)cropWidth * mult / div;
+    const uint16_t scaledHeight = (uint32_t)cropHeight * mult / div;
+
+    if (scaledWidth == 0 || scaledHeight == 0) return FPMStatus::INVALID_PARAMS;
+    if (mult != div && scaledWidth > FPM_IMAGE_SCALED_MAX_WIDTH) return FPMStatus::INVALID_PARAMS;
+
+    scaleMult = mult;
+    scaleDiv = div;
+
+    updateGeometry();
+    return FPMStatus::OK;
+}
+
+void FPMImageWriter::updateGeometry(void)
+{
+    outWidth = (uint32_t)cropWidth * scaleMult / scaleDiv;
+    outHeight = (uint32_t)cropHeight * scaleMult / scaleDiv;
+}
+
+uint16_t FPMImageWriter::outputWidth(void)
+{
+    return outWidth;
+}
+
+uint16_t FPMImageWriter::outputHeight(void)
+{
+    return outHeight;
+}
+
+uint16_t FPMImageWriter::coverage(uint16_t index)
+{
+    /* source pixel i goes into output pixel floor(i * mult / div), 
+     * so output pixel j covers those from ceil(j * div / mult) up to ceil((j + 1) * div / mult) */
+    uint32_t first = ((uint32_t)index * scaleDiv + scaleMult - 1) / scaleMult;
+    uint32_t next = ((uint32_t)(index + 1) * scaleDiv + scaleMult - 1) / scaleMult;
+
+    return next - first;
+}
+
+uint32_t FPMImageWriter::packedSize(void)
+{
+    return ((uint32_t)width * height + 1) / 2;
+}
+
+uint8_t FPMImageWriter::rowPadding(void)
+{
+    /* BMP rows are padded out to a multiple of 4 bytes */
+    return (format == FPMImageFormat::BMP) ? (4 - (outWidth & 3)) & 3 : 0;
+}
+
+uint16_t FPMImageWriter::headerSize(void)
+{
+    switch (format)
+    {
+        case FPMImageFormat::PGM:
+        {
+            char header[24];
+            return snprintf(header, sizeof(header), "P5\n%u %u\n255\n", outWidth, outHeight);
+        }
+
+        case FPMImageFormat::BMP:
+            return FPM_BMP_HEADER_LEN + FPM_BMP_PALETTE_LEN;
+
+        default:
+            return 0;
+    }
+}
+
+uint32_t FPMImageWriter::outputSize(void)
+{
+    return headerSize() + ((uint32_t)outWidth + rowPadding()) * outHeight;
+}
+
+FPMStatus FPMImageWriter::begin(void)
+{
+    pixelCount = 0;
+    srcX = 0;
+    srcY = 0;
+    column = 0;
+    bufferLen = 0;
+    status = FPMStatus::OK;
+
+    if (dest == NULL || outWidth == 0 || outHeight == 0) {
+        status = FPMStatus::INVALID_PARAMS;
+        return status;
+    }
+
+    if (scaleMult != scaleDiv) {
+        memset(lineSums, 0, sizeof(lineSums));
+    }
+
+    if (format == FPMImageFormat::PGM)
+    {
+        char header[24];
+        uint16_t len = snprintf(header, sizeof(header), "P5\n%u %u\n255\n", outWidth, outHeight);
+
+        if (dest->write((const uint8_t *)header, len) != len) status = FPMStatus::WRITE_ERROR;
+    }
+    else if (format == FPMImageFormat::BMP)
+    {
+        uint8_t header[FPM_BMP_HEADER_LEN];
+        const uint32_t rasterLen = outputSize() - headerSize();
+
+        memset(header, 0, sizeof(header));
+        header[0] = 'B'; header[1] = 'M';
+
+        putLE(&header[2], outputSize(), 4);
+        putLE(&header[10], headerSize(), 4);                        /* offset of the raster */
+        putLE(&header[14], 40, 4);                                  /* size of the info header */
+        putLE(&header[18], outWidth, 4);
+        putLE(&header[22], (uint32_t)(-(int32_t)outHeight), 4);     /* negative, since rows arrive top to bottom */
+        putLE(&header[26], 1, 2);                                   /* planes */
+        putLE(&header[28], 8, 2);                                   /* bits per pixel */
+        putLE(&header[34], rasterLen, 4);
+        putLE(&header[38], FPM_BMP_PIXELS_PER_METER, 4);
+        putLE(&header[42], FPM_BMP_PIXELS_PER_METER, 4);
+
+        if (dest->write(header, sizeof(header)) != sizeof(header)) status = FPMStatus::WRITE_ERROR;
+
+        /* the palette is just a scale of grays, from black to white */
+        for (uint16_t i = 0; i < 256 && status == FPMStatus::OK; i++)
+        {
+            putByte(i); putByte(i); putByte(i); putByte(0);
+        }
+
+        passOn();
+    }
+
+    return status;
+}
+
+inline void FPMImageWriter::putByte(uint8_t value)
+{
+    buffer[bufferLen++] = value;
+    if (bufferLen == FPM_IMAGE_BUFFER_SZ) passOn();
+}
+
+inline void FPMImageWriter::putPixel(uint8_t pixel)
+{
+    putByte(pixel);
+
+    if (++column == outWidth)
+    {
+        column = 0;
+
+        for (uint8_t i = rowPadding(); i != 0; i--) {
+            putByte(0);
+        }
+    }
+}
+
+void FPMImageWriter::putScaledRow(uint16_t outRow)
+{
+    const uint16_t rows = coverage(outRow);
+
+    for (uint16_t x = 0; x < outWidth; x++)
+    {
+        const uint16_t count = coverage(x) * rows;
+
+        putPixel((lineSums[x] + count / 2) / count);
+        lineSums[x] = 0;
+    }
+}
+
+inline void FPMImageWriter::putSourcePixel(uint8_t pixel)
+{
+    /* both wrap around to large values, left of or above the crop */
+    const uint16_t x = srcX - cropX;
+    const uint16_t y = srcY - cropY;
+
+    if (x < cropWidth && y < cropHeight)
+    {
+        if (scaleMult == scaleDiv) 
+        {
+            putPixel(pixel);
+        }
+        else 
+        {
+            /* outX = x * mult / div, stepped along the row without dividing */
+            if (x == 0) {
+                outX = 0;
+                outXRemainder = 0;
+            }
+
+            if (outX < outWidth) lineSums[outX] += pixel;
+
+            outXRemainder += scaleMult;
+            if (outXRemainder >= scaleDiv) {
+                outXRemainder -= scaleDiv;
+                outX++;
+            }
+        }
+    }
+
+    pixelCount++;
+    if (++srcX == width) endSourceRow();
+}
+
+void FPMImageWriter::endSourceRow(void)
+{
+    const uint16_t y = srcY - cropY;
+
+    /* pass on the scaled row, once the last source row it covers is done */
+    if (scaleMult != scaleDiv && y < cropHeight)
+    {
+        const uint16_t outY = (uint32_t)y * scaleMult / scaleDiv;
+
+        if (outY < outHeight && (uint32_t)(y + 1) * scaleMult / scaleDiv != outY) {
+            putScaledRow(outY);
+        }
+    }
+
+    srcX = 0;
+    srcY++;
+}
+
+void FPMImageWriter::passOn(void)
+{
+    if (bufferLen == 0) return;
+
+    if (status == FPMStatus::OK && dest->write(buffer, bufferLen) != bufferLen)
+    {
+        FPM_LOGLN_ERROR("FPMImageWriter: destination stopped accepting bytes");
+        status = FPMStatus::WRITE_ERROR;
+    }
+
+    bufferLen = 0;
+}
+
+size_t FPMImageWriter::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t FPMImageWriter::write(const uint8_t * packed, size_t size)
+{
+    if (status != FPMStatus::OK) return 0;
+
+    const uint32_t totalPixels = (uint32_t)width * height;
+    size_t i = 0;
+
+    while (i < size && pixelCount < totalPixels)
+    {
+        const bool inRows = (uint16_t)(srcY - cropY) < cropHeight;
+        const uint16_t cropEnd = cropX + cropWidth;
+
+        /* whole bytes are only handled at once from an even column, and never across a row */
+        if ((srcX & 1) == 0 && (srcX + 1) < width)
+        {
+            uint32_t span = 0;
+
+            if (!inRows || srcX >= cropEnd || srcX + 1 < cropX)
+            {
+                /* nothing to keep up to the crop, or the end of the row */
+                const uint16_t next = (inRows && srcX < cropX) ? cropX : width;
+                span = min((uint32_t)(next - srcX) / 2, (uint32_t)(size - i));
+
+                srcX += 2 * span;
+            }
+            else if (scaleMult == scaleDiv && srcX >= cropX)
+            {
+                /* as many whole bytes as fit in both the rest of the crop's row and the working buffer */
+                span = min((uint32_t)(cropEnd - srcX), (uint32_t)(FPM_IMAGE_BUFFER_SZ - bufferLen)) / 2;
+                span = min(span, (uint32_t)(size - i));
+
+                uint8_t * out = &buffer[bufferLen];
+
+                /* the upper nibble is the left pixel */
+                for (uint16_t k = 0; k < span; k++, out += 2) 
+                {
+                    uint8_t b = packed[i + k];
+                    out[0] = pgm_read_byte(&nibbleLevels[b >> 4]);
+                    out[1] = pgm_read_byte(&nibbleLevels[b & 0x0F]);
+                }
+
+                bufferLen += 2 * span;
+                column += 2 * span;
+                srcX += 2 * span;
+
+                if (bufferLen == FPM_IMAGE_BUFFER_SZ) passOn();
+
+                if (column == outWidth) 
+                {
+                    column = 0;
+
+                    for (uint8_t p = rowPadding(); p != 0; p--) {
+                        putByte(0);
+                    }
+                }
+            }
+
+            if (span != 0)
+            {
+                i += span;
+                pixelCount += 2 * span;
+
+                if (srcX == width) endSourceRow();
+
+                continue;
+            }
+        }
+
+        /* one pixel at a time: a byte straddling 2 rows (with an odd width), the edges of the crop,
+         * the end of the buffer, or anything to be scaled */
+        putSourcePixel(pgm_read_byte(&nibbleLevels[packed[i] >> 4]));
+
+        if (pixelCount < totalPixels) {
+            putSourcePixel(pgm_read_byte(&nibbleLevels[packed[i] & 0x0F]));
+        }
+
+        i++;
+    }
+
+    /* anything past the end of the image is dropped */
+    return (status == FPMStatus::OK) ? size : 0;
+}
+
+FPMStatus FPMImageWriter::end(void)
+{
+    passOn();
+
+    if (status == FPMStatus::OK && pixelCount < (uint32_t)width * height)
+    {
+        FPM_LOGLN_ERROR("FPMImageWriter: image incomplete, %lu pixels", (unsigned long)pixelCount);
+        status = FPMStatus::READ_ERROR;
+    }
+
+    return status;
+}
+
+#define FPM_IMAGE_QUALITY_BLOCK_MASK    (FPM_IMAGE_QUALITY_BLOCK - 1)
+
+FPMImageQuality::FPMImageQuality(Print * next, uint16_t width, uint16_t height) :
+    next(next), width(width), height(height),
+    pixelCount(0), column(0), row(0), coveredCount(0), coveredPixels(0), contrastSum(0), sumX(0), sumY(0),
+    status(FPMStatus::OK)
+{
+    limits.minCoverage = FPM_IMAGE_QUALITY_MIN_COVERAGE;
+    limits.minContrast = FPM_IMAGE_QUALITY_MIN_CONTRAST;
+    limits.maxOffset = FPM_IMAGE_QUALITY_MAX_OFFSET;
+
+    memset(&report, 0, sizeof(report));
+}
+
+void FPMImageQuality::setLimits(const FPMImageQualityLimits * limits)
+{
+    this->limits = *limits;
+}
+
+FPMStatus FPMImageQuality::begin(void)
+{
+    pixelCount = 0;
+    column = 0;
+    row = 0;
+    coveredCount = 0;
+    coveredPixels = 0;
+    contrastSum = 0;
+    sumX = 0;
+    sumY = 0;
+    status = FPMStatus::OK;
+
+    memset(&report, 0, sizeof(report));
+    resetBlocks();
+
+    if (width == 0 || height == 0 || width > FPM_IMAGE_MAX_WIDTH) {
+        status = FPMStatus::INVALID_PARAMS;
+    }
+
+    return status;
+}
+
+void FPMImageQuality::resetBlocks(void)
+{
+    memset(darkCounts, 0, sizeof(darkCounts));
+    memset(minLevels, 0x0F, sizeof(minLevels));
+    memset(maxLevels, 0, sizeof(maxLevels));
+}
+
+inline void FPMImageQuality::putPixel(uint8_t level)
+{
+    const uint8_t block = column / FPM_IMAGE_QUALITY_BLOCK;
+
+    if (level < FPM_IMAGE_QUALITY_BACKGROUND) darkCounts[block]++;
+    if (level < minLevels[block]) minLevels[block] = level;
+    if (level > maxLevels[block]) maxLevels[block] = level;
+
+    pixelCount++;
+
+    if (++column == width)
+    {
+        column = 0;
+        row++;
+
+        if ((row & FPM_IMAGE_QUALITY_BLOCK_MASK) == 0 || row == height) endBlockRow();
+    }
+}
+
+void FPMImageQuality::endBlockRow(void)
+{
+    /* the last row and column of blocks may be cut short by the edges of the image */
+    const uint16_t top = (row - 1) & ~FPM_IMAGE_QUALITY_BLOCK_MASK;
+    const uint8_t rows = row - top;
+
+    for (uint16_t left = 0; left < width; left += FPM_IMAGE_QUALITY_BLOCK)
+    {
+        const uint8_t block = left / FPM_IMAGE_QUALITY_BLOCK;
+        const uint8_t columns = min((uint16_t)(width - left), (uint16_t)FPM_IMAGE_QUALITY_BLOCK);
+        const uint16_t area = (uint16_t)rows * columns;
+
+        if ((uint32_t)darkCounts[block] * 8 >= area)
+        {
+            /* the centre of the block, doubled to keep it whole, and weighted by its area */
+            coveredCount++;
+            coveredPixels += area;
+            contrastSum += maxLevels[block] - minLevels[block];
+            sumX += (uint32_t)area * (2 * left + columns - 1);
+            sumY += (uint32_t)area * (2 * top + rows - 1);
+        }
+    }
+
+    resetBlocks();
+}
+
+size_t FPMImageQuality::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t FPMImageQuality::write(const uint8_t * packed, size_t size)
+{
+    if (next != NULL) next->write(packed, size);
+
+    if (status != FPMStatus::OK) return size;
+
+    const uint32_t totalPixels = (uint32_t)width * height;
+
+    for (size_t i = 0; i < size && pixelCount < totalPixels; i++)
+    {
+        /* the upper nibble is the left pixel */
+        putPixel(packed[i] >> 4);
+
+        if (pixelCount < totalPixels) {
+            putPixel(packed[i] & 0x0F);
+        }
+    }
+
+    return size;
+}
+
+FPMStatus FPMImageQuality::end(void)
+{
+    memset(&report, 0, sizeof(report));
+
+    if (status != FPMStatus::OK) return status;
+
+    if (pixelCount < (uint32_t)width * height)
+    {
+        FPM_LOGLN_ERROR("FPMImageQuality: image incomplete, %lu pixels", (unsigned long)pixelCount);
+        status = FPMStatus::READ_ERROR;
+        return status;
+    }
+
+    report.coverage = coveredPixels * 100 / pixelCount;
+
+    if (coveredCount != 0)
+    {
+        const int32_t doubledX = sumX / coveredPixels;
+        const int32_t doubledY = sumY / coveredPixels;
+
+        report.contrast = (contrastSum + coveredCount / 2) / coveredCount;
+        report.centroidX = doubledX / 2;
+        report.centroidY = doubledY / 2;
+        report.offsetX = (doubledX - (width - 1)) * 50 / (int32_t)width;
+        report.offsetY = (doubledY - (height - 1)) * 50 / (int32_t)height;
+    }
+
+    report.acceptable = report.coverage >= limits.minCoverage && report.contrast >= limits.minContrast &&
+                        abs(report.offsetX) <= limits.maxOffset && abs(report.offsetY) <= limits.maxOffset;
+
+    FPM_LOGLN_VERBOSE("FPMImageQuality: coverage %u%%, contrast %u, offset %d%%/%d%%", report.coverage, report.contrast, 
+                    report.offsetX, report.offsetY);
+
+    return status;
+}
+
+void FPMImageQuality::getReport(FPMImageQualityReport * report)
+{
+    *report = this->report;
+}
+
+bool FPMImageQuality::acceptable(void)
+{
+    return report.acceptable;
+}
+
+/* The running mean of the errors is reset this often, so that it follows the image */
+#define FPM_IMAGEZ_ERROR_WINDOW     32
+
+FPMImageCompressor::FPMImageCompressor(Print * dest, uint16_t width, uint16_t height) :
+    dest(dest), width(width), height(height),
+    pixelCount(0), column(0), left(0), upperLeft(0), runLength(0), errorSum(0), errorCount(0),
+    bits(0), bitCount(0), bufferLen(0), totalWritten(0), status(FPMStatus::OK)
+{
+
+}
+
+uint32_t FPMImageCompressor::compressedSize(void)
+{
+    return totalWritten + bufferLen;
+}
+
+FPMStatus FPMImageCompressor::begin(void)
+{
+    pixelCount = 0;
+    column = 0;
+    runLength = 0;
+    errorSum = 4;
+    errorCount = 1;
+    bits = 0;
+    bitCount = 0;
+    bufferLen = 0;
+    totalWritten = 0;
+    status = FPMStatus::OK;
+
+    if (dest == NULL || width == 0 || height == 0 || width > FPM_IMAGE_MAX_WIDTH) {
+        status = FPMStatus::INVALID_PARAMS;
+        return status;
+    }
+
+    uint8_t header[FPM_IMAGEZ_HEADER_LEN];
+
+    memcpy(header, FPM_IMAGEZ_MAGIC, 4);
+    header[4] = FPM_IMAGEZ_VERSION;
+    putLE(&header[5], width, 2);
+    putLE(&header[7], height, 2);
+
+    if (dest->write(header, sizeof(header)) != sizeof(header)) status = FPMStatus::WRITE_ERROR;
+    else totalWritten = sizeof(header);
+
+    return status;
+}
+
+void FPMImageCompressor::passOn(void)
+{
+    if (bufferLen == 0) return;
+
+    if (status == FPMStatus::OK && dest->write(buffer, bufferLen) != bufferLen)
+    {
+        FPM_LOGLN_ERROR("FPMImageCompressor: destination stopped accepting bytes");
+        status = FPMStatus::WRITE_ERROR;
+    }
+
+    totalWritten += bufferLen;
+    bufferLen = 0;
+}
+
+/* most significant bit first; #count must be no more than 24 */
+void FPMImageCompressor::putBits(uint32_t value, uint8_t count)
+{
+    bits = (bits << count) | value;
+    bitCount += count;
+
+    while (bitCount >= 8)
+    {
+        bitCount -= 8;
+        buffer[bufferLen++] = (bits >> bitCount) & 0xFF;
+
+        if (bufferLen == FPM_IMAGE_BUFFER_SZ) passOn();
+    }
+}
+
+void FPMImageCompressor::putRun(void)
+{
+    /* a 0, then the length in Elias gamma code: as many 0s as it has bits after the first, then the length itself */
+    uint8_t len = 0;
+    while ((runLength >> len) > 1) len++;
+
+    putBits(0, 1);
+    putBits(0, len);
+
+    if (len >= 16) {
+        putBits(runLength >> 16, len + 1 - 16);
+        putBits(runLength & 0xFFFF, 16);
+    }
+    else {
+        putBits(runLength, len + 1);
+    }
+
+    runLength = 0;
+}
+
+void FPMImageCompressor::encodePixel(uint8_t pixel)
+{
+    /* above the first row is all background */
+    const uint8_t above = (pixelCount >= width) ? ((prevRow[column / 2] >> ((column & 1) ? 0 : 4)) & 0x0F) : 0x0F;
+    const uint8_t a = column ? left : above;
+    const uint8_t c = column ? upperLeft : above;
+
+    /* the error, wrapped to [-8, 7], then folded into [0, 15] */
+    int8_t error = (pixel - FPMImageCompressor::predict(a, above, c)) & 0x0F;
+    if (error >= 8) error -= 16;
+
+    const uint8_t folded = (error >= 0) ? 2 * error : -2 * error - 1;
+
+    if (folded == 0)
+    {
+        runLength++;
+    }
+    else
+    {
+        if (runLength != 0) putRun();
+
+        /* a 1, then the error in Rice code: the quotient in unary (1s ending with a 0), then the remainder in k bits */
+        const uint8_t k = FPMImageCompressor::riceParam(errorSum, errorCount);
+        const uint8_t value = folded - 1;
+        const uint8_t q = value >> k;
+
+        putBits((((1UL << (q + 1)) - 1) << (k + 1)) | (value & ((1 << k) - 1)), q + k + 2);
+
+        errorSum += value;
+
+        if (++errorCount == FPM_IMAGEZ_ERROR_WINDOW) {
+            errorSum >>= 1;
+            errorCount >>= 1;
+        }
+    }
+
+    /* move along, keeping this pixel for the row below */
+    uint8_t * stored = &prevRow[column / 2];
+    *stored = (column & 1) ? ((*stored & 0xF0) | pixel) : ((*stored & 0x0F) | (pixel << 4));
+
+    upperLeft = above;
+    left = pixel;
+    pixelCount++;
+
+    if (++column == width) column = 0;
+}
+
+size_t FPMImageCompressor::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t FPMImageCompressor::write(const uint8_t * packed, size_t size)
+{
+    if (status != FPMStatus::OK) return 0;
+
+    const uint32_t totalPixels = (uint32_t)width * height;
+
+    for (size_t i = 0; i < size && pixelCount < totalPixels; i++)
+    {
+        /* the upper nibble is the left pixel */
+        encodePixel(packed[i] >> 4);
+
+        if (pixelCount < totalPixels) {
+            encodePixel(packed[i] & 0x0F);
+        }
+    }
+
+    /* anything past the end of the image is dropped */
+    return (status == FPMStatus::OK) ? size : 0;
+}
+
+FPMStatus FPMImageCompressor::end(void)
+{
+    if (status != FPMStatus::OK) return status;
+
+    if (pixelCount < (uint32_t)width * height)
+    {
+        FPM_LOGLN_ERROR("FPMImageCompressor: image incomplete, %lu pixels", (unsigned long)pixelCount);
+        status = FPMStatus::READ_ERROR;
+        return status;
+    }
+
+    if (runLength != 0) putRun();
+
+    /* pad out the last byte */
+    if (bitCount != 0) putBits(0, 8 - bitCount);
+
+    passOn();
+    return status;
+}
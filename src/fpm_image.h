@@ -0,0 +1,331 @@
+/***************************************************
+  Streaming conversion of fingerprint images, as read from the sensor, into 8-bit raw pixels, PGM or BMP files
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_IMAGE_H_
+#define FPM_IMAGE_H_
+
+#include <Arduino.h>
+#include "fpm.h"
+
+/* Default image dimensions, if the sensor can't report them (see FPMProductInfo) */
+#define FPM_IMAGE_WIDTH             256
+#define FPM_IMAGE_HEIGHT            288
+
+/* Size of the working buffer in which pixels are expanded, before they're passed on.
+ * Larger buffers mean fewer writes to the destination. */
+#ifndef FPM_IMAGE_BUFFER_SZ
+    #if defined(ARDUINO_ARCH_AVR)
+        #define FPM_IMAGE_BUFFER_SZ     32
+    #else
+        #define FPM_IMAGE_BUFFER_SZ     256
+    #endif
+#endif
+
+/* Widest scaled image that FPMImageWriter can produce; it sums each row of output pixels in RAM, at 16 bits per pixel */
+#ifndef FPM_IMAGE_SCALED_MAX_WIDTH
+    #if defined(ARDUINO_ARCH_AVR)
+        #define FPM_IMAGE_SCALED_MAX_WIDTH  64
+    #else
+        #define FPM_IMAGE_SCALED_MAX_WIDTH  256
+    #endif
+#endif
+
+/* Smallest scale factor, as 1/N, so that the sums can't overflow */
+#define FPM_IMAGE_MIN_SCALE         16
+
+/* Widest image that FPMImageCompressor can handle; it keeps the previous row in RAM, at 4 bits per pixel */
+#ifndef FPM_IMAGE_MAX_WIDTH
+    #define FPM_IMAGE_MAX_WIDTH     256
+#endif
+
+/* Signature and version of each compressed image, see FPMImageCompressor */
+#define FPM_IMAGEZ_MAGIC            "FPMZ"
+#define FPM_IMAGEZ_VERSION          1
+#define FPM_IMAGEZ_HEADER_LEN       9
+
+/* FPMImageQuality divides the image into square blocks of this many pixels (a power of 2) along each side,
+ * and counts a block as part of the finger if at least 1/8 of its pixels are dark enough to be ridges */
+#ifndef FPM_IMAGE_QUALITY_BLOCK
+    #define FPM_IMAGE_QUALITY_BLOCK         16
+#endif
+
+/* Darkest 4-bit level that still counts as background, i.e. 8-bit levels above ~180 */
+#ifndef FPM_IMAGE_QUALITY_BACKGROUND
+    #define FPM_IMAGE_QUALITY_BACKGROUND    11
+#endif
+
+/* Default limits for an acceptable image, see FPMImageQualityLimits */
+#define FPM_IMAGE_QUALITY_MIN_COVERAGE      30
+#define FPM_IMAGE_QUALITY_MIN_CONTRAST      6
+#define FPM_IMAGE_QUALITY_MAX_OFFSET        25
+
+/* image formats */
+enum class FPMImageFormat : uint8_t {
+    /* 8-bit grayscale pixels, row by row, from the top left */
+    RAW,
+    /* binary PGM (P5) file */
+    PGM,
+    /* 8-bit BMP file with a grayscale palette, top-down */
+    BMP
+};
+
+/* A Stream to be handed to readDataPacket()/pollDataPacket() after downloadImage().
+ * The sensor packs 2 pixels (4 bits each) into every byte; these are expanded to 8 bits each,
+ * and passed on to #dest in the chosen format, as they arrive, without ever holding the whole image.
+ * Optionally, only a part of the image is passed on, and/or it's scaled down on the way. 
+ * The rest of the image is still read from the sensor (and checked) as usual, but dropped right away. */
+class FPMImageWriter : public Stream
+{
+    public:
+    /** #width and #height should be those reported by the sensor, in FPMProductInfo, where available */
+    FPMImageWriter(Print * dest, FPMImageFormat format = FPMImageFormat::BMP,
+                   uint16_t width = FPM_IMAGE_WIDTH, uint16_t height = FPM_IMAGE_HEIGHT);
+
+    /** Passes on only the pixels inside this rectangle of the sensor's image.
+     *  Call it before begin(); the whole image is passed on by default. */
+    FPMStatus setCrop(uint16_t x, uint16_t y, uint16_t cropWidth, uint16_t cropHeight);
+
+    /** Scales the (cropped) image down by #mult/#div, each pixel being the average of those it covers, 
+     *  e.g. 1/2 for a quarter of the pixels, or 3/4 to fit 256x288 into 192x216. The factor must lie within [1/16, 1],
+     *  and the scaled width within FPM_IMAGE_SCALED_MAX_WIDTH. Call it before begin(), after setCrop(). */
+    FPMStatus setScale(uint8_t mult, uint8_t div);
+
+    /* Dimensions of the image as passed on, after any cropping and scaling */
+    uint16_t outputWidth(void);
+    uint16_t outputHeight(void);
+
+    /* Writes the file header, if any. Call it before each image is read. */
+    FPMStatus begin(void);
+
+    /** Passes on any pixels still buffered. Returns FPMStatus::READ_ERROR if the image is incomplete,
+     *  or FPMStatus::WRITE_ERROR if #dest stopped accepting bytes at any point. */
+    FPMStatus end(void);
+
+    /* Number of bytes the sensor sends for the whole image */
+    uint32_t packedSize(void);
+
+    /* Total number of bytes written to #dest for the whole image, header included */
+    uint32_t outputSize(void);
+
+    /* Stream interface */
+    size_t write(uint8_t c);
+    size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+    int peek(void) { return -1; }
+
+    private:
+    Print * dest;
+    FPMImageFormat format;
+    uint16_t width;
+    uint16_t height;
+
+    /* the part of the image that's passed on, and how it's scaled */
+    uint16_t cropX, cropY, cropWidth, cropHeight;
+    uint8_t scaleMult, scaleDiv;
+    uint16_t outWidth, outHeight;
+
+    /* position in the sensor's image, in pixels */
+    uint32_t pixelCount;
+    uint16_t srcX, srcY;
+
+    /* and in the output, along with the output pixel that the current source pixel goes into, when scaling */
+    uint16_t column;
+    uint16_t outX;
+    uint16_t outXRemainder;
+
+    /* sums of the pixels covered by each output pixel in the current row, when scaling */
+    uint16_t lineSums[FPM_IMAGE_SCALED_MAX_WIDTH];
+
+    uint8_t buffer[FPM_IMAGE_BUFFER_SZ];
+    uint16_t bufferLen;
+    FPMStatus status;
+
+    uint16_t headerSize(void);
+    uint8_t rowPadding(void);
+    void updateGeometry(void);
+
+    /* number of source pixels (along either axis) that go into output pixel #index */
+    uint16_t coverage(uint16_t index);
+
+    inline void putSourcePixel(uint8_t pixel);
+    inline void putPixel(uint8_t pixel);
+    inline void putByte(uint8_t value);
+    void putScaledRow(uint16_t outRow);
+    void endSourceRow(void);
+    void passOn(void);
+};
+
+/* Quality of a captured image, as measured by FPMImageQuality */
+typedef struct {
+    /* percentage of the image covered by the finger, to the nearest block */
+    uint8_t coverage;
+    /* average spread of 4-bit levels (0-15) from ridge to valley, over the blocks covered by the finger */
+    uint8_t contrast;
+    /* centre of the covered blocks, in pixels */
+    uint16_t centroidX;
+    uint16_t centroidY;
+    /* how far that centre is from the middle of the image, as a percentage of its width/height */
+    int8_t offsetX;
+    int8_t offsetY;
+    /* whether the image met all the limits */
+    bool acceptable;
+} FPMImageQualityReport;
+
+/* Limits for an acceptable image; the defaults are FPM_IMAGE_QUALITY_MIN_COVERAGE and co. */
+typedef struct {
+    uint8_t minCoverage;
+    uint8_t minContrast;
+    uint8_t maxOffset;
+} FPMImageQualityLimits;
+
+/* A Stream to be handed to readDataPacket()/pollDataPacket() after downloadImage(), which measures 
+ * the quality of the image as it arrives, so a poor capture can be rejected (and the finger placed again) 
+ * without waiting for image2Tz() to fail, or a search to come back with a low score.
+ * Every byte is also passed on unchanged to #next, if any, e.g. an FPMImageWriter. 
+ * Only a few bytes are kept for each column of blocks, so it's cheap enough for any board. */
+class FPMImageQuality : public Stream
+{
+    public:
+    FPMImageQuality(Print * next = NULL, uint16_t width = FPM_IMAGE_WIDTH, uint16_t height = FPM_IMAGE_HEIGHT);
+
+    void setLimits(const FPMImageQualityLimits * limits);
+
+    /* Call it before each image is read. */
+    FPMStatus begin(void);
+
+    /** Completes the measurements. Returns FPMStatus::READ_ERROR if the image is incomplete,
+     *  in which case the image is never acceptable. */
+    FPMStatus end(void);
+
+    /* Call it after end() */
+    void getReport(FPMImageQualityReport * report);
+    bool acceptable(void);
+
+    /* Stream interface */
+    size_t write(uint8_t c);
+    size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+    int peek(void) { return -1; }
+
+    private:
+    Print * next;
+    uint16_t width;
+    uint16_t height;
+    FPMImageQualityLimits limits;
+
+    uint32_t pixelCount;
+    uint16_t column;
+    uint16_t row;
+
+    /* for each block in the current row of blocks: its dark pixels and its lightest and darkest levels */
+    uint16_t darkCounts[FPM_IMAGE_MAX_WIDTH / FPM_IMAGE_QUALITY_BLOCK];
+    uint8_t minLevels[FPM_IMAGE_MAX_WIDTH / FPM_IMAGE_QUALITY_BLOCK];
+    uint8_t maxLevels[FPM_IMAGE_MAX_WIDTH / FPM_IMAGE_QUALITY_BLOCK];
+
+    /* and totals over the covered blocks so far */
+    uint16_t coveredCount;
+    uint32_t coveredPixels;
+    uint32_t contrastSum;
+    uint32_t sumX;
+    uint32_t sumY;
+
+    FPMImageQualityReport report;
+    FPMStatus status;
+
+    inline void putPixel(uint8_t level);
+    void endBlockRow(void);
+    void resetBlocks(void);
+};
+
+/* A Stream to be handed to readDataPacket()/pollDataPacket() after downloadImage(), which compresses the image
+ * losslessly on its way to #dest. The bench in extras/bench reports how well it does on recorded images.
+ *
+ * Each pixel is predicted from its neighbours to the left and above (as in LOCO-I/JPEG-LS), 
+ * and the prediction errors are coded as runs of zeros (mostly background) or adaptive Rice codes (mostly ridges).
+ * The output is a 9-byte header ("FPMZ", version, width and height, little-endian) followed by the bitstream, 
+ * which extras/decoder turns back into the sensor's format. */
+class FPMImageCompressor : public Stream
+{
+    public:
+    FPMImageCompressor(Print * dest, uint16_t width = FPM_IMAGE_WIDTH, uint16_t height = FPM_IMAGE_HEIGHT);
+
+    /* Writes the header. Call it before each image is read. */
+    FPMStatus begin(void);
+
+    /** Writes out the last of the bitstream. Returns FPMStatus::READ_ERROR if the image is incomplete,
+     *  or FPMStatus::WRITE_ERROR if #dest stopped accepting bytes at any point. */
+    FPMStatus end(void);
+
+    /* Number of bytes written to #dest so far, header included */
+    uint32_t compressedSize(void);
+
+    /* Stream interface */
+    size_t write(uint8_t c);
+    size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+    int peek(void) { return -1; }
+
+    /* Shared with the decoder: the predicted value of a pixel, from its neighbours to the left, above and above-left */
+    static inline uint8_t predict(uint8_t left, uint8_t above, uint8_t upperLeft)
+    {
+        uint8_t lo = min(left, above), hi = max(left, above);
+
+        if (upperLeft >= hi) return lo;
+        if (upperLeft <= lo) return hi;
+        return left + above - upperLeft;
+    }
+
+    /* and the Rice parameter for the next error, given the sum and number of those coded so far */
+    static inline uint8_t riceParam(uint16_t errorSum, uint8_t errorCount)
+    {
+        uint8_t k = 0;
+        while (k < 3 && ((uint16_t)errorCount << k) < errorSum) k++;
+        return k;
+    }
+
+    private:
+    Print * dest;
+    uint16_t width;
+    uint16_t height;
+
+    uint32_t pixelCount;
+    uint16_t column;
+
+    /* the row above the current pixel, and its neighbour to the left of that */
+    uint8_t prevRow[FPM_IMAGE_MAX_WIDTH / 2];
+    uint8_t left;
+    uint8_t upperLeft;
+
+    /* current run of correctly predicted pixels, and the running mean of the other errors */
+    uint32_t runLength;
+    uint16_t errorSum;
+    uint8_t errorCount;
+
+    uint32_t bits;
+    uint8_t bitCount;
+
+    uint8_t buffer[FPM_IMAGE_BUFFER_SZ];
+    uint16_t bufferLen;
+    uint32_t totalWritten;
+    FPMStatus status;
+
+    void encodePixel(uint8_t pixel);
+    void putBits(uint32_t value, uint8_t count);
+    void putRun(void);
+    void passOn(void);
+};
+
+#endif
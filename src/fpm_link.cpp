@@ -0,0 +1,232 @@
+/***************************************************
+  Baud rate detection and link tuning, for the FPM library
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm.h"
+#include "fpm_logging.h"
+
+#include <Arduino.h>
+
+/* the most common rates first, then the rest from the top down */
+static const FPMBaud probeOrder[] = {
+    FPMBaud::B57600, FPMBaud::B115200, FPMBaud::B9600, FPMBaud::B105600,
+    FPMBaud::B96000, FPMBaud::B86400, FPMBaud::B76800, FPMBaud::B67200,
+    FPMBaud::B48000, FPMBaud::B38400, FPMBaud::B28800, FPMBaud::B19200
+};
+
+/* Compares a template as it's read back from the sensor against the copy that was sent */
+class FPMProbeSink : public Stream
+{
+    public:
+    FPMProbeSink(const uint8_t * expected, uint16_t len) : pos(0), mismatches(0), expected(expected), len(len) { }
+
+    size_t write(uint8_t c) { return write(&c, 1); }
+
+    size_t write(const uint8_t * buf, size_t size)
+    {
+        for (size_t i = 0; i < size; i++, pos++)
+        {
+            if (pos >= len || buf[i] != expected[pos]) mismatches++;
+        }
+
+        return size;
+    }
+
+    using Print::write;
+
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+    int peek(void) { return -1; }
+
+    uint16_t pos;
+    uint16_t mismatches;
+
+    private:
+    const uint8_t * expected;
+    uint16_t len;
+};
+
+static bool firstTemplate(uint16_t id, void * ctx)
+{
+    *(int32_t *)ctx = id;
+    return false;
+}
+
+uint32_t FPM::baudToBps(FPMBaud baudRate)
+{
+    return 9600UL * static_cast<uint16_t>(baudRate);
+}
+
+void FPM::setPortBaudHandler(FPMBaudHandler handler, void * ctx)
+{
+    baudHandler = handler;
+    baudHandlerCtx = ctx;
+}
+
+void FPM::setReadTimeout(uint16_t timeout)
+{
+    readTimeout = timeout;
+}
+
+bool FPM::detectBaud(void)
+{
+    if (baudHandler == NULL) return false;
+
+    /* a wrong guess gets no response at all, so don't wait long for one */
+    const uint16_t timeout = readTimeout;
+    readTimeout = FPM_BAUD_PROBE_TIMEOUT;
+
+    bool found = false;
+
+    for (uint8_t i = 0; i < sizeof(probeOrder) / sizeof(probeOrder[0]) && !found; i++)
+    {
+        baudHandler(FPM::baudToBps(probeOrder[i]), baudHandlerCtx);
+
+        /* any answer at all will do, even if the password's wrong */
+        if (!FPM::isErrorCode(sendPassword()))
+        {
+            FPM_LOGLN_INFO("detectBaud: sensor found at %lu baud", (unsigned long)FPM::baudToBps(probeOrder[i]));
+            sysParams.baudRate = probeOrder[i];
+            found = true;
+        }
+    }
+
+    readTimeout = timeout;
+    return found;
+}
+
+uint8_t FPM::probeLink(uint8_t * probeBuffer, uint16_t len, uint8_t rounds, uint32_t * bytesPerSec)
+{
+    uint8_t errors = 0;
+    uint32_t start = micros();
+
+    for (uint8_t r = 0; r < rounds; r++)
+    {
+        FPMProbeSink sink(probeBuffer, len);
+
+        FPMStatus status = sendTemplate(probeBuffer, len, 2);
+        if (status == FPMStatus::OK) status = downloadTemplate(2);
+
+        bool readComplete = false;
+
+        while (status == FPMStatus::OK && !readComplete)
+        {
+            uint16_t readLen = 0;
+
+            while ((status = pollDataPacket(NULL, &sink, &readLen, &readComplete)) == FPMStatus::PENDING)
+            {
+                yield();
+            }
+        }
+
+        if (status != FPMStatus::OK || sink.pos != len || sink.mismatches != 0) errors++;
+    }
+
+    uint32_t elapsed = micros() - start;
+
+    /* each round trip moves the template both ways */
+    *bytesPerSec = (errors == 0 && elapsed != 0) ? (uint32_t)((2ULL * len * rounds * 1000000UL) / elapsed) : 0;
+    return errors;
+}
+
+FPMStatus FPM::tuneLink(uint8_t * probeBuffer, uint16_t bufLen, FPMLinkResult * results, uint8_t * numResults, uint8_t rounds)
+{
+    const uint8_t maxResults = (results != NULL && numResults != NULL) ? *numResults : 0;
+    if (numResults != NULL) *numResults = 0;
+
+    if (baudHandler == NULL || useFixedParams || probeBuffer == NULL || rounds == 0) return FPMStatus::INVALID_PARAMS;
+
+    /* the probe is whatever template is in buffer 2, read at the current settings, which are known to work */
+    uint16_t len = bufLen;
+    FPMStatus status = fetchTemplate(probeBuffer, &len, 2);
+
+    if (status != FPMStatus::OK)
+    {
+        int32_t id = -1;
+        forEachTemplate(0, firstTemplate, &id);
+
+        if (id == -1)
+        {
+            FPM_LOGLN_ERROR("tuneLink: no template to probe with");
+            return FPMStatus::INVALID_PARAMS;
+        }
+
+        len = bufLen;
+        status = readTemplate(id, probeBuffer, &len, 2);
+        if (status != FPMStatus::OK) return status;
+    }
+
+    FPMBaud bestBaud = sysParams.baudRate;
+    FPMPacketLength bestPacketLen = sysParams.packetLen;
+    uint32_t bestBytesPerSec = 0;
+    uint8_t count = 0;
+
+    for (uint16_t baud = static_cast<uint16_t>(sysParams.baudRate); baud <= static_cast<uint16_t>(FPMBaud::B115200); baud++)
+    {
+        if (baud != static_cast<uint16_t>(sysParams.baudRate))
+        {
+            status = setBaudRate(static_cast<FPMBaud>(baud));
+
+            /* no point going any faster, once the link has failed at this rate */
+            if (status != FPMStatus::OK || !verifyPassword(password))
+            {
+                FPM_LOGLN_ERROR("tuneLink: no link at %lu baud", (unsigned long)FPM::baudToBps(static_cast<FPMBaud>(baud)));
+
+                if (!detectBaud()) return FPMStatus::TIMEOUT;
+                break;
+            }
+        }
+
+        for (uint16_t plen = 0; plen <= static_cast<uint16_t>(FPMPacketLength::PLEN_256); plen++)
+        {
+            FPMLinkResult result;
+            result.baudRate = static_cast<FPMBaud>(baud);
+            result.packetLen = static_cast<FPMPacketLength>(plen);
+
+            status = setPacketLength(result.packetLen);
+
+            if (status == FPMStatus::OK)
+            {
+                result.errors = probeLink(probeBuffer, len, rounds, &result.bytesPerSec);
+            }
+            else
+            {
+                result.errors = rounds;
+                result.bytesPerSec = 0;
+            }
+
+            FPM_LOGLN_INFO("tuneLink: %lu baud, %u-byte packets: %lu bytes/s, %u errors", (unsigned long)FPM::baudToBps(result.baudRate),
+                           FPM::packetLengths[plen], (unsigned long)result.bytesPerSec, result.errors);
+
+            if (count < maxResults) results[count] = result;
+            count++;
+
+            if (result.errors == 0 && result.bytesPerSec > bestBytesPerSec)
+            {
+                bestBytesPerSec = result.bytesPerSec;
+                bestBaud = result.baudRate;
+                bestPacketLen = result.packetLen;
+            }
+        }
+    }
+
+    if (numResults != NULL) *numResults = min(count, maxResults);
+
+    /* finally, settle on the fastest */
+    if (sysParams.baudRate != bestBaud)
+    {
+        status = setBaudRate(bestBaud);
+        if (status != FPMStatus::OK) return status;
+    }
+
+    if (sysParams.packetLen != bestPacketLen)
+    {
+        status = setPacketLength(bestPacketLen);
+        if (status != FPMStatus::OK) return status;
+    }
+
+    return verifyPassword(password) ? FPMStatus::OK : FPMStatus::TIMEOUT;
+}
@@ -3,7 +3,7 @@
  *
  * - Setup necessary to direct stdout to the Arduino Serial library, which
  *   enables 'printf'. 
- * - Select logging level.
+ * - Select logging level, and mode.
  */
 
 #ifndef FPM_LOGGING_H_
@@ -23,6 +23,68 @@
  */
 #define FPM_LOG_LEVEL                       FPM_LOG_LEVEL_INFO
 
+/* The packet layer (every packet read or written) has a level of its own, 
+ * e.g. to trace every packet at VERBOSE in DEFERRED mode, while everything else stays at INFO */
+#define FPM_LOG_LEVEL_PACKET                FPM_LOG_LEVEL
+
+#define FPM_LOG_MODE_PRINTF                 0
+#define FPM_LOG_MODE_DEFERRED               1
+
+/* How the packet layer logs:
+ * PRINTF formats each message as it happens, which takes much longer than a byte at high baud rates;
+ * DEFERRED just records each one as a binary event (an ID, a timestamp and 2 numbers) in a ring buffer
+ * of FPM_LOG_RING_SZ events, to be formatted later, after the transfer, by FPM::drainLog(). 
+ * When the ring is full, the oldest events are overwritten. */
+#define FPM_LOG_MODE                        FPM_LOG_MODE_PRINTF
+
+/* Must be a power of 2. Each event takes 12 bytes */
+#define FPM_LOG_RING_SZ                     32
+
+/* The packet layer's events, with the messages they're formatted with: 
+ * #arg is printed with 'l' formats, #arg2 with the rest */
+#define FPM_LOG_EVENTS(X) \
+    X(READ_START,       "Reading packet") \
+    X(READ_TIMEOUT,     "readPacket timeout.") \
+    X(HEADER,           "Found Header") \
+    X(WRONG_ADDRESS,    "Wrong address: 0x%lX") \
+    X(ADDRESS,          "Address: 0x%lX") \
+    X(PACKET_ID,        "PID: 0x%lX") \
+    X(BAD_LENGTH,       "Length is invalid or too large: %lu") \
+    X(LENGTH,           "Length: %lu") \
+    X(PAYLOAD,          "Payload: %08lX..., %u bytes") \
+    X(WRONG_CHECKSUM,   "Wrong checksum: 0x%lX != 0x%X") \
+    X(READ_COMPLETE,    "Read complete.") \
+    X(WRITE,            "Sent packet, PID 0x%lX, length %u") \
+    X(WRITE_TIMEOUT,    "writePacket: timed out while reading from Stream")
+
+#define FPM_LOG_EVENT_ID(name, fmt)         FPM_LOG_EVENT_##name,
+
+enum FPMLogEventId : uint8_t {
+    FPM_LOG_EVENTS(FPM_LOG_EVENT_ID)
+    FPM_LOG_EVENT_COUNT
+};
+
+typedef struct {
+    uint32_t time;          /* micros() */
+    uint32_t arg;
+    uint16_t arg2;
+    uint8_t id;
+} FPMLogEvent;
+
+void fpmLogRecord(uint8_t id, uint32_t arg, uint16_t arg2);
+void fpmLogPrint(uint8_t id, uint32_t arg, uint16_t arg2);
+
+/* Log a packet-layer event, at #level */
+#if (FPM_LOG_LEVEL_PACKET == FPM_LOG_LEVEL_SILENT)
+    #define FPM_LOG_EVENT(level, name, arg, arg2)
+#elif (FPM_LOG_MODE == FPM_LOG_MODE_DEFERRED)
+    #define FPM_LOG_EVENT(level, name, arg, arg2) \
+                do { if (level <= FPM_LOG_LEVEL_PACKET) fpmLogRecord(FPM_LOG_EVENT_##name, arg, arg2); } while (0)
+#else
+    #define FPM_LOG_EVENT(level, name, arg, arg2) \
+                do { if (level <= FPM_LOG_LEVEL_PACKET) fpmLogPrint(FPM_LOG_EVENT_##name, arg, arg2); } while (0)
+#endif
+
 #if (FPM_LOG_LEVEL != FPM_LOG_LEVEL_SILENT)
 
     #define FPM_LOG(level, fmt, ...) \
@@ -41,6 +103,22 @@
     #define FPM_LOGLN_VERBOSE(fmt, ...)         FPM_LOGLN(FPM_LOG_LEVEL_VERBOSE, fmt, ##__VA_ARGS__)
     #define FPM_LOGLN_V_VERBOSE(fmt, ...)       FPM_LOGLN(FPM_LOG_LEVEL_V_VERBOSE, fmt, ##__VA_ARGS__)
 
+#else
+
+    #define FPM_LOG_ERROR(fmt, ...)
+    #define FPM_LOG_INFO(fmt, ...)
+    #define FPM_LOG_VERBOSE(fmt, ...)
+    #define FPM_LOG_V_VERBOSE(fmt, ...)
+
+    #define FPM_LOGLN_ERROR(fmt, ...)
+    #define FPM_LOGLN_INFO(fmt, ...)
+    #define FPM_LOGLN_VERBOSE(fmt, ...)
+    #define FPM_LOGLN_V_VERBOSE(fmt, ...)
+
+#endif  /* (FPM_LOG_LEVEL != FPM_LOG_LEVEL_SILENT) */
+
+#if (FPM_LOG_LEVEL != FPM_LOG_LEVEL_SILENT) || (FPM_LOG_LEVEL_PACKET != FPM_LOG_LEVEL_SILENT)
+
     #if defined(ARDUINO_ARCH_AVR)
     
     #include <Arduino.h>
@@ -53,25 +131,13 @@
     
     #endif    
     
-    void printf_begin(void)
+    static inline void printf_begin(void)
     {
     #if defined(ARDUINO_ARCH_AVR)
         fdevopen(&uart_putchar, NULL);
     #endif
     }                                 
 
-#else
-
-    #define FPM_LOG_ERROR(fmt, ...)
-    #define FPM_LOG_INFO(fmt, ...)
-    #define FPM_LOG_VERBOSE(fmt, ...)
-    #define FPM_LOG_V_VERBOSE(fmt, ...)
-
-    #define FPM_LOGLN_ERROR(fmt, ...)
-    #define FPM_LOGLN_INFO(fmt, ...)
-    #define FPM_LOGLN_VERBOSE(fmt, ...)
-    #define FPM_LOGLN_V_VERBOSE(fmt, ...)
-
-#endif  /* (FPM_LOG_LEVEL != FPM_LOG_LEVEL_SILENT) */
+#endif
 
 #endif
@@ -0,0 +1,242 @@
+/***************************************************
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm_shards.h"
+#include "fpm_logging.h"
+
+#include <Arduino.h>
+
+FPMShardedDatabase::FPMShardedDatabase(uint8_t * templateBuffer, uint16_t bufferLen) :
+    numShards(0), templateBuffer(templateBuffer), bufferLen(bufferLen)
+{
+
+}
+
+int8_t FPMShardedDatabase::add(FPM * fpm)
+{
+    if (fpm == NULL || numShards == FPM_MAX_SHARDS) return -1;
+
+    FPMSystemParams params;
+    if (fpm->readParams(&params) != FPMStatus::OK) return -1;
+
+    shards[numShards] = fpm;
+    shardCapacity[numShards] = params.capacity;
+    shardBase[numShards] = getCapacity();
+
+    return numShards++;
+}
+
+uint8_t FPMShardedDatabase::size(void)
+{
+    return numShards;
+}
+
+FPM * FPMShardedDatabase::shard(uint8_t shardIdx)
+{
+    return (shardIdx < numShards) ? shards[shardIdx] : NULL;
+}
+
+uint32_t FPMShardedDatabase::getCapacity(void)
+{
+    if (numShards == 0) return 0;
+
+    return shardBase[numShards - 1] + shardCapacity[numShards - 1];
+}
+
+FPM * FPMShardedDatabase::locate(uint32_t globalId, uint16_t * localId)
+{
+    for (uint8_t i = 0; i < numShards; i++)
+    {
+        if (globalId < shardBase[i] + shardCapacity[i])
+        {
+            *localId = globalId - shardBase[i];
+            return shards[i];
+        }
+    }
+
+    return NULL;
+}
+
+FPMStatus FPMShardedDatabase::getTemplateCount(uint32_t * templateCount)
+{
+    *templateCount = 0;
+
+    for (uint8_t i = 0; i < numShards; i++)
+    {
+        uint16_t count;
+
+        FPMStatus status = shards[i]->getTemplateCount(&count);
+        if (status != FPMStatus::OK) return status;
+
+        *templateCount += count;
+    }
+
+    return FPMStatus::OK;
+}
+
+FPMStatus FPMShardedDatabase::enroll(uint8_t sensorIdx, uint32_t * globalId, uint8_t slot)
+{
+    if (sensorIdx >= numShards) return FPMStatus::INVALID_PARAMS;
+
+    /* find the shard with the most free slots */
+    int8_t target = -1;
+    uint16_t mostFree = 0;
+
+    for (uint8_t i = 0; i < numShards; i++)
+    {
+        uint16_t count;
+
+        FPMStatus status = shards[i]->getTemplateCount(&count);
+        if (status != FPMStatus::OK) return status;
+
+        if (count < shardCapacity[i] && shardCapacity[i] - count > mostFree)
+        {
+            mostFree = shardCapacity[i] - count;
+            target = i;
+        }
+    }
+
+    if (target == -1) return FPMStatus::NO_FREE_INDEX;
+
+    int16_t localId;
+
+    FPMStatus status = shards[target]->getFreeId(&localId);
+    if (status != FPMStatus::OK) return status;
+    if (localId == -1) return FPMStatus::NO_FREE_INDEX;
+
+    if (target == sensorIdx)
+    {
+        status = shards[target]->storeTemplate(localId, slot);
+    }
+    else
+    {
+        /* move the template over to its shard */
+        uint16_t len = bufferLen;
+
+        status = shards[sensorIdx]->fetchTemplate(templateBuffer, &len, slot);
+        if (status != FPMStatus::OK) return status;
+
+        status = shards[target]->writeTemplate(localId, templateBuffer, len);
+    }
+
+    if (status != FPMStatus::OK) return status;
+
+    FPM_LOGLN_INFO("enroll: stored on shard %d at ID %d", target, localId);
+
+    *globalId = shardBase[target] + localId;
+    return FPMStatus::OK;
+}
+
+FPMStatus FPMShardedDatabase::identify(uint8_t sensorIdx, uint32_t * globalId, uint16_t * score, uint8_t slot)
+{
+    if (sensorIdx >= numShards) return FPMStatus::INVALID_PARAMS;
+
+    FPM * source = shards[sensorIdx];
+    uint16_t len = bufferLen;
+
+    /* pull the features off the source sensor first, since it can't be read from while it's searching */
+    if (numShards > 1)
+    {
+        FPMStatus status = source->fetchTemplate(templateBuffer, &len, slot);
+        if (status != FPMStatus::OK) return status;
+    }
+
+    FPMStatus results[FPM_MAX_SHARDS];
+    bool searching[FPM_MAX_SHARDS];
+    uint8_t pending = 0;
+
+    /* get each shard searching as soon as it has the features, so that the searches overlap
+     * with the transfers to the shards after it */
+    for (uint8_t i = 0; i < numShards; i++)
+    {
+        uint8_t shardSlot = slot;
+        results[i] = FPMStatus::OK;
+
+        if (i != sensorIdx)
+        {
+            shardSlot = 1;
+            results[i] = shards[i]->sendTemplate(templateBuffer, len, shardSlot);
+        }
+
+        searching[i] = (results[i] == FPMStatus::OK);
+
+        if (searching[i])
+        {
+            shards[i]->beginSearch(shardSlot);
+            pending++;
+        }
+    }
+
+    /* then collect the results as they come in */
+    int8_t best = -1;
+    uint16_t bestId = 0;
+    *score = 0;
+
+    while (pending != 0)
+    {
+        for (uint8_t i = 0; i < numShards; i++)
+        {
+            if (!searching[i]) continue;
+
+            results[i] = shards[i]->poll();
+            if (results[i] == FPMStatus::PENDING) continue;
+
+            searching[i] = false;
+            pending--;
+
+            uint16_t fingerId, fingerScore;
+
+            if (results[i] == FPMStatus::OK) results[i] = shards[i]->getSearchResult(&fingerId, &fingerScore);
+
+            if (results[i] == FPMStatus::OK && (best == -1 || fingerScore > *score))
+            {
+                best = i;
+                bestId = fingerId;
+                *score = fingerScore;
+            }
+        }
+
+        yield();
+    }
+
+    if (best != -1)
+    {
+        *globalId = shardBase[best] + bestId;
+        return FPMStatus::OK;
+    }
+
+    /* no match anywhere, so report any shard that couldn't be searched at all */
+    for (uint8_t i = 0; i < numShards; i++)
+    {
+        if (results[i] != FPMStatus::NOTFOUND)
+        {
+            FPM_LOGLN_ERROR("identify: shard %u failed with 0x%X", i, static_cast<uint16_t>(results[i]));
+            return results[i];
+        }
+    }
+
+    return FPMStatus::NOTFOUND;
+}
+
+FPMStatus FPMShardedDatabase::deleteTemplate(uint32_t globalId)
+{
+    uint16_t localId;
+
+    FPM * fpm = locate(globalId, &localId);
+    if (fpm == NULL) return FPMStatus::INVALID_PARAMS;
+
+    return fpm->deleteTemplate(localId);
+}
+
+FPMStatus FPMShardedDatabase::emptyDatabase(void)
+{
+    for (uint8_t i = 0; i < numShards; i++)
+    {
+        FPMStatus status = shards[i]->emptyDatabase();
+        if (status != FPMStatus::OK) return status;
+    }
+
+    return FPMStatus::OK;
+}
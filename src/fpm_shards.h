@@ -0,0 +1,64 @@
+/***************************************************
+  A single virtual template database, spread across several fingerprint sensors
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_SHARDS_H_
+#define FPM_SHARDS_H_
+
+#include "fpm.h"
+
+/* Max number of sensors (shards) in the database */
+#ifndef FPM_MAX_SHARDS
+    #define FPM_MAX_SHARDS              4
+#endif
+
+/* Global IDs are allotted to each shard in turn, in the order they're added:
+ * the first shard has IDs [0, capacity0), the next one [capacity0, capacity0 + capacity1), and so on. */
+class FPMShardedDatabase
+{
+    public:
+    /** #templateBuffer is used to move templates between sensors,
+     *  so it must be large enough for one template (see FPM::getTemplateSize()) */
+    FPMShardedDatabase(uint8_t * templateBuffer, uint16_t bufferLen);
+
+    /** Adds a sensor as the next shard, returning its index, or -1 if there's no room.
+     *  The sensor should have been started with begin() already. */
+    int8_t add(FPM * fpm);
+
+    uint8_t size(void);
+    FPM * shard(uint8_t shardIdx);
+
+    /* total capacity of all shards */
+    uint32_t getCapacity(void);
+    FPMStatus getTemplateCount(uint32_t * templateCount);
+
+    /** Stores the template in buffer #slot of sensor #sensorIdx (e.g. just after generateTemplate())
+     *  on whichever shard is the least full, and returns its global ID in #globalId */
+    FPMStatus enroll(uint8_t sensorIdx, uint32_t * globalId, uint8_t slot = 1);
+
+    /** Searches every shard for the features in buffer #slot of sensor #sensorIdx (e.g. just after image2Tz()).
+     *  The features are copied into buffer 1 of every other shard, and all the shards are searched at once,
+     *  so this takes not much longer than a search of the largest shard. Returns FPMStatus::NOTFOUND if no shard has a match,
+     *  otherwise the global ID and score of the best match. */
+    FPMStatus identify(uint8_t sensorIdx, uint32_t * globalId, uint16_t * score, uint8_t slot = 1);
+
+    FPMStatus deleteTemplate(uint32_t globalId);
+    FPMStatus emptyDatabase(void);
+
+    /* Returns the shard holding #globalId, and its ID within that shard, or NULL if it's out of range */
+    FPM * locate(uint32_t globalId, uint16_t * localId);
+
+    private:
+    FPM * shards[FPM_MAX_SHARDS];
+    uint32_t shardBase[FPM_MAX_SHARDS];
+    uint16_t shardCapacity[FPM_MAX_SHARDS];
+    uint8_t numShards;
+
+    uint8_t * templateBuffer;
+    uint16_t bufferLen;
+};
+
+#endif
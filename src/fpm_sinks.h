@@ -0,0 +1,277 @@
+/***************************************************
+  Sinks and sources for data packets, as lightweight alternatives to a Stream:
+  the packet reader calls them directly, with no virtual calls, and reads straight into their memory where it can.
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_SINKS_H_
+#define FPM_SINKS_H_
+
+#include <Arduino.h>
+#include "fpm.h"
+
+/* A buffer of #size bytes, filled from the start by readDataPacket()/pollDataPacket(),
+ * which read straight into it. Anything beyond #size is counted, but dropped. */
+class FPMSpanSink
+{
+    public:
+    FPMSpanSink(uint8_t * data, uint32_t size) : data(data), size(size), length(0), overflow(0) { }
+
+    /* Start over from the beginning of the buffer */
+    void reset(void) { length = 0; overflow = 0; }
+
+    uint8_t * window(uint16_t * len)
+    {
+        uint32_t room = size - length;
+
+        *len = (room > 0xFFFF) ? 0xFFFF : room;
+        return (room != 0) ? data + length : NULL;
+    }
+
+    void put(const uint8_t * chunk, uint16_t len)
+    {
+        /* most likely, it's already in place */
+        if (chunk == data + length) {
+            length += len;
+            return;
+        }
+
+        uint16_t fit = min((uint32_t)len, size - length);
+        memcpy(data + length, chunk, fit);
+        length += fit;
+        overflow += len - fit;
+    }
+
+    uint8_t * data;
+    uint32_t size;
+
+    /* bytes received so far, and those that didn't fit */
+    uint32_t length;
+    uint32_t overflow;
+};
+
+/* #size bytes for writeDataPacket() to send, from the start */
+class FPMSpanSource
+{
+    public:
+    FPMSpanSource(const uint8_t * data, uint32_t size) : data(data), size(size), position(0) { }
+
+    void reset(void) { position = 0; }
+
+    uint32_t available(void) { return size - position; }
+
+    uint16_t read(uint8_t * dest, uint16_t len)
+    {
+        memcpy(dest, data + position, len);
+        position += len;
+        return len;
+    }
+
+    const uint8_t * data;
+    uint32_t size;
+    uint32_t position;
+};
+
+/* A ring buffer of #size bytes, in which data packets can be received (it's a sink)
+ * and drained elsewhere with peek()/consume() or read(), e.g. by a network client; or filled with write()
+ * and sent with writeDataPacket() (it's also a source). Anything that doesn't fit is counted, but dropped.
+ * It isn't safe to share between threads, or with an ISR. */
+class FPMRingBuffer
+{
+    public:
+    FPMRingBuffer(uint8_t * ring, uint16_t size) : overflow(0), ring(ring), size(size), head(0), count(0) { }
+
+    void reset(void) { head = 0; count = 0; overflow = 0; }
+
+    /* sink: the free space after the last byte, up to the end of the ring */
+    uint8_t * window(uint16_t * len)
+    {
+        uint16_t tail = wrap(head + count);
+
+        *len = (tail >= head && count != size) ? size - tail : head - tail;
+        return (*len != 0) ? &ring[tail] : NULL;
+    }
+
+    void put(const uint8_t * chunk, uint16_t len)
+    {
+        uint16_t tail = wrap(head + count);
+
+        if (chunk == &ring[tail]) {
+            count += len;
+            return;
+        }
+
+        write(chunk, len);
+    }
+
+    /* source */
+    uint32_t available(void) { return count; }
+
+    uint16_t read(uint8_t * dest, uint16_t len)
+    {
+        uint16_t done = 0;
+
+        while (done < len && count != 0)
+        {
+            uint16_t piece;
+            const uint8_t * data = peek(&piece);
+
+            piece = min(piece, (uint16_t)(len - done));
+            memcpy(dest + done, data, piece);
+            consume(piece);
+            done += piece;
+        }
+
+        return done;
+    }
+
+    /* Appends #len bytes, as many as fit */
+    uint16_t write(const uint8_t * data, uint16_t len)
+    {
+        uint16_t done = 0;
+
+        while (done < len)
+        {
+            uint16_t room;
+            uint8_t * dest = window(&room);
+
+            if (dest == NULL) break;
+
+            room = min(room, (uint16_t)(len - done));
+            memcpy(dest, data + done, room);
+            count += room;
+            done += room;
+        }
+
+        overflow += len - done;
+        return done;
+    }
+
+    /* The oldest bytes, up to the end of the ring; consume() them once they've been dealt with */
+    const uint8_t * peek(uint16_t * len)
+    {
+        *len = min(count, (uint16_t)(size - head));
+        return &ring[head];
+    }
+
+    void consume(uint16_t len)
+    {
+        head = wrap(head + len);
+        count -= len;
+
+        if (count == 0) head = 0;
+    }
+
+    /* bytes dropped because the ring was full */
+    uint32_t overflow;
+
+    private:
+    uint8_t * ring;
+    uint16_t size;
+    uint16_t head;
+    uint16_t count;
+
+    uint16_t wrap(uint32_t index) { return (index >= size) ? index - size : index; }
+};
+
+/* Calls #callback(const uint8_t * data, uint16_t len) with each chunk of a data packet, as it's read.
+ * #callback can be a plain function or (on cores with C++11) a lambda, and is called directly.
+ * makeCallbackSink() saves spelling out its type. */
+template <class Callback>
+class FPMCallbackSink
+{
+    public:
+    FPMCallbackSink(Callback callback) : callback(callback) { }
+
+    uint8_t * window(uint16_t * len) { *len = 0; return NULL; }
+    void put(const uint8_t * chunk, uint16_t len) { callback(chunk, len); }
+
+    private:
+    Callback callback;
+};
+
+template <class Callback>
+inline FPMCallbackSink<Callback> makeCallbackSink(Callback callback)
+{
+    return FPMCallbackSink<Callback>(callback);
+}
+
+/* The data packet methods of FPM, for any of the above (or anything else with the same methods) */
+
+template <class Sink>
+FPMStatus FPM::pollDataPacket(Sink & sink, uint16_t * readLen, bool * readComplete)
+{
+    uint8_t pktId;
+
+    if (readLen == NULL || readComplete == NULL) return FPMStatus::INVALID_PARAMS;
+
+    /* start a new read, if one isn't already in progress */
+    if (rxState == FPMState::IDLE) startChunkedRead();
+
+    while (true)
+    {
+        uint16_t windowLen = 0;
+        uint8_t * window = sink.window(&windowLen);
+        uint8_t * chunk;
+        uint16_t chunkLen;
+
+        FPMStatus status = pollChunk(window, windowLen, &chunk, &chunkLen, readLen, &pktId);
+
+        /* every chunk goes to the sink as soon as it's read, then on to the next */
+        if (chunkLen != 0) {
+            sink.put(chunk, chunkLen);
+            continue;
+        }
+
+        if (status != FPMStatus::OK) return status;
+
+        *readComplete = (pktId == FPM_ENDDATAPACKET);
+        return FPMStatus::OK;
+    }
+}
+
+template <class Sink>
+bool FPM::readDataPacket(Sink & sink, uint16_t * readLen, bool * readComplete)
+{
+    FPMStatus status;
+
+    startChunkedRead();
+
+    while ((status = pollDataPacket(sink, readLen, readComplete)) == FPMStatus::PENDING)
+    {
+        yield();
+    }
+
+    return status == FPMStatus::OK;
+}
+
+template <class Source>
+bool FPM::writeDataPacket(Source & source, uint16_t * writeLen, bool writeComplete)
+{
+    const uint16_t PACKET_LEN = FPM::packetLengths[static_cast<uint16_t>(sysParams.packetLen)];
+    const uint32_t left = source.available();
+
+    /* clip the write-length to the current packet length, and to what's left */
+    if (*writeLen > PACKET_LEN) *writeLen = PACKET_LEN;
+    if (*writeLen > left) *writeLen = left;
+    if (*writeLen == 0) return false;
+
+    uint16_t space;
+    uint8_t * chunk = beginDataPacket(*writeLen, writeComplete, &space);
+
+    for (uint16_t done = 0; done < *writeLen; )
+    {
+        uint16_t len = min((uint16_t)(*writeLen - done), space);
+
+        source.read(chunk, len);
+        putDataChunk(chunk, len);
+        done += len;
+    }
+
+    endDataPacket();
+    return true;
+}
+
+#endif
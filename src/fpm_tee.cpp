@@ -0,0 +1,184 @@
+/***************************************************
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm_tee.h"
+#include "fpm_logging.h"
+
+#include <Arduino.h>
+
+FPMTee::FPMTee(void) : consumerCount(0), totalReceived(0)
+{
+
+}
+
+FPMStatus FPMTee::addConsumer(Print * consumer, uint8_t * ring, uint16_t ringSize)
+{
+    if (consumer == NULL || (ring == NULL && ringSize != 0)) return FPMStatus::INVALID_PARAMS;
+    if (consumerCount == FPM_TEE_MAX_CONSUMERS) return FPMStatus::NO_FREE_INDEX;
+
+    FPMTeeConsumer * c = &consumers[consumerCount++];
+    memset(c, 0, sizeof(FPMTeeConsumer));
+
+    c->dest = consumer;
+    c->ring = ring;
+    c->ringSize = ringSize;
+
+    return FPMStatus::OK;
+}
+
+FPMStatus FPMTee::addConsumer(uint8_t * buffer, uint32_t bufferSize)
+{
+    if (buffer == NULL) return FPMStatus::INVALID_PARAMS;
+    if (consumerCount == FPM_TEE_MAX_CONSUMERS) return FPMStatus::NO_FREE_INDEX;
+
+    FPMTeeConsumer * c = &consumers[consumerCount++];
+    memset(c, 0, sizeof(FPMTeeConsumer));
+
+    c->copy = buffer;
+    c->copySize = bufferSize;
+
+    return FPMStatus::OK;
+}
+
+void FPMTee::removeAll(void)
+{
+    consumerCount = 0;
+}
+
+void FPMTee::begin(void)
+{
+    totalReceived = 0;
+
+    for (uint8_t i = 0; i < consumerCount; i++) {
+        consumers[i].head = 0;
+        consumers[i].count = 0;
+        consumers[i].dropped = 0;
+    }
+}
+
+void FPMTee::drain(FPMTeeConsumer * consumer)
+{
+    while (consumer->count != 0)
+    {
+        /* up to the end of the ring at most, then around again */
+        uint16_t len = min(consumer->count, (uint16_t)(consumer->ringSize - consumer->head));
+        uint16_t written = consumer->dest->write(&consumer->ring[consumer->head], len);
+
+        consumer->head += written;
+        if (consumer->head == consumer->ringSize) consumer->head = 0;
+        consumer->count -= written;
+
+        if (written < len) break;
+    }
+
+    if (consumer->count == 0) consumer->head = 0;
+}
+
+void FPMTee::enqueue(FPMTeeConsumer * consumer, const uint8_t * buffer, size_t size)
+{
+    if (size > (size_t)(consumer->ringSize - consumer->count))
+    {
+        /* once anything is lost, the rest of the download is no use to this consumer */
+        if (consumer->dropped == 0) {
+            FPM_LOGLN_ERROR("FPMTee: consumer stalled, dropping the rest of the download");
+        }
+
+        consumer->dropped += size;
+        return;
+    }
+
+    uint16_t tail = consumer->head + consumer->count;
+    if (tail >= consumer->ringSize) tail -= consumer->ringSize;
+
+    /* in at most 2 pieces, around the end of the ring */
+    uint16_t first = min(size, (size_t)(consumer->ringSize - tail));
+    memcpy(&consumer->ring[tail], buffer, first);
+    memcpy(consumer->ring, buffer + first, size - first);
+
+    consumer->count += size;
+}
+
+size_t FPMTee::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t FPMTee::write(const uint8_t * buffer, size_t size)
+{
+    for (uint8_t i = 0; i < consumerCount; i++)
+    {
+        FPMTeeConsumer * c = &consumers[i];
+
+        if (c->dest == NULL)
+        {
+            /* a plain copy, as far as it fits */
+            if (totalReceived < c->copySize) {
+                uint32_t len = min((uint32_t)size, c->copySize - totalReceived);
+                memcpy(&c->copy[totalReceived], buffer, len);
+                c->dropped += size - len;
+            }
+            else {
+                c->dropped += size;
+            }
+
+            continue;
+        }
+
+        if (c->dropped != 0) {
+            c->dropped += size;
+            continue;
+        }
+
+        /* whatever is queued goes first, to keep the bytes in order */
+        if (c->count != 0) drain(c);
+
+        if (c->count != 0) {
+            enqueue(c, buffer, size);
+        }
+        else {
+            size_t written = c->dest->write(buffer, size);
+            if (written < size) enqueue(c, buffer + written, size - written);
+        }
+    }
+
+    totalReceived += size;
+    return size;
+}
+
+bool FPMTee::poll(void)
+{
+    bool pending = false;
+
+    for (uint8_t i = 0; i < consumerCount; i++)
+    {
+        if (consumers[i].count == 0) continue;
+
+        drain(&consumers[i]);
+        pending = pending || (consumers[i].count != 0);
+    }
+
+    return pending;
+}
+
+FPMStatus FPMTee::end(void)
+{
+    if (poll()) return FPMStatus::PENDING;
+
+    for (uint8_t i = 0; i < consumerCount; i++) {
+        if (consumers[i].dropped != 0) return FPMStatus::WRITE_ERROR;
+    }
+
+    return FPMStatus::OK;
+}
+
+uint32_t FPMTee::received(void)
+{
+    return totalReceived;
+}
+
+uint32_t FPMTee::dropped(uint8_t index)
+{
+    return (index < consumerCount) ? consumers[index].dropped : 0;
+}
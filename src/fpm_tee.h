@@ -0,0 +1,91 @@
+/***************************************************
+  Fan-out of a single download (image or template) to several consumers at once,
+  each with its own queue, so that a slow one can't hold up the others or the sensor.
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_TEE_H_
+#define FPM_TEE_H_
+
+#include <Arduino.h>
+#include "fpm.h"
+
+/* Max number of consumers of each download */
+#ifndef FPM_TEE_MAX_CONSUMERS
+    #define FPM_TEE_MAX_CONSUMERS       4
+#endif
+
+/* A Stream to be handed to readDataPacket()/pollDataPacket(), which passes every chunk of the payload
+ * on to each of its consumers as it arrives, so the sensor only has to send it once.
+ *
+ * A consumer is either another Stream/Print (a display, a network client, an FPMImageWriter...),
+ * or a buffer that receives a plain copy. A Print consumer that can't keep up should take what it can
+ * and return the number of bytes it took, like most network clients do; the rest is queued in its ring buffer,
+ * if it has one, and passed on later by poll(). If that fills up, the consumer misses the rest of the download,
+ * but the others carry on. */
+class FPMTee : public Stream
+{
+    public:
+    FPMTee(void);
+
+    /** Adds a consumer, with an optional ring buffer of #ringSize bytes to absorb its stalls.
+     *  Returns FPMStatus::NO_FREE_INDEX if there are already FPM_TEE_MAX_CONSUMERS. */
+    FPMStatus addConsumer(Print * consumer, uint8_t * ring = NULL, uint16_t ringSize = 0);
+
+    /* Adds a buffer of #bufferSize bytes, into which the payload is copied, e.g. in PSRAM */
+    FPMStatus addConsumer(uint8_t * buffer, uint32_t bufferSize);
+
+    void removeAll(void);
+
+    /* Empties the queues and counters. Call it before each download. */
+    void begin(void);
+
+    /** Passes on queued bytes to the consumers that will take them.
+     *  Call it while downloading and afterwards, until it returns false. */
+    bool poll(void);
+
+    /** Call it after the download. Returns FPMStatus::PENDING while any bytes are still queued (keep calling poll()),
+     *  or FPMStatus::WRITE_ERROR if any consumer missed part of the download. */
+    FPMStatus end(void);
+
+    /* Bytes of the download received so far, and those that consumer #index missed */
+    uint32_t received(void);
+    uint32_t dropped(uint8_t index);
+
+    /* Stream interface */
+    size_t write(uint8_t c);
+    size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+    int peek(void) { return -1; }
+
+    private:
+    typedef struct {
+        Print * dest;
+
+        /* a plain copy, when there's no #dest */
+        uint8_t * copy;
+        uint32_t copySize;
+
+        /* queued bytes: #count of them, from #head, in #ring */
+        uint8_t * ring;
+        uint16_t ringSize;
+        uint16_t head;
+        uint16_t count;
+
+        uint32_t dropped;
+    } FPMTeeConsumer;
+
+    FPMTeeConsumer consumers[FPM_TEE_MAX_CONSUMERS];
+    uint8_t consumerCount;
+    uint32_t totalReceived;
+
+    void drain(FPMTeeConsumer * consumer);
+    void enqueue(FPMTeeConsumer * consumer, const uint8_t * buffer, size_t size);
+};
+
+#endif
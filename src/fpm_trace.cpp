@@ -0,0 +1,123 @@
+/***************************************************
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#include "fpm_trace.h"
+
+#include <Arduino.h>
+
+static_assert(FPM_TRACE_RECORD_SZ >= 1 && FPM_TRACE_RECORD_SZ <= FPM_TRACE_LENGTH_MASK + 1, "records hold up to 128 bytes");
+
+FPMTraceStream::FPMTraceStream(Stream * port, Print * trace) :
+    port(port), trace(trace), recordLen(0), recordWrite(false), recordStart(0), lastStart(0), written(0), dropped(0)
+{
+
+}
+
+void FPMTraceStream::begin(void)
+{
+    const uint8_t header[FPM_TRACE_MAGIC_LEN + 1] = { 'F', 'P', 'M', 'T', FPM_TRACE_VERSION };
+
+    recordLen = 0;
+    written = 0;
+    dropped = 0;
+
+    emit(header, sizeof(header));
+    lastStart = micros();
+}
+
+void FPMTraceStream::emit(const uint8_t * bytes, size_t len)
+{
+    size_t done = trace->write(bytes, len);
+
+    written += done;
+    dropped += len - done;
+}
+
+void FPMTraceStream::flushTrace(void)
+{
+    if (recordLen == 0) return;
+
+    /* the tag and the time since the last record, at most 5 bytes for 32 bits */
+    uint8_t head[1 + 5];
+    uint8_t headLen = 0;
+    uint32_t delta = recordStart - lastStart;
+
+    head[headLen++] = (recordWrite ? FPM_TRACE_WRITE : 0) | (recordLen - 1);
+
+    do {
+        uint8_t byte = delta & 0x7F;
+        delta >>= 7;
+        head[headLen++] = byte | ((delta != 0) ? 0x80 : 0);
+    } while (delta != 0);
+
+    emit(head, headLen);
+    emit(record, recordLen);
+
+    lastStart = recordStart;
+    recordLen = 0;
+}
+
+void FPMTraceStream::capture(const uint8_t * bytes, size_t len, bool toSensor)
+{
+    while (len != 0)
+    {
+        /* a new record for each change of direction, or when this one's full */
+        if (recordLen != 0 && (recordWrite != toSensor || recordLen == FPM_TRACE_RECORD_SZ)) {
+            flushTrace();
+        }
+
+        if (recordLen == 0) {
+            recordWrite = toSensor;
+            recordStart = micros();
+        }
+
+        uint8_t piece = min(len, (size_t)(FPM_TRACE_RECORD_SZ - recordLen));
+        memcpy(&record[recordLen], bytes, piece);
+
+        recordLen += piece;
+        bytes += piece;
+        len -= piece;
+    }
+}
+
+int FPMTraceStream::available(void)
+{
+    return port->available();
+}
+
+int FPMTraceStream::read(void)
+{
+    int c = port->read();
+
+    if (c >= 0) {
+        uint8_t byte = c;
+        capture(&byte, 1, false);
+    }
+
+    return c;
+}
+
+int FPMTraceStream::peek(void)
+{
+    return port->peek();
+}
+
+size_t FPMTraceStream::write(uint8_t c)
+{
+    return write(&c, 1);
+}
+
+size_t FPMTraceStream::write(const uint8_t * buffer, size_t size)
+{
+    size_t done = port->write(buffer, size);
+    capture(buffer, done, true);
+
+    return done;
+}
+
+void FPMTraceStream::flush(void)
+{
+    port->flush();
+}
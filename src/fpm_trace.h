@@ -0,0 +1,77 @@
+/***************************************************
+  Capture of all the traffic between an FPM object and its sensor, as a compact binary trace,
+  to be replayed later (see FPMReplayStream, in extras/emulator) when a unit in the field misbehaves.
+
+  Copyright (c) 2023, Brian Ejike <bcejike@gmail.com>
+  Distributed under the terms of the MIT license
+ ****************************************************/
+
+#ifndef FPM_TRACE_H_
+#define FPM_TRACE_H_
+
+#include <Arduino.h>
+#include "fpm.h"
+
+/* The trace starts with FPM_TRACE_MAGIC and FPM_TRACE_VERSION, followed by records of up to 128 bytes, each made up of:
+ *   - a tag: FPM_TRACE_WRITE if the bytes were written to the sensor (else they were read from it),
+ *     OR'ed with the number of bytes, minus 1
+ *   - the time in microseconds since the previous record began, as a varint (7 bits per byte, LSB first)
+ *   - the bytes themselves */
+#define FPM_TRACE_MAGIC             "FPMT"
+#define FPM_TRACE_MAGIC_LEN         4
+#define FPM_TRACE_VERSION           1
+
+#define FPM_TRACE_WRITE             0x80
+#define FPM_TRACE_LENGTH_MASK       0x7F
+
+/* Bytes gathered into a record before it's passed on to the trace; no more than 128.
+ * Consecutive bytes in the same direction share a record. */
+#ifndef FPM_TRACE_RECORD_SZ
+    #define FPM_TRACE_RECORD_SZ     32
+#endif
+
+/* A Stream that sits between an FPM object and its port, passing everything through,
+ * and recording it all to #trace as it goes.
+ * #trace can be any Print (a File, a network client, another UART...), but not the sensor's port. */
+class FPMTraceStream : public Stream
+{
+    public:
+    FPMTraceStream(Stream * port, Print * trace);
+
+    /* Writes the trace's header and starts the clock. Call it before handing this to FPM::begin() */
+    void begin(void);
+
+    /* Passes on the record in progress, e.g. before closing the trace */
+    void flushTrace(void);
+
+    /* Bytes of the trace written so far, and those #trace didn't take */
+    uint32_t traceLength(void) { return written; }
+    uint32_t traceDropped(void) { return dropped; }
+
+    /* Stream interface */
+    int available(void);
+    int read(void);
+    int peek(void);
+    size_t write(uint8_t c);
+    size_t write(const uint8_t * buffer, size_t size);
+    using Print::write;
+    void flush(void);
+
+    private:
+    Stream * port;
+    Print * trace;
+
+    uint8_t record[FPM_TRACE_RECORD_SZ];
+    uint8_t recordLen;
+    bool recordWrite;
+    uint32_t recordStart;
+    uint32_t lastStart;
+
+    uint32_t written;
+    uint32_t dropped;
+
+    void capture(const uint8_t * bytes, size_t len, bool toSensor);
+    void emit(const uint8_t * bytes, size_t len);
+};
+
+#endif